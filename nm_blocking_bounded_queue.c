@@ -9,10 +9,36 @@
  * 
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* clock_gettime */
+#endif
+
 #include <stddef.h> /* size_t, NULL */
-#include <stdlib.h> /* malloc, calloc, free */
+#include <stdlib.h> /* malloc, calloc, free, abort */
+#include <string.h> /* memcpy */
 #include <errno.h>
+#include <limits.h> /* INT_MAX, CHAR_BIT */
+
+#if defined(__linux__)
+#include <time.h> /* clock_gettime */
+#endif
+
+#if ((defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)) || (defined(_MSC_VER) && defined(_M_X64))
+#include <immintrin.h> /* SSE2, AVX2 (the vectorized ring scan) */
+#define NM_SCAN_X86_64
+#endif
+
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+#define NM_FILE_WINDOWS /* The spill files and the persistent queue files use the Win32 file API */
+#else
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap, msync, munmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h> /* pread, pwrite, ftruncate, close, unlink, sysconf */
+#endif
 
+#undef NM_BBQ_INLINE /* The library always exports the out-of-line (validating) functions */
+#define NM_BBQ_IMPLEMENTATION
 #include "nm_blocking_bounded_queue.h"
 
 
@@ -22,21 +48,207 @@
 
 #define MAX_SIZE_T ((size_t)-1)
 
-struct nm_queue
-{
-    void** items_;
-	size_t capacity_;
-	size_t head_;
-	size_t tail_;
-	size_t items_count_;
-};
-
 #define NM_QUEUE_INIT(queue_, init_size_) \
 	queue_->capacity_= init_size_; \
 	queue_->head_ = 0; \
 	queue_->tail_ = 0; \
 	queue_->items_count_ = 0;
 
+/* Copies count_ elements of a ring of capacity_ elements, starting at head_, to the beginning of dest_ (in up to 2 copies) */
+static void ring_copy_span(void* dest_, const void* ring_, size_t element_size_, size_t capacity_, size_t head_, size_t count_)
+{
+	size_t first_part = capacity_ - head_;
+
+	if(first_part > count_)
+	{
+		first_part = count_;
+	}
+
+	memcpy(dest_, (const char*)ring_ + head_ * element_size_, first_part * element_size_);
+	memcpy((char*)dest_ + first_part * element_size_, ring_, (count_ - first_part) * element_size_); /* The wrapped part */
+}
+
+
+/* Vectorized scan: */
+
+/* Every kernel returns count_ if the item was not found (find), or the number of its occurrences (count) */
+
+static size_t scan_find_scalar(void* const* items_, size_t count_, const void* item_)
+{
+	size_t i;
+
+	for(i = 0; i < count_ && items_[i] != item_; ++i);
+	return i;
+}
+
+static size_t scan_count_scalar(void* const* items_, size_t count_, const void* item_)
+{
+	size_t occurrences = 0;
+	size_t i;
+
+	for(i = 0; i < count_; ++i)
+	{
+		occurrences += items_[i] == item_;
+	}
+	return occurrences;
+}
+
+#if defined(NM_SCAN_X86_64)
+	#if defined(_MSC_VER)
+		#define NM_SCAN_TARGET_AVX2
+
+		static int scan_cpu_has_avx2(void)
+		{
+			int info[4];
+
+			__cpuid(info, 0);
+			if(info[0] < 7)
+			{
+				return 0;
+			}
+
+			__cpuid(info, 1);
+			if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) /* OSXSAVE, AVX, YMM state */
+			{
+				return 0;
+			}
+
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+		}
+	#else
+		#define NM_SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+
+		static int scan_cpu_has_avx2(void)
+		{
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+		}
+	#endif
+
+	/* SSE2 has no 64 bit compare - a pointer is equal if both its 32 bit halves are */
+	static __m128i scan_cmpeq_sse2(__m128i items_, __m128i key_)
+	{
+		__m128i halves_eq = _mm_cmpeq_epi32(items_, key_);
+
+		return _mm_and_si128(halves_eq, _mm_shuffle_epi32(halves_eq, _MM_SHUFFLE(2, 3, 0, 1)));
+	}
+
+	static size_t scan_find_sse2(void* const* items_, size_t count_, const void* item_)
+	{
+		__m128i key = _mm_set1_epi64x((long long)(size_t)item_);
+		__m128i eq;
+		size_t i;
+
+		for(i = 0; i + 4 <= count_; i += 4) /* 4 pointers per iteration, the matching block is rescanned by the scalar tail */
+		{
+			eq = _mm_or_si128(scan_cmpeq_sse2(_mm_loadu_si128((const __m128i*)(items_ + i)), key),
+			                  scan_cmpeq_sse2(_mm_loadu_si128((const __m128i*)(items_ + i + 2)), key));
+			if(_mm_movemask_epi8(eq) != 0)
+			{
+				break;
+			}
+		}
+
+		return i + scan_find_scalar(items_ + i, count_ - i, item_);
+	}
+
+	static size_t scan_count_sse2(void* const* items_, size_t count_, const void* item_)
+	{
+		__m128i key = _mm_set1_epi64x((long long)(size_t)item_);
+		__m128i occurrences = _mm_setzero_si128();
+		nm_uint64_t lanes[2];
+		size_t i;
+
+		for(i = 0; i + 2 <= count_; i += 2)
+		{
+			occurrences = _mm_sub_epi64(occurrences, scan_cmpeq_sse2(_mm_loadu_si128((const __m128i*)(items_ + i)), key)); /* -1 per match */
+		}
+
+		_mm_storeu_si128((__m128i*)lanes, occurrences);
+		return (size_t)(lanes[0] + lanes[1]) + scan_count_scalar(items_ + i, count_ - i, item_);
+	}
+
+	NM_SCAN_TARGET_AVX2 static size_t scan_find_avx2(void* const* items_, size_t count_, const void* item_)
+	{
+		__m256i key = _mm256_set1_epi64x((long long)(size_t)item_);
+		__m256i eq;
+		size_t i;
+
+		for(i = 0; i + 8 <= count_; i += 8)
+		{
+			eq = _mm256_or_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(items_ + i)), key),
+			                     _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(items_ + i + 4)), key));
+			if(!_mm256_testz_si256(eq, eq))
+			{
+				break;
+			}
+		}
+
+		return i + scan_find_scalar(items_ + i, count_ - i, item_);
+	}
+
+	NM_SCAN_TARGET_AVX2 static size_t scan_count_avx2(void* const* items_, size_t count_, const void* item_)
+	{
+		__m256i key = _mm256_set1_epi64x((long long)(size_t)item_);
+		__m256i occurrences = _mm256_setzero_si256();
+		nm_uint64_t lanes[4];
+		size_t i;
+
+		for(i = 0; i + 4 <= count_; i += 4)
+		{
+			occurrences = _mm256_sub_epi64(occurrences, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(items_ + i)), key));
+		}
+
+		_mm256_storeu_si256((__m256i*)lanes, occurrences);
+		return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + scan_count_scalar(items_ + i, count_ - i, item_);
+	}
+#endif
+
+typedef enum scan_level
+{
+	SCAN_UNKNOWN, /* Detected on the first scan */
+	SCAN_SCALAR,
+	SCAN_SSE2,
+	SCAN_AVX2
+} scan_level;
+
+static nm_atomic_int_t scan_selected_level;
+
+static scan_level scan_get_level(void)
+{
+	nm_atomic_int_t level = NM_ATOMIC_INT_LOAD_RELAXED(&scan_selected_level);
+
+	if(level == SCAN_UNKNOWN) /* Threads that race here detect the same level */
+	{
+#if defined(NM_SCAN_X86_64)
+		level = scan_cpu_has_avx2() ? SCAN_AVX2 : SCAN_SSE2; /* SSE2 is a part of x86-64 */
+#else
+		level = SCAN_SCALAR;
+#endif
+		NM_ATOMIC_INT_STORE(&scan_selected_level, level);
+	}
+
+	return (scan_level)level;
+}
+
+/* Scans a contiguous span of a ring with the best kernel of the CPU */
+static size_t scan_span(void* const* items_, size_t count_, const void* item_, int is_find_)
+{
+	switch(scan_get_level())
+	{
+#if defined(NM_SCAN_X86_64)
+	case SCAN_AVX2:
+		return is_find_ ? scan_find_avx2(items_, count_, item_) : scan_count_avx2(items_, count_, item_);
+
+	case SCAN_SSE2:
+		return is_find_ ? scan_find_sse2(items_, count_, item_) : scan_count_sse2(items_, count_, item_);
+#endif
+	default:
+		return is_find_ ? scan_find_scalar(items_, count_, item_) : scan_count_scalar(items_, count_, item_);
+	}
+}
+
 
 /* ---------------------------------- nm_queue main API functions implementation ---------------------------------- */
 
@@ -136,6 +348,39 @@ nm_queue_status nm_queue_dequeue(nm_queue* queue_, void** item_ptr_)
 }
 
 
+size_t nm_queue_dequeue_n(nm_queue* queue_, void** items_, size_t max_items_)
+{
+	size_t count;
+	size_t first_part;
+
+	if(!queue_ || (!items_ && max_items_ > 0))
+	{
+		return MAX_SIZE_T;
+	}
+
+	count = queue_->items_count_ < max_items_ ? queue_->items_count_ : max_items_;
+	ring_copy_span(items_, queue_->items_, sizeof(void*), queue_->capacity_, queue_->head_, count);
+
+	first_part = queue_->capacity_ - queue_->head_;
+	if(first_part > count)
+	{
+		first_part = count;
+	}
+
+	memset(queue_->items_ + queue_->head_, 0, first_part * sizeof(void*)); /* Like nm_queue_dequeue, leaves no stale items */
+	memset(queue_->items_, 0, (count - first_part) * sizeof(void*));
+
+	queue_->head_ += count;
+	if(queue_->head_ >= queue_->capacity_)
+	{
+		queue_->head_ -= queue_->capacity_;
+	}
+	queue_->items_count_ -= count;
+
+	return count;
+}
+
+
 int nm_queue_is_empty(nm_queue* queue_)
 {
 	if(!queue_)
@@ -158,6 +403,38 @@ size_t nm_queue_capacity(nm_queue* queue_)
 }
 
 
+nm_queue_status nm_queue_resize(nm_queue* queue_, size_t new_capacity_)
+{
+	void** items;
+
+	if(!queue_ || new_capacity_ == 0)
+	{
+		return NM_QUEUE_UNINITIALIZED_ERROR;
+	}
+
+	if(queue_->items_count_ > new_capacity_)
+	{
+		return NM_QUEUE_OVERFLOW_ERROR;
+	}
+
+	items = (void**)calloc(new_capacity_, sizeof(void*)); /* The free slots must be NULLs, like in nm_queue_create */
+	if(!items)
+	{
+		return NM_QUEUE_ALLOCATION_ERROR;
+	}
+
+	ring_copy_span(items, queue_->items_, sizeof(void*), queue_->capacity_, queue_->head_, queue_->items_count_);
+	free(queue_->items_);
+
+	queue_->items_ = items;
+	queue_->capacity_ = new_capacity_;
+	queue_->head_ = 0;
+	queue_->tail_ = queue_->items_count_ % new_capacity_;
+
+	return NM_QUEUE_SUCCESS;
+}
+
+
 size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* context_)
 {
     size_t item_idx;
@@ -173,9 +450,9 @@ size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* cont
     queue_capacity = queue_->capacity_;
     item_idx = queue_->head_;
 
-    while(items_left-- > 0)
+    while(items_left > 0)
     {
-
+        --items_left; /* Before the callback, so an early stop still counts the current item */
         if(callback_(queue_->items_[item_idx++], context_) == 0)
         {
             break;
@@ -186,6 +463,42 @@ size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* cont
     return queue_->items_count_ - items_left; /* Calculates the total iterated items (1..N) */
 }
 
+size_t nm_queue_find(nm_queue* queue_, const void* item_)
+{
+	size_t first_part;
+	size_t position;
+
+	if(!queue_)
+	{
+		return MAX_SIZE_T;
+	}
+
+	/* The items are split in 2 spans where the ring wraps: [head, capacity) and [0, the rest) */
+	first_part = queue_->capacity_ - queue_->head_ < queue_->items_count_ ? queue_->capacity_ - queue_->head_ : queue_->items_count_;
+	position = scan_span(queue_->items_ + queue_->head_, first_part, item_, 1);
+	if(position == first_part)
+	{
+		position += scan_span(queue_->items_, queue_->items_count_ - first_part, item_, 1);
+	}
+
+	return position < queue_->items_count_ ? position : MAX_SIZE_T;
+}
+
+
+size_t nm_queue_count_eq(nm_queue* queue_, const void* item_)
+{
+	size_t first_part;
+
+	if(!queue_)
+	{
+		return MAX_SIZE_T;
+	}
+
+	first_part = queue_->capacity_ - queue_->head_ < queue_->items_count_ ? queue_->capacity_ - queue_->head_ : queue_->items_count_;
+	return scan_span(queue_->items_ + queue_->head_, first_part, item_, 0)
+	       + scan_span(queue_->items_, queue_->items_count_ - first_part, item_, 0);
+}
+
 /* ------------------------------- End of nm_queue main API functions implementation --------------------------- */
 
 /* ------------------------------------------- End of Underlying queue ----------------------------------------- */
@@ -193,6 +506,29 @@ size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* cont
 
 /* ----------------------------------------------- Sync utils: ------------------------------------------------- */
 
+#define DEADLINE_NEVER ((nm_uint64_t)-1)
+
+#if defined(_MSC_VER)
+#define NM_THREAD_LOCAL __declspec(thread)
+#else
+#define NM_THREAD_LOCAL __thread
+#endif
+
+static void epoch_thread_exit(void); /* Called on the exit of a thread that is registered for epoch reclamation */
+
+#define CACHE_LINE_SIZE 64
+#define SPIN_LIMIT 128 /* Busy-wait iterations before a spinning thread starts yielding its CPU */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(_MSC_VER)
+#define CPU_RELAX() YieldProcessor()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()
+#endif
+
 #if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
 	static int errno_set(int result)
 	{
@@ -373,117 +709,6208 @@ size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* cont
 		*sem_ = NULL;
 		return 0;
 	}
-#elif defined(__linux__)
-	#include <semaphore.h>
-#else
-    #error Environment not supported
-#endif
 
+	#pragma comment(lib, "Synchronization.lib") /* WaitOnAddress, WakeByAddressSingle, WakeByAddressAll */
 
-struct nm_mutex_t
-{
-	sem_t lock_;
-};
-
-int nm_mutex_init(nm_mutex_t* mtx_)
-{
-	return sem_init(&mtx_->lock_, 0, 1);
-}
-
-int nm_mutex_destroy(nm_mutex_t* mtx_)
-{
-	return sem_destroy(&mtx_->lock_);
-}
+	/* Waits while *addr_ == expected_, returns -1 if the deadline has passed, 0 otherwise (woken up / value changed / spurious) */
+	static int futex_wait(volatile nm_atomic_int_t* addr_, nm_atomic_int_t expected_, nm_uint64_t deadline_ns_)
+	{
+		nm_uint64_t now;
+		DWORD wait_ms = INFINITE;
 
-void nm_mutex_lock(nm_mutex_t* mtx_)
-{
-	sem_wait(&mtx_->lock_);
-}
+		if(deadline_ns_ != DEADLINE_NEVER)
+		{
+			now = nm_time_now_ns();
+			if(now >= deadline_ns_)
+			{
+				return -1;
+			}
 
-void nm_mutex_unlock(nm_mutex_t* mtx_)
-{
-	sem_post(&mtx_->lock_);
-}
+			wait_ms = (DWORD)((deadline_ns_ - now + 999999) / 1000000);
+		}
 
+		if(!WaitOnAddress((volatile VOID*)addr_, &expected_, sizeof(expected_), wait_ms))
+		{
+			return GetLastError() == ERROR_TIMEOUT ? -1 : 0;
+		}
 
-struct nm_barrier_t
-{
-	unsigned int max_threads_count_;
-	unsigned int waiting_threads_count_;
-	nm_mutex_t mtx_;
-	sem_t turnstile_;
-};
+		return 0;
+	}
 
+	static void thread_yield(void)
+	{
+		SwitchToThread();
+	}
 
-int nm_barrier_init(nm_barrier_t* barrier_, unsigned int threads_count_)
-{
-	barrier_->max_threads_count_ = threads_count_;
-	barrier_->waiting_threads_count_ = 0;
+	static DWORD thread_exit_fls_index = FLS_OUT_OF_INDEXES;
+	static INIT_ONCE thread_exit_once = INIT_ONCE_STATIC_INIT;
 
-	if(nm_mutex_init(&barrier_->mtx_) != 0)
+	static void NTAPI thread_exit_fls_callback(void* value_)
 	{
-		return -1;
+		if(value_)
+		{
+			epoch_thread_exit();
+		}
 	}
 
-	if(sem_init(&barrier_->turnstile_, 0, 0) != 0)
+	static BOOL CALLBACK thread_exit_fls_init(PINIT_ONCE once_, void* parameter_, void** context_)
 	{
-		nm_mutex_destroy(&barrier_->mtx_);
-		return -1;
+		(void)once_;
+		(void)parameter_;
+		(void)context_;
+		thread_exit_fls_index = FlsAlloc(thread_exit_fls_callback);
+		return thread_exit_fls_index != FLS_OUT_OF_INDEXES;
 	}
 
-	return 0;
-}
-
+	/* Arranges for epoch_thread_exit to run when the calling thread exits (a NULL value_ cancels it), returns 0 on success */
+	static int watch_thread_exit(void* value_)
+	{
+		if(!InitOnceExecuteOnce(&thread_exit_once, thread_exit_fls_init, NULL, NULL))
+		{
+			return -1;
+		}
 
-int nm_barrier_destroy(nm_barrier_t* barrier_)
-{
-	return nm_mutex_destroy(&barrier_->mtx_) && sem_destroy(&barrier_->turnstile_);
-}
+		return FlsSetValue(thread_exit_fls_index, value_) ? 0 : -1;
+	}
 
+	/* Returns the NUMA node of the CPU the calling thread currently runs on */
+	static unsigned int current_numa_node(void)
+	{
+		PROCESSOR_NUMBER processor;
+		USHORT node;
 
-void nm_barrier_wait(nm_barrier_t* barrier_)
-{
-	unsigned int i, max_threads;
-	nm_mutex_lock(&barrier_->mtx_);
+		GetCurrentProcessorNumberEx(&processor);
+		return GetNumaProcessorNodeEx(&processor, &node) ? (unsigned int)node : 0;
+	}
 
-	if(++barrier_->waiting_threads_count_ == barrier_->max_threads_count_)
+	/* Wakes up to count_ threads that wait on addr_ */
+	static void futex_wake(volatile nm_atomic_int_t* addr_, int count_)
 	{
-		max_threads = barrier_->max_threads_count_;
-		for(i = 0; i < max_threads; ++i)
+		if(count_ == INT_MAX)
 		{
-			sem_post(&barrier_->turnstile_);
+			WakeByAddressAll((PVOID)addr_);
+			return;
+		}
+
+		while(count_-- > 0)
+		{
+			WakeByAddressSingle((PVOID)addr_);
 		}
 	}
 
-	nm_mutex_unlock(&barrier_->mtx_);
-	sem_wait(&barrier_->turnstile_);
-}
+	nm_uint64_t nm_time_now_ns(void)
+	{
+		static LARGE_INTEGER frequency;
+		LARGE_INTEGER counter;
 
-/* --------------------------------------------- End of Sync utils ----------------------------------------------- */
+		if(frequency.QuadPart == 0)
+		{
+			QueryPerformanceFrequency(&frequency);
+		}
 
-/* Blocking Bounded Queue: */
+		QueryPerformanceCounter(&counter);
+		return (nm_uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL
+			+ (nm_uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / (nm_uint64_t)frequency.QuadPart;
+	}
 
-/* Underlying queue defines: */
+	typedef struct thread_start_args
+	{
+		nm_thread_routine routine_;
+		void* arg_;
+	} thread_start_args;
 
-typedef nm_queue queue_type; /* TODO: implement a nm_deque class (using 2 nm_vectors (Map) (back and forward growing) and nm_queue (pointed fixed sized queues)) */
-#define ENQUEUE(queue_, item_) nm_queue_enqueue(queue_, item_)
-#define DEQUEUE(queue_, item_ptr_) nm_queue_dequeue(queue_, item_ptr_)
-#define SIZE(queue_) nm_queue_capacity(queue_)
-#define IS_EMPTY(queue_) nm_queue_is_empty(queue_)
+	static DWORD WINAPI thread_trampoline(LPVOID args_)
+	{
+		thread_start_args args = *(thread_start_args*)args_;
 
-/* Defines: */
+		free(args_);
+		args.routine_(args.arg_);
+		return 0;
+	}
 
-struct nm_blocking_bounded_queue
-{
-    queue_type queue_;
-    nm_mutex_t mtx_;
-    sem_t free_slots_;
-    sem_t occupied_slots_;
-    nm_barrier_t enq_waiters_barrier_;
-    nm_barrier_t deq_waiters_barrier_;
-    nm_atomic_value_t enq_waiters_;
-    nm_atomic_value_t deq_waiters_;
-    nm_atomic_flag_t is_valid_;
+	int nm_thread_create(nm_thread_t* thread_, nm_thread_routine routine_, void* arg_)
+	{
+		thread_start_args* args;
+
+		if(!thread_ || !routine_ || !(args = (thread_start_args*)malloc(sizeof(thread_start_args))))
+		{
+			return -1;
+		}
+
+		args->routine_ = routine_;
+		args->arg_ = arg_;
+		if(!(*thread_ = CreateThread(NULL, 0, thread_trampoline, args, 0, NULL)))
+		{
+			free(args);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	int nm_thread_join(nm_thread_t* thread_)
+	{
+		if(!thread_ || WaitForSingleObject(*thread_, INFINITE) != WAIT_OBJECT_0)
+		{
+			return -1;
+		}
+
+		CloseHandle(*thread_);
+		return 0;
+	}
+#elif defined(__linux__)
+	#include <semaphore.h>
+
+	#include <linux/futex.h> /* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+	#include <sys/syscall.h> /* SYS_futex */
+	#include <unistd.h> /* syscall */
+	#include <sched.h> /* sched_yield, getcpu */
+
+	/* Waits while *addr_ == expected_, returns -1 if the deadline has passed, 0 otherwise (woken up / value changed / spurious) */
+	static int futex_wait(volatile nm_atomic_int_t* addr_, nm_atomic_int_t expected_, nm_uint64_t deadline_ns_)
+	{
+		struct timespec timeout;
+		nm_uint64_t now;
+
+		if(deadline_ns_ == DEADLINE_NEVER)
+		{
+			syscall(SYS_futex, addr_, FUTEX_WAIT_PRIVATE, expected_, NULL, NULL, 0);
+			return 0;
+		}
+
+		now = nm_time_now_ns();
+		if(now >= deadline_ns_)
+		{
+			return -1;
+		}
+
+		timeout.tv_sec = (time_t)((deadline_ns_ - now) / 1000000000ULL); /* FUTEX_WAIT takes a relative CLOCK_MONOTONIC timeout */
+		timeout.tv_nsec = (long)((deadline_ns_ - now) % 1000000000ULL);
+		if(syscall(SYS_futex, addr_, FUTEX_WAIT_PRIVATE, expected_, &timeout, NULL, 0) != 0 && errno == ETIMEDOUT)
+		{
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* Wakes up to count_ threads that wait on addr_ */
+	static void futex_wake(volatile nm_atomic_int_t* addr_, int count_)
+	{
+		syscall(SYS_futex, addr_, FUTEX_WAKE_PRIVATE, count_, NULL, NULL, 0);
+	}
+
+	static void thread_yield(void)
+	{
+		sched_yield();
+	}
+
+	static pthread_key_t thread_exit_key;
+	static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+	static int thread_exit_key_result;
+
+	static void thread_exit_destructor(void* value_)
+	{
+		(void)value_; /* Thread local variables are still valid in key destructors */
+		epoch_thread_exit();
+	}
+
+	static void thread_exit_key_init(void)
+	{
+		thread_exit_key_result = pthread_key_create(&thread_exit_key, thread_exit_destructor);
+	}
+
+	/* Arranges for epoch_thread_exit to run when the calling thread exits (a NULL value_ cancels it), returns 0 on success */
+	static int watch_thread_exit(void* value_)
+	{
+		if(pthread_once(&thread_exit_once, thread_exit_key_init) != 0 || thread_exit_key_result != 0)
+		{
+			return -1;
+		}
+
+		return pthread_setspecific(thread_exit_key, value_) == 0 ? 0 : -1;
+	}
+
+	/* Returns the NUMA node of the CPU the calling thread currently runs on */
+	static unsigned int current_numa_node(void)
+	{
+		unsigned int cpu;
+		unsigned int node;
+
+	#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+		if(getcpu(&cpu, &node) != 0) /* Served by the vDSO where available */
+	#else
+		if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+	#endif
+		{
+			return 0;
+		}
+
+		return node;
+	}
+
+	static NM_THREAD_LOCAL nm_atomic_int_t cached_tid;
+
+	/* Returns the kernel thread id of the calling thread (the owner value of a priority-inheritance futex) */
+	static nm_atomic_int_t current_tid(void)
+	{
+		if(cached_tid == 0)
+		{
+			cached_tid = (nm_atomic_int_t)syscall(SYS_gettid);
+		}
+
+		return cached_tid;
+	}
+
+	/* Priority-inheritance futex lock: the kernel boosts the owner to the priority of its highest priority waiter */
+	static void futex_lock_pi(volatile nm_atomic_int_t* addr_)
+	{
+		if(NM_ATOMIC_INT_CAS(addr_, 0, current_tid()) == 0)
+		{
+			return;
+		}
+
+		while(syscall(SYS_futex, addr_, FUTEX_LOCK_PI_PRIVATE, 0, NULL, NULL, 0) != 0)
+		{
+			if(errno == EAGAIN) /* The owner is exiting - the kernel hands the futex over once it is gone */
+			{
+				thread_yield();
+			}
+			else if(errno != EINTR)
+			{
+				/* EDEADLK, ENOMEM, ... - the lock is not held, and the caller cannot be told (nm_mutex_lock never fails),
+				   so going on would silently break the mutual exclusion */
+				abort();
+			}
+		}
+	}
+
+	static void futex_unlock_pi(volatile nm_atomic_int_t* addr_)
+	{
+		nm_atomic_int_t tid = current_tid();
+
+		if(NM_ATOMIC_INT_CAS(addr_, tid, 0) == tid)
+		{
+			return;
+		}
+
+		syscall(SYS_futex, addr_, FUTEX_UNLOCK_PI_PRIVATE, 0, NULL, NULL, 0); /* There are waiters (FUTEX_WAITERS is set) */
+	}
+
+	nm_uint64_t nm_time_now_ns(void)
+	{
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (nm_uint64_t)now.tv_sec * 1000000000ULL + (nm_uint64_t)now.tv_nsec;
+	}
+
+	typedef struct thread_start_args
+	{
+		nm_thread_routine routine_;
+		void* arg_;
+	} thread_start_args;
+
+	static void* thread_trampoline(void* args_)
+	{
+		thread_start_args args = *(thread_start_args*)args_;
+
+		free(args_);
+		args.routine_(args.arg_);
+		return NULL;
+	}
+
+	int nm_thread_create(nm_thread_t* thread_, nm_thread_routine routine_, void* arg_)
+	{
+		thread_start_args* args;
+
+		if(!thread_ || !routine_ || !(args = (thread_start_args*)malloc(sizeof(thread_start_args))))
+		{
+			return -1;
+		}
+
+		args->routine_ = routine_;
+		args->arg_ = arg_;
+		if(pthread_create(thread_, NULL, thread_trampoline, args) != 0)
+		{
+			free(args);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	int nm_thread_join(nm_thread_t* thread_)
+	{
+		if(!thread_ || pthread_join(*thread_, NULL) != 0)
+		{
+			return -1;
+		}
+
+		return 0;
+	}
+#else
+    #error Environment not supported
+#endif
+
+
+#define MUTEX_UNLOCKED 0
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2 /* Locked, and other threads may wait for it */
+
+struct nm_mutex_t
+{
+	nm_atomic_int_t state_; /* The futex word (the owner's thread id in priority-inheritance mode) */
+	int is_pi_;
+};
+
+int nm_mutex_init(nm_mutex_t* mtx_)
+{
+	if(!mtx_)
+	{
+		return -1;
+	}
+
+	NM_ATOMIC_INT_STORE(&mtx_->state_, MUTEX_UNLOCKED);
+	mtx_->is_pi_ = 0;
+	return 0;
+}
+
+int nm_mutex_init_pi(nm_mutex_t* mtx_)
+{
+#if defined(__linux__)
+	if(nm_mutex_init(mtx_) != 0)
+	{
+		return -1;
+	}
+
+	mtx_->is_pi_ = 1;
+	return 0;
+#else
+	UNUSED(mtx_);
+	return -1;
+#endif
+}
+
+int nm_mutex_destroy(nm_mutex_t* mtx_)
+{
+	return mtx_ && NM_ATOMIC_INT_LOAD(&mtx_->state_) == MUTEX_UNLOCKED ? 0 : -1;
+}
+
+/* Locks the mutex as contended - the unlocking thread will wake the next waiter */
+static int mutex_lock_contended(nm_mutex_t* mtx_, nm_uint64_t deadline_ns_)
+{
+	while(NM_ATOMIC_INT_EXCHANGE(&mtx_->state_, MUTEX_CONTENDED) != MUTEX_UNLOCKED)
+	{
+		if(futex_wait(&mtx_->state_, MUTEX_CONTENDED, deadline_ns_) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void nm_mutex_lock(nm_mutex_t* mtx_)
+{
+#if defined(__linux__)
+	if(mtx_->is_pi_)
+	{
+		futex_lock_pi(&mtx_->state_);
+		return;
+	}
+#endif
+
+	if(NM_ATOMIC_INT_CAS(&mtx_->state_, MUTEX_UNLOCKED, MUTEX_LOCKED) != MUTEX_UNLOCKED)
+	{
+		mutex_lock_contended(mtx_, DEADLINE_NEVER);
+	}
+}
+
+void nm_mutex_unlock(nm_mutex_t* mtx_)
+{
+#if defined(__linux__)
+	if(mtx_->is_pi_)
+	{
+		futex_unlock_pi(&mtx_->state_);
+		return;
+	}
+#endif
+
+	if(NM_ATOMIC_INT_EXCHANGE(&mtx_->state_, MUTEX_UNLOCKED) == MUTEX_CONTENDED)
+	{
+		futex_wake(&mtx_->state_, 1);
+	}
+}
+
+int nm_mutex_trylock(nm_mutex_t* mtx_)
+{
+#if defined(__linux__)
+	if(mtx_->is_pi_)
+	{
+		return NM_ATOMIC_INT_CAS(&mtx_->state_, MUTEX_UNLOCKED, current_tid()) == MUTEX_UNLOCKED;
+	}
+#endif
+
+	return NM_ATOMIC_INT_CAS(&mtx_->state_, MUTEX_UNLOCKED, MUTEX_LOCKED) == MUTEX_UNLOCKED;
+}
+
+
+struct nm_cond_t
+{
+	nm_atomic_int_t seq_; /* The futex word - advanced by every signal and broadcast */
+	nm_atomic_int_t waiters_;
+	nm_mutex_t* mtx_; /* The mutex of the waiters - the requeue target of a broadcast */
+};
+
+int nm_cond_init(nm_cond_t* cond_)
+{
+	if(!cond_)
+	{
+		return -1;
+	}
+
+	NM_ATOMIC_INT_STORE(&cond_->seq_, 0);
+	NM_ATOMIC_INT_STORE(&cond_->waiters_, 0);
+	cond_->mtx_ = NULL;
+	return 0;
+}
+
+int nm_cond_destroy(nm_cond_t* cond_)
+{
+	return cond_ && NM_ATOMIC_INT_LOAD(&cond_->waiters_) == 0 ? 0 : -1;
+}
+
+void nm_cond_wait(nm_cond_t* cond_, nm_mutex_t* mtx_)
+{
+	nm_cond_wait_until(cond_, mtx_, DEADLINE_NEVER);
+}
+
+int nm_cond_wait_until(nm_cond_t* cond_, nm_mutex_t* mtx_, nm_uint64_t deadline_ns_)
+{
+	nm_atomic_int_t seq;
+	int result;
+
+	cond_->mtx_ = mtx_;
+	NM_ATOMIC_INT_FETCH_ADD(&cond_->waiters_, 1);
+	seq = NM_ATOMIC_INT_LOAD(&cond_->seq_);
+	nm_mutex_unlock(mtx_);
+
+	result = futex_wait(&cond_->seq_, seq, deadline_ns_);
+
+	/* The waiter may have been requeued onto the mutex, so it locks it as contended to keep the wakeup chain going */
+	if(mtx_->is_pi_)
+	{
+		nm_mutex_lock(mtx_);
+	}
+	else
+	{
+		mutex_lock_contended(mtx_, DEADLINE_NEVER);
+	}
+	NM_ATOMIC_INT_FETCH_ADD(&cond_->waiters_, -1);
+	return result;
+}
+
+void nm_cond_signal(nm_cond_t* cond_)
+{
+	NM_ATOMIC_INT_FETCH_ADD(&cond_->seq_, 1);
+	if(NM_ATOMIC_INT_LOAD(&cond_->waiters_) > 0)
+	{
+		futex_wake(&cond_->seq_, 1);
+	}
+}
+
+void nm_cond_broadcast(nm_cond_t* cond_)
+{
+	nm_atomic_int_t seq = NM_ATOMIC_INT_FETCH_ADD(&cond_->seq_, 1) + 1;
+
+	if(NM_ATOMIC_INT_LOAD(&cond_->waiters_) == 0)
+	{
+		return;
+	}
+
+#if defined(__linux__)
+	if(cond_->mtx_->is_pi_) /* A priority-inheritance futex cannot be a plain requeue target */
+	{
+		futex_wake(&cond_->seq_, INT_MAX);
+		return;
+	}
+
+	/* Wakes one waiter, and moves all the others to the mutex futex (fails if another signal has raced with this one) */
+	while(syscall(SYS_futex, &cond_->seq_, FUTEX_CMP_REQUEUE_PRIVATE, 1, (long)INT_MAX, &cond_->mtx_->state_, seq) < 0 && errno == EAGAIN)
+	{
+		seq = NM_ATOMIC_INT_LOAD(&cond_->seq_);
+	}
+#else
+	UNUSED(seq);
+	futex_wake(&cond_->seq_, INT_MAX);
+#endif
+}
+
+
+struct nm_barrier_t
+{
+	nm_atomic_int_t phase_; /* The futex word - advanced when the last expected thread arrives */
+	nm_atomic_int_t remaining_; /* Arrivals that are still missing in the current phase */
+	nm_atomic_int_t expected_; /* Participants of each phase */
+	nm_atomic_int_t dropped_; /* Participants that leave once the current phase completes */
 };
 
-/* TODO: implement the BBQ main API function */
+
+int nm_barrier_init(nm_barrier_t* barrier_, unsigned int threads_count_)
+{
+	if(!barrier_ || threads_count_ == 0 || threads_count_ > (unsigned int)INT_MAX)
+	{
+		return -1;
+	}
+
+	NM_ATOMIC_INT_STORE(&barrier_->phase_, 0);
+	NM_ATOMIC_INT_STORE(&barrier_->remaining_, (nm_atomic_int_t)threads_count_);
+	NM_ATOMIC_INT_STORE(&barrier_->expected_, (nm_atomic_int_t)threads_count_);
+	NM_ATOMIC_INT_STORE(&barrier_->dropped_, 0);
+	return 0;
+}
+
+
+int nm_barrier_destroy(nm_barrier_t* barrier_)
+{
+	return barrier_ ? 0 : -1;
+}
+
+
+nm_barrier_token nm_barrier_arrive(nm_barrier_t* barrier_)
+{
+	nm_atomic_int_t phase = NM_ATOMIC_INT_LOAD(&barrier_->phase_);
+	nm_atomic_int_t expected;
+
+	if(NM_ATOMIC_INT_FETCH_ADD(&barrier_->remaining_, -1) == 1) /* The last arrival completes the phase */
+	{
+		expected = NM_ATOMIC_INT_LOAD(&barrier_->expected_) - NM_ATOMIC_INT_EXCHANGE(&barrier_->dropped_, 0);
+		NM_ATOMIC_INT_STORE(&barrier_->expected_, expected);
+		NM_ATOMIC_INT_STORE(&barrier_->remaining_, expected);
+		NM_ATOMIC_INT_FETCH_ADD(&barrier_->phase_, 1);
+		futex_wake(&barrier_->phase_, INT_MAX);
+	}
+
+	return (nm_barrier_token)phase;
+}
+
+
+nm_barrier_token nm_barrier_arrive_and_drop(nm_barrier_t* barrier_)
+{
+	NM_ATOMIC_INT_FETCH_ADD(&barrier_->dropped_, 1);
+	return nm_barrier_arrive(barrier_);
+}
+
+
+void nm_barrier_wait_phase(nm_barrier_t* barrier_, nm_barrier_token token_)
+{
+	nm_barrier_wait_until(barrier_, token_, DEADLINE_NEVER);
+}
+
+
+int nm_barrier_wait_until(nm_barrier_t* barrier_, nm_barrier_token token_, nm_uint64_t deadline_ns_)
+{
+	while(NM_ATOMIC_INT_LOAD(&barrier_->phase_) == (nm_atomic_int_t)token_)
+	{
+		if(futex_wait(&barrier_->phase_, (nm_atomic_int_t)token_, deadline_ns_) != 0)
+		{
+			return NM_ATOMIC_INT_LOAD(&barrier_->phase_) == (nm_atomic_int_t)token_ ? -1 : 0;
+		}
+	}
+
+	return 0;
+}
+
+
+void nm_barrier_wait(nm_barrier_t* barrier_)
+{
+	nm_barrier_wait_phase(barrier_, nm_barrier_arrive(barrier_));
+}
+
+#define SEMAPHORE_MIXED_WAITERS (-1) /* Waiters asked for different unit counts - every release wakes all of them */
+
+struct nm_semaphore_t
+{
+	nm_atomic_int_t value_; /* The futex word */
+	nm_atomic_int_t waiters_;
+	nm_atomic_int_t waiter_units_; /* The units that every current waiter asked for (0 - no waiter), or SEMAPHORE_MIXED_WAITERS */
+};
+
+
+/* Records the units of a new waiter: a single wakeup is enough only while all the waiters ask for the same units -
+   a woken waiter that asks for more than a sleeping one would go back to sleep, and the wakeup would be lost */
+static void semaphore_register_units(nm_semaphore_t* sem_, unsigned int n_)
+{
+	nm_atomic_int_t units = NM_ATOMIC_INT_LOAD(&sem_->waiter_units_);
+
+	while(units != (nm_atomic_int_t)n_ && units != SEMAPHORE_MIXED_WAITERS)
+	{
+		units = NM_ATOMIC_INT_CAS(&sem_->waiter_units_, units, units == 0 ? (nm_atomic_int_t)n_ : SEMAPHORE_MIXED_WAITERS);
+	}
+}
+
+
+static int semaphore_acquire(nm_semaphore_t* sem_, unsigned int n_, nm_uint64_t deadline_ns_)
+{
+	nm_atomic_int_t value;
+	int is_timed_out;
+
+	if(n_ > (unsigned int)INT_MAX)
+	{
+		return -1; /* More than a semaphore can ever hold */
+	}
+
+	for(;;)
+	{
+		value = NM_ATOMIC_INT_LOAD(&sem_->value_);
+		if(value >= (nm_atomic_int_t)n_)
+		{
+			if(NM_ATOMIC_INT_CAS(&sem_->value_, value, value - (nm_atomic_int_t)n_) == value)
+			{
+				return 0;
+			}
+
+			continue;
+		}
+
+		semaphore_register_units(sem_, n_); /* Before the waiter is counted, so a release that counts it sees its units */
+		NM_ATOMIC_INT_FETCH_ADD(&sem_->waiters_, 1);
+		semaphore_register_units(sem_, n_); /* Again once counted - the last leaving waiter may have reset the units meanwhile */
+		value = NM_ATOMIC_INT_LOAD(&sem_->value_); /* Re-checks after registering, a release may have missed this waiter */
+		is_timed_out = value < (nm_atomic_int_t)n_ && futex_wait(&sem_->value_, value, deadline_ns_) != 0;
+		if(NM_ATOMIC_INT_FETCH_ADD(&sem_->waiters_, -1) == 1)
+		{
+			/* The last waiter leaves: the next waiters start over with single wakeups. A waiter that registered before
+			   the reset, and was counted before the check, is covered by the mixed marker - one counted after it
+			   registers again */
+			NM_ATOMIC_INT_STORE(&sem_->waiter_units_, 0);
+			if(NM_ATOMIC_INT_LOAD(&sem_->waiters_) != 0)
+			{
+				NM_ATOMIC_INT_STORE(&sem_->waiter_units_, SEMAPHORE_MIXED_WAITERS);
+			}
+		}
+
+		if(is_timed_out)
+		{
+			return nm_semaphore_try_acquire_n(sem_, n_) ? 0 : -1;
+		}
+	}
+}
+
+
+int nm_semaphore_init(nm_semaphore_t* sem_, unsigned int initial_value_)
+{
+	if(!sem_ || initial_value_ > (unsigned int)INT_MAX)
+	{
+		return -1;
+	}
+
+	NM_ATOMIC_INT_STORE(&sem_->value_, (nm_atomic_int_t)initial_value_);
+	NM_ATOMIC_INT_STORE(&sem_->waiters_, 0);
+	NM_ATOMIC_INT_STORE(&sem_->waiter_units_, 0);
+	return 0;
+}
+
+
+int nm_semaphore_destroy(nm_semaphore_t* sem_)
+{
+	return sem_ && NM_ATOMIC_INT_LOAD(&sem_->waiters_) == 0 ? 0 : -1;
+}
+
+
+int nm_semaphore_acquire_n(nm_semaphore_t* sem_, unsigned int n_)
+{
+	return semaphore_acquire(sem_, n_, DEADLINE_NEVER);
+}
+
+
+int nm_semaphore_try_acquire_n(nm_semaphore_t* sem_, unsigned int n_)
+{
+	nm_atomic_int_t value = NM_ATOMIC_INT_LOAD(&sem_->value_);
+
+	if(n_ > (unsigned int)INT_MAX)
+	{
+		return 0;
+	}
+
+	while(value >= (nm_atomic_int_t)n_)
+	{
+		nm_atomic_int_t previous = NM_ATOMIC_INT_CAS(&sem_->value_, value, value - (nm_atomic_int_t)n_);
+		if(previous == value)
+		{
+			return 1;
+		}
+
+		value = previous;
+	}
+
+	return 0;
+}
+
+
+int nm_semaphore_acquire_n_until(nm_semaphore_t* sem_, unsigned int n_, nm_uint64_t deadline_ns_)
+{
+	return semaphore_acquire(sem_, n_, deadline_ns_);
+}
+
+
+int nm_semaphore_release_n(nm_semaphore_t* sem_, unsigned int n_)
+{
+	nm_atomic_int_t value;
+	nm_atomic_int_t previous;
+	nm_atomic_int_t waiters;
+	nm_atomic_int_t units;
+
+	if(n_ > (unsigned int)INT_MAX)
+	{
+		return -1;
+	}
+
+	if(n_ == 0)
+	{
+		return 0;
+	}
+
+	value = NM_ATOMIC_INT_LOAD(&sem_->value_);
+	for(;;)
+	{
+		if(value > INT_MAX - (nm_atomic_int_t)n_)
+		{
+			return -1; /* The value would pass INT_MAX, like an initial value above it */
+		}
+
+		previous = NM_ATOMIC_INT_CAS(&sem_->value_, value, value + (nm_atomic_int_t)n_);
+		if(previous == value)
+		{
+			break;
+		}
+
+		value = previous;
+	}
+
+	waiters = NM_ATOMIC_INT_LOAD(&sem_->waiters_);
+	if(waiters > 0)
+	{
+		units = NM_ATOMIC_INT_LOAD(&sem_->waiter_units_);
+		if(units == SEMAPHORE_MIXED_WAITERS || units == 0) /* 0 - a counted waiter is registering again after a reset */
+		{
+			futex_wake(&sem_->value_, INT_MAX); /* Any of them may be the one that the units are enough for */
+		}
+		else
+		{
+			futex_wake(&sem_->value_, (unsigned int)waiters < n_ ? waiters : (int)n_);
+		}
+	}
+	return 0;
+}
+
+
+#define EVENTCOUNT_WAITERS_MASK 0xFFFF
+#define EVENTCOUNT_EPOCH_SHIFT 16
+#define EVENTCOUNT_EPOCH_ONE (1 << EVENTCOUNT_EPOCH_SHIFT)
+
+static void eventcount_notify(nm_eventcount_t* ec_, int count_)
+{
+	NM_ATOMIC_FENCE(); /* Orders the caller's publication before the waiters check (pairs with prepare_wait) */
+	if((NM_ATOMIC_INT_LOAD_RELAXED(&ec_->state_) & EVENTCOUNT_WAITERS_MASK) == 0)
+	{
+		return;
+	}
+
+	NM_ATOMIC_INT_FETCH_ADD(&ec_->state_, EVENTCOUNT_EPOCH_ONE); /* The epoch wraps around naturally */
+	futex_wake(&ec_->state_, count_);
+}
+
+
+int nm_eventcount_init(nm_eventcount_t* ec_)
+{
+	if(!ec_)
+	{
+		return -1;
+	}
+
+	NM_ATOMIC_INT_STORE(&ec_->state_, 0);
+	return 0;
+}
+
+
+int nm_eventcount_destroy(nm_eventcount_t* ec_)
+{
+	return ec_ && (NM_ATOMIC_INT_LOAD(&ec_->state_) & EVENTCOUNT_WAITERS_MASK) == 0 ? 0 : -1;
+}
+
+
+nm_eventcount_key nm_eventcount_prepare_wait(nm_eventcount_t* ec_)
+{
+	return (nm_eventcount_key)NM_ATOMIC_INT_FETCH_ADD(&ec_->state_, 1) >> EVENTCOUNT_EPOCH_SHIFT;
+}
+
+
+void nm_eventcount_cancel_wait(nm_eventcount_t* ec_)
+{
+	NM_ATOMIC_INT_FETCH_ADD(&ec_->state_, -1);
+}
+
+
+void nm_eventcount_commit_wait(nm_eventcount_t* ec_, nm_eventcount_key key_)
+{
+	nm_eventcount_commit_wait_until(ec_, key_, DEADLINE_NEVER);
+}
+
+
+int nm_eventcount_commit_wait_until(nm_eventcount_t* ec_, nm_eventcount_key key_, nm_uint64_t deadline_ns_)
+{
+	nm_atomic_int_t state;
+	int result = 0;
+
+	for(;;)
+	{
+		state = NM_ATOMIC_INT_LOAD(&ec_->state_);
+		if(((nm_eventcount_key)state >> EVENTCOUNT_EPOCH_SHIFT) != key_)
+		{
+			break; /* Notified since prepare_wait */
+		}
+
+		if(futex_wait(&ec_->state_, state, deadline_ns_) != 0)
+		{
+			result = -1;
+			break;
+		}
+	}
+
+	NM_ATOMIC_INT_FETCH_ADD(&ec_->state_, -1);
+	return result;
+}
+
+
+void nm_eventcount_notify_one(nm_eventcount_t* ec_)
+{
+	eventcount_notify(ec_, 1);
+}
+
+
+void nm_eventcount_notify_all(nm_eventcount_t* ec_)
+{
+	eventcount_notify(ec_, INT_MAX);
+}
+
+/* Queue locks (the spinning alternatives of nm_mutex_t for the BBQ lock): */
+
+static nm_atomic_int_t online_cpus; /* 0 until the first spin_cpus call */
+
+/* Returns the number of online CPUs (queried once) */
+static nm_atomic_int_t spin_cpus(void)
+{
+	nm_atomic_int_t cpus = NM_ATOMIC_INT_LOAD_RELAXED(&online_cpus);
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+	SYSTEM_INFO info;
+#endif
+
+	if(cpus == 0)
+	{
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+		GetSystemInfo(&info);
+		cpus = (nm_atomic_int_t)info.dwNumberOfProcessors;
+#else
+		cpus = (nm_atomic_int_t)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		cpus = cpus > 0 ? cpus : 1;
+		NM_ATOMIC_INT_STORE(&online_cpus, cpus); /* Racing threads store the same value */
+	}
+
+	return cpus;
+}
+
+static void spin_wait(unsigned int* spins_)
+{
+	/* On a single CPU the lock holder cannot run while the waiter spins - every spin would only delay the handoff */
+	if(++(*spins_) < SPIN_LIMIT && spin_cpus() > 1)
+	{
+		CPU_RELAX();
+	}
+	else
+	{
+		thread_yield(); /* The lock holder may be preempted - lets it run */
+	}
+}
+
+
+typedef struct ticket_lock
+{
+	nm_atomic_int_t next_ticket_;
+	char next_ticket_padding_[CACHE_LINE_SIZE - sizeof(nm_atomic_int_t)];
+	nm_atomic_int_t now_serving_; /* On its own cache line - the waiters spin on it, while the arrivals take tickets */
+	char now_serving_padding_[CACHE_LINE_SIZE - sizeof(nm_atomic_int_t)];
+} ticket_lock;
+
+static void ticket_lock_init(ticket_lock* lock_)
+{
+	NM_ATOMIC_INT_STORE(&lock_->next_ticket_, 0);
+	NM_ATOMIC_INT_STORE(&lock_->now_serving_, 0);
+}
+
+static void ticket_lock_acquire(ticket_lock* lock_)
+{
+	nm_atomic_int_t ticket = NM_ATOMIC_INT_FETCH_ADD(&lock_->next_ticket_, 1);
+	nm_atomic_int_t serving;
+	unsigned int spins = 0;
+
+	while((serving = NM_ATOMIC_INT_LOAD(&lock_->now_serving_)) != ticket)
+	{
+		if(ticket - serving >= spin_cpus())
+		{
+			thread_yield(); /* More waiters ahead than CPUs - some of them must run before this ticket can be served */
+		}
+		else
+		{
+			spin_wait(&spins);
+		}
+	}
+}
+
+static void ticket_lock_release(ticket_lock* lock_)
+{
+	NM_ATOMIC_INT_STORE(&lock_->now_serving_, NM_ATOMIC_INT_LOAD_RELAXED(&lock_->now_serving_) + 1); /* Only the holder writes it */
+}
+
+
+#define MCS_POOL_NODES 4 /* MCS locks that a thread may hold at once without allocating a node */
+
+typedef struct mcs_node
+{
+	struct mcs_node* next_;
+	struct mcs_node* free_next_; /* The thread's free list */
+	nm_atomic_int_t is_locked_;
+	int is_allocated_; /* Beyond the thread's pool - freed when its lock is released */
+	char padding_[CACHE_LINE_SIZE - 2 * sizeof(struct mcs_node*) - sizeof(nm_atomic_int_t) - sizeof(int)];
+} mcs_node;
+
+typedef struct mcs_lock
+{
+	mcs_node* tail_;
+	mcs_node* owner_; /* The holder's node, written and read only by the holder */
+} mcs_lock;
+
+/* Every thread waits on its own nodes - a node is free again as soon as its lock is released, in any order
+   (the holder's node is kept in the lock, so the locks a thread holds may be released in any order) */
+static NM_THREAD_LOCAL mcs_node mcs_pool[MCS_POOL_NODES];
+static NM_THREAD_LOCAL unsigned int mcs_pool_used; /* The pool nodes that were ever taken - the rest were never used */
+static NM_THREAD_LOCAL mcs_node* mcs_free_nodes;
+
+static mcs_node* mcs_node_take(void)
+{
+	mcs_node* node = mcs_free_nodes;
+
+	if(node)
+	{
+		mcs_free_nodes = node->free_next_;
+		return node;
+	}
+
+	if(mcs_pool_used < MCS_POOL_NODES)
+	{
+		return &mcs_pool[mcs_pool_used++];
+	}
+
+	/* Deeper nesting (user callbacks that call into other queues under the lock) - a node of its own, from the heap */
+	node = (mcs_node*)malloc(sizeof(mcs_node));
+	if(!node)
+	{
+		abort(); /* A lock acquisition cannot fail */
+	}
+
+	node->is_allocated_ = 1;
+	return node;
+}
+
+static void mcs_node_give_back(mcs_node* node_)
+{
+	if(node_->is_allocated_)
+	{
+		free(node_);
+		return;
+	}
+
+	node_->free_next_ = mcs_free_nodes;
+	mcs_free_nodes = node_;
+}
+
+static void mcs_lock_init(mcs_lock* lock_)
+{
+	NM_ATOMIC_PTR_STORE(&lock_->tail_, NULL);
+	lock_->owner_ = NULL;
+}
+
+static void mcs_lock_acquire(mcs_lock* lock_)
+{
+	mcs_node* node = mcs_node_take();
+	mcs_node* predecessor;
+	unsigned int spins = 0;
+
+	NM_ATOMIC_PTR_STORE(&node->next_, NULL);
+	NM_ATOMIC_INT_STORE(&node->is_locked_, 1);
+
+	predecessor = (mcs_node*)NM_ATOMIC_PTR_EXCHANGE(&lock_->tail_, node);
+	if(predecessor)
+	{
+		NM_ATOMIC_PTR_STORE(&predecessor->next_, node);
+		while(NM_ATOMIC_INT_LOAD(&node->is_locked_))
+		{
+			spin_wait(&spins);
+		}
+	}
+
+	lock_->owner_ = node;
+}
+
+static void mcs_lock_release(mcs_lock* lock_)
+{
+	mcs_node* node = lock_->owner_;
+	mcs_node* successor = (mcs_node*)NM_ATOMIC_PTR_LOAD(&node->next_);
+	unsigned int spins = 0;
+
+	if(!successor)
+	{
+		if(NM_ATOMIC_PTR_CAS(&lock_->tail_, node, NULL) == node)
+		{
+			mcs_node_give_back(node);
+			return;
+		}
+
+		while(!(successor = (mcs_node*)NM_ATOMIC_PTR_LOAD(&node->next_))) /* A successor is linking itself */
+		{
+			spin_wait(&spins);
+		}
+	}
+
+	NM_ATOMIC_INT_STORE(&successor->is_locked_, 0);
+	mcs_node_give_back(node); /* The successor no longer reads it */
+}
+
+
+#define COHORT_MAX_NODES 8 /* NUMA nodes beyond it share cohorts */
+#define COHORT_MAX_LOCAL_HANDOFFS 64 /* Bounds the starvation of the other NUMA nodes */
+
+/* The local lock is a test-and-set lock with a waiter count, rather than a FIFO lock: when the threads outnumber
+   the CPUs, a FIFO handoff goes to a waiter that is not running, and the lock convoys (every acquisition then costs
+   a round of context switches) - a barging local lock lets the running thread take it. The global lock is still
+   handed over inside the cohort, and the cohorts are still served in FIFO order */
+typedef struct cohort_node
+{
+	nm_atomic_int_t is_locked_; /* The local lock */
+	nm_atomic_int_t waiters_; /* Threads that wait for the local lock */
+	int owns_global_; /* Accessed only by the holder of the local lock */
+	unsigned int local_handoffs_;
+	char padding_[CACHE_LINE_SIZE - 2 * sizeof(nm_atomic_int_t) - 2 * sizeof(int)];
+} cohort_node;
+
+typedef struct cohort_lock
+{
+	ticket_lock global_;
+	cohort_node nodes_[COHORT_MAX_NODES];
+	cohort_node* owner_; /* The holder's cohort, written and read only by the holder */
+} cohort_lock;
+
+static void cohort_lock_init(cohort_lock* lock_)
+{
+	unsigned int i;
+
+	ticket_lock_init(&lock_->global_);
+	for(i = 0; i < COHORT_MAX_NODES; ++i)
+	{
+		NM_ATOMIC_INT_STORE(&lock_->nodes_[i].is_locked_, 0);
+		NM_ATOMIC_INT_STORE(&lock_->nodes_[i].waiters_, 0);
+		lock_->nodes_[i].owns_global_ = 0;
+		lock_->nodes_[i].local_handoffs_ = 0;
+	}
+
+	lock_->owner_ = NULL;
+}
+
+static void cohort_lock_acquire(cohort_lock* lock_)
+{
+	cohort_node* node = &lock_->nodes_[current_numa_node() % COHORT_MAX_NODES];
+	unsigned int spins = 0;
+
+	if(NM_ATOMIC_INT_CAS(&node->is_locked_, 0, 1) != 0)
+	{
+		NM_ATOMIC_INT_FETCH_ADD(&node->waiters_, 1); /* Lets the holder know that the global lock is wanted in the cohort */
+		while(NM_ATOMIC_INT_LOAD(&node->is_locked_) != 0 || NM_ATOMIC_INT_CAS(&node->is_locked_, 0, 1) != 0)
+		{
+			spin_wait(&spins);
+		}
+		NM_ATOMIC_INT_FETCH_ADD(&node->waiters_, -1);
+	}
+
+	if(!node->owns_global_) /* Otherwise the global lock was handed over inside the cohort */
+	{
+		ticket_lock_acquire(&lock_->global_);
+		node->owns_global_ = 1;
+	}
+
+	lock_->owner_ = node;
+}
+
+static void cohort_lock_release(cohort_lock* lock_)
+{
+	cohort_node* node = lock_->owner_;
+
+	if(NM_ATOMIC_INT_LOAD(&node->waiters_) > 0 && node->local_handoffs_ < COHORT_MAX_LOCAL_HANDOFFS)
+	{
+		++node->local_handoffs_; /* Keeps the global lock in the cohort, and passes the local lock on */
+	}
+	else
+	{
+		node->local_handoffs_ = 0;
+		node->owns_global_ = 0;
+		ticket_lock_release(&lock_->global_);
+	}
+
+	NM_ATOMIC_INT_STORE(&node->is_locked_, 0);
+}
+
+/* Epoch based reclamation: */
+
+#define EPOCH_ACTIVE 1 /* The low bit of a record's state - the thread is in a critical region */
+#define EPOCH_RECLAIM_BATCH 64 /* Retired nodes per thread between reclamation attempts */
+
+typedef struct epoch_record
+{
+	nm_atomic_int_t state_; /* (epoch << 1) | EPOCH_ACTIVE while in a critical region, 0 otherwise */
+	nm_atomic_int_t is_used_; /* Records of unregistered threads are reused */
+	struct epoch_record* next_;
+	char padding_[CACHE_LINE_SIZE - 2 * sizeof(nm_atomic_int_t) - sizeof(struct epoch_record*)];
+} epoch_record;
+
+static epoch_record* epoch_records; /* Push-only list of the records of all the threads that ever registered */
+static nm_epoch_node* epoch_orphans; /* Retired nodes of unregistered threads, reclaimed by any thread */
+static nm_atomic_int_t global_epoch;
+
+static NM_THREAD_LOCAL epoch_record* epoch_current_record;
+static NM_THREAD_LOCAL unsigned int epoch_nesting;
+static NM_THREAD_LOCAL nm_epoch_node* epoch_limbo_head; /* Retired nodes in retirement order */
+static NM_THREAD_LOCAL nm_epoch_node* epoch_limbo_tail;
+static NM_THREAD_LOCAL unsigned int epoch_limbo_count;
+
+
+/* Advances the global epoch if every thread in a critical region has observed the current one, returns 1 if it did */
+static int epoch_try_advance(void)
+{
+	unsigned int epoch = (unsigned int)NM_ATOMIC_INT_LOAD(&global_epoch);
+	epoch_record* record;
+	nm_atomic_int_t state;
+
+	for(record = (epoch_record*)NM_ATOMIC_PTR_LOAD(&epoch_records); record; record = record->next_)
+	{
+		state = NM_ATOMIC_INT_LOAD(&record->state_);
+		if((state & EPOCH_ACTIVE) && ((unsigned int)state >> 1) != (epoch & (UINT_MAX >> 1)))
+		{
+			return 0;
+		}
+	}
+
+	(void)NM_ATOMIC_INT_CAS(&global_epoch, (nm_atomic_int_t)epoch, (nm_atomic_int_t)(epoch + 1));
+	return 1;
+}
+
+
+static void epoch_push_orphans(nm_epoch_node* head_, nm_epoch_node* tail_)
+{
+	nm_epoch_node* orphans;
+
+	do
+	{
+		orphans = (nm_epoch_node*)NM_ATOMIC_PTR_LOAD(&epoch_orphans);
+		tail_->next_ = orphans;
+	}
+	while(NM_ATOMIC_PTR_CAS(&epoch_orphans, orphans, head_) != orphans); /* The pushed nodes may be reclaimed once it succeeds */
+}
+
+
+/* Frees the orphaned nodes that are safe to free, and puts the others back */
+static void epoch_reclaim_orphans(unsigned int epoch_)
+{
+	nm_epoch_node* node = (nm_epoch_node*)NM_ATOMIC_PTR_EXCHANGE(&epoch_orphans, NULL);
+	nm_epoch_node* next;
+	nm_epoch_node* kept_head = NULL;
+	nm_epoch_node* kept_tail = NULL;
+
+	for(; node; node = next)
+	{
+		next = node->next_;
+		if(epoch_ - node->epoch_ >= 2)
+		{
+			node->free_(node);
+			continue;
+		}
+
+		node->next_ = kept_head;
+		kept_head = node;
+		if(!kept_tail)
+		{
+			kept_tail = node;
+		}
+	}
+
+	if(kept_head)
+	{
+		epoch_push_orphans(kept_head, kept_tail);
+	}
+}
+
+
+static void epoch_thread_exit(void)
+{
+	epoch_nesting = 0; /* A thread that exits is not reading anything anymore */
+	nm_epoch_unregister();
+}
+
+
+int nm_epoch_register(void)
+{
+	epoch_record* record;
+	epoch_record* records;
+
+	if(epoch_current_record)
+	{
+		return 0;
+	}
+
+	for(record = (epoch_record*)NM_ATOMIC_PTR_LOAD(&epoch_records); record; record = record->next_)
+	{
+		if(NM_ATOMIC_INT_LOAD_RELAXED(&record->is_used_) == 0 && NM_ATOMIC_INT_CAS(&record->is_used_, 0, 1) == 0)
+		{
+			break;
+		}
+	}
+
+	if(!record)
+	{
+		record = (epoch_record*)calloc(1, sizeof(epoch_record));
+		if(!record)
+		{
+			return -1;
+		}
+
+		record->is_used_ = 1;
+		do
+		{
+			records = (epoch_record*)NM_ATOMIC_PTR_LOAD(&epoch_records);
+			record->next_ = records;
+		}
+		while(NM_ATOMIC_PTR_CAS(&epoch_records, records, record) != records);
+	}
+
+	if(watch_thread_exit(record) != 0)
+	{
+		NM_ATOMIC_INT_STORE(&record->is_used_, 0);
+		return -1;
+	}
+
+	epoch_current_record = record;
+	return 0;
+}
+
+
+void nm_epoch_unregister(void)
+{
+	epoch_record* record = epoch_current_record;
+
+	if(!record || epoch_nesting > 0)
+	{
+		return;
+	}
+
+	nm_epoch_reclaim();
+	if(epoch_limbo_head)
+	{
+		epoch_push_orphans(epoch_limbo_head, epoch_limbo_tail);
+		epoch_limbo_head = NULL;
+		epoch_limbo_tail = NULL;
+		epoch_limbo_count = 0;
+	}
+
+	watch_thread_exit(NULL);
+	epoch_current_record = NULL;
+	NM_ATOMIC_INT_STORE(&record->is_used_, 0);
+}
+
+
+int nm_epoch_enter(void)
+{
+	if(epoch_nesting > 0)
+	{
+		++epoch_nesting;
+		return 0;
+	}
+
+	if(!epoch_current_record && nm_epoch_register() != 0)
+	{
+		return -1;
+	}
+
+	epoch_nesting = 1;
+	NM_ATOMIC_INT_STORE(&epoch_current_record->state_,
+	                    (nm_atomic_int_t)(((unsigned int)NM_ATOMIC_INT_LOAD_RELAXED(&global_epoch) << 1) | EPOCH_ACTIVE));
+	NM_ATOMIC_FENCE(); /* Publishes the state before any read of the protected structure */
+	return 0;
+}
+
+
+void nm_epoch_exit(void)
+{
+	if(--epoch_nesting == 0)
+	{
+		NM_ATOMIC_INT_STORE(&epoch_current_record->state_, 0);
+	}
+}
+
+
+void nm_epoch_retire(nm_epoch_node* node_, nm_epoch_free_callback free_)
+{
+	node_->next_ = NULL;
+	node_->free_ = free_;
+	node_->epoch_ = (unsigned int)NM_ATOMIC_INT_LOAD(&global_epoch);
+
+	if(!epoch_current_record && nm_epoch_register() != 0) /* An unregistered thread's nodes are orphans right away */
+	{
+		epoch_push_orphans(node_, node_);
+		return;
+	}
+
+	if(epoch_limbo_tail)
+	{
+		epoch_limbo_tail->next_ = node_;
+	}
+	else
+	{
+		epoch_limbo_head = node_;
+	}
+	epoch_limbo_tail = node_;
+
+	if(++epoch_limbo_count >= EPOCH_RECLAIM_BATCH)
+	{
+		nm_epoch_reclaim();
+	}
+}
+
+
+void nm_epoch_reclaim(void)
+{
+	unsigned int epoch;
+	nm_epoch_node* node;
+
+	epoch_try_advance();
+	epoch = (unsigned int)NM_ATOMIC_INT_LOAD(&global_epoch);
+	while(epoch_limbo_head && epoch - epoch_limbo_head->epoch_ >= 2)
+	{
+		node = epoch_limbo_head;
+		epoch_limbo_head = node->next_;
+		--epoch_limbo_count;
+		node->free_(node);
+	}
+
+	if(!epoch_limbo_head)
+	{
+		epoch_limbo_tail = NULL;
+	}
+
+	if(NM_ATOMIC_PTR_LOAD(&epoch_orphans))
+	{
+		epoch_reclaim_orphans(epoch);
+	}
+}
+
+
+void nm_epoch_synchronize(void)
+{
+	unsigned int target = (unsigned int)NM_ATOMIC_INT_LOAD(&global_epoch) + 2;
+
+	while((int)((unsigned int)NM_ATOMIC_INT_LOAD(&global_epoch) - target) < 0)
+	{
+		if(!epoch_try_advance())
+		{
+			thread_yield(); /* Some thread is still in a critical region of an older epoch */
+		}
+	}
+
+	nm_epoch_reclaim();
+}
+
+/* --------------------------------------------- End of Sync utils ----------------------------------------------- */
+
+/* Blocking Bounded Queue: */
+
+/* Underlying queue defines: */
+
+typedef nm_queue queue_type; /* TODO: implement a nm_deque class (using 2 nm_vectors (Map) (back and forward growing) and nm_queue (pointed fixed sized queues)) */
+#define ENQUEUE(queue_, item_) nm_queue_enqueue(queue_, item_)
+#define DEQUEUE(queue_, item_ptr_) nm_queue_dequeue(queue_, item_ptr_)
+#define SIZE(queue_) nm_queue_capacity(queue_)
+#define IS_EMPTY(queue_) nm_queue_is_empty(queue_)
+
+/* Defines: */
+
+#define COMBINING_RECORDS 64 /* Publication records per queue - threads beyond it wait for a free record */
+#define COMBINING_MAX_PASSES 4 /* Bounds the time a combiner works for the other threads */
+
+typedef enum bbq_combining_state
+{
+    COMBINING_FREE,
+    COMBINING_CLAIMED,
+    COMBINING_PUT,
+    COMBINING_TAKE,
+    COMBINING_DONE
+} bbq_combining_state;
+
+typedef struct bbq_combining_record
+{
+    nm_atomic_int_t state_; /* bbq_combining_state */
+    nm_bbq_status status_;
+    void* item_;
+    char padding_[CACHE_LINE_SIZE - sizeof(nm_atomic_int_t) - sizeof(nm_bbq_status) - sizeof(void*)];
+} bbq_combining_record;
+
+/* The record a thread claimed last - usually free again, so threads settle on records of their own */
+static NM_THREAD_LOCAL unsigned int combining_record_hint;
+
+typedef struct lfq_segment
+{
+    nm_epoch_node retire_node_; /* Must be first - a retired node is freed as a segment */
+    nm_atomic_int_t enq_idx_;
+    char enq_idx_padding_[CACHE_LINE_SIZE - sizeof(nm_atomic_int_t)];
+    nm_atomic_int_t deq_idx_;
+    char deq_idx_padding_[CACHE_LINE_SIZE - sizeof(nm_atomic_int_t)];
+    struct lfq_segment* next_;
+    size_t id_; /* Segments are numbered consecutively (for the size estimation) */
+    void* items_[1]; /* segment_capacity_ slots */
+} lfq_segment;
+
+static char lfq_taken_marker;
+#define LFQ_TAKEN ((void*)&lfq_taken_marker) /* Marks a slot whose item was taken, or that a taker gave up on */
+
+typedef struct bbq_parked_taker
+{
+    nm_semaphore_t wakeup_;
+    struct bbq_parked_taker* prev_;
+    struct bbq_parked_taker* next_;
+    int is_parked_;
+} bbq_parked_taker;
+
+struct nm_bbq_producer
+{
+    nm_blocking_bounded_queue* bbq_;
+    struct nm_bbq_producer* prev_;
+    struct nm_bbq_producer* next_;
+    nm_mutex_t mtx_; /* Taken by the owner thread around every put, and by the flushes of the other threads */
+    nm_atomic_int_t is_flushing_; /* The owner is in a blocking flush, holding mtx_ */
+    unsigned long max_delay_ms_;
+    nm_uint64_t first_put_ns_; /* The put time of the oldest staged item */
+    size_t batch_size_;
+    size_t count_;
+    void* items_[1]; /* batch_size_ slots */
+};
+
+typedef unsigned int nm_uint32_t; /* 32 bits on all the supported platforms */
+typedef char nm_uint32_t_is_32_bits[sizeof(nm_uint32_t) == 4 ? 1 : -1];
+
+/* The spill tier: the spilled records (each a nm_uint32_t size, followed by the record) are, in their queue order,
+   the unread part of the read buffer, the file range [read_offset_, write_offset_), and the unwritten part of the write buffer */
+typedef struct bbq_spill
+{
+    char* path_;
+#if defined(NM_FILE_WINDOWS)
+    HANDLE file_;
+#else
+    int fd_;
+#endif
+    size_t buffer_bytes_;
+    char* write_buffer_;
+    size_t write_start_; /* Records before it were read straight from the buffer (the file was drained), they are not written */
+    size_t write_end_;
+    char* flush_buffer_; /* A full write buffer that is written to the file with the queue unlocked */
+    size_t flush_start_;
+    size_t flush_size_; /* 0 - no write is pending */
+    nm_uint64_t flush_offset_;
+    char* read_buffer_;
+    size_t read_start_;
+    size_t read_end_;
+    nm_uint64_t write_offset_; /* Where the write buffer is written to (after the pending write) */
+    nm_uint64_t read_offset_; /* Where the read buffer is filled from */
+    size_t count_; /* The spilled items */
+    unsigned int held_slots_; /* Slots freed by takes that a failed read could not refill, the next release retries them */
+    int is_reading_; /* A read of the file to the end of the read buffer is in progress */
+    int is_truncate_pending_;
+    int is_write_failed_; /* The pending write failed, the next write back retries it */
+    nm_atomic_int_t is_failed_; /* is_write_failed_ or held_slots_ - puts and takes retry the I/O first, and fail if it fails again */
+    nm_mutex_t file_mtx_; /* Serializes the file I/O, that is done with the queue unlocked (taken before the queue lock) */
+    bbq_spill_encode_callback encode_;
+    bbq_spill_decode_callback decode_;
+    bbq_destruction_policy_callback release_;
+    void* context_;
+} bbq_spill;
+
+struct nm_blocking_bounded_queue
+{
+    queue_type queue_;
+    nm_uint32_t* compact_slots_; /* NM_BBQ_SLOTS_COMPACT: the ring's slots (queue_ keeps the indices, its items_ is NULL) */
+    size_t compact_base_;
+    unsigned int compact_shift_;
+    size_t capacity_; /* The ring may stay larger until a shrink completes (see shrink_debt_) */
+    size_t shrink_debt_; /* Free slot units a pending shrink still has to withdraw, the takers withhold them */
+    void** standby_items_; /* An empty ring buffer that drain_all swaps in, NULL until the first drained span is released */
+    size_t standby_capacity_;
+    nm_mutex_t mtx_;
+    nm_semaphore_t free_slots_;
+    nm_semaphore_t occupied_slots_;
+    nm_barrier_t enq_waiters_barrier_;
+    nm_barrier_t deq_waiters_barrier_;
+    nm_atomic_value_t enq_waiters_;
+    nm_atomic_value_t deq_waiters_;
+    nm_atomic_flag_t is_valid_;
+    nm_atomic_flag_t is_destroying_;
+    nm_uint64_t* put_stamps_; /* Per slot put timestamps (sojourn time tracking), NULL if tracking is disabled */
+    nm_uint64_t sojourn_ewma_ns_;
+    nm_bbq_wake_policy wake_policy_;
+    bbq_parked_taker* parked_head_; /* Takers that are parked by the wake policy, in parking order */
+    bbq_parked_taker* parked_tail_;
+    nm_bbq_lock_kind lock_kind_;
+    union
+    {
+        ticket_lock ticket_;
+        mcs_lock mcs_;
+        cohort_lock* cohort_;
+    } spin_lock_; /* The queue lock for the spinning lock kinds, mtx_ is the queue lock otherwise */
+    nm_bbq_mode mode_;
+    bbq_combining_record* combining_records_; /* Cache line aligned, inside combining_block_ */
+    void* combining_block_;
+    nm_atomic_int_t is_combining_;
+    nm_atomic_int_t combining_high_; /* 1 + the highest record index ever claimed - the combiner scans only below it */
+    char lfq_head_padding_[CACHE_LINE_SIZE];
+    lfq_segment* lfq_head_; /* NM_BBQ_MODE_UNBOUNDED: the takers' segment */
+    char lfq_tail_padding_[CACHE_LINE_SIZE - sizeof(lfq_segment*)];
+    lfq_segment* lfq_tail_; /* NM_BBQ_MODE_UNBOUNDED: the putters' segment (may lag behind) */
+    char lfq_tail_end_padding_[CACHE_LINE_SIZE - sizeof(lfq_segment*)];
+    size_t segment_capacity_;
+    nm_eventcount_t not_empty_;
+    nm_atomic_value_t segments_bytes_;
+    size_t memory_budget_bytes_;
+    bbq_memory_budget_callback memory_budget_callback_;
+    void* memory_budget_context_;
+    nm_atomic_int_t is_over_budget_;
+    nm_mutex_t producers_mtx_; /* Guards the producers list and the flusher state */
+    nm_bbq_producer* producers_; /* The registered producer handles */
+    nm_thread_t flusher_; /* Flushes the staged items of the handles whose time bound expired */
+    nm_semaphore_t flusher_wakeup_;
+    unsigned long flush_interval_ms_;
+    int has_flusher_;
+    size_t prefetch_distance_; /* The payloads that take_n prefetches, 0 if prefetching is disabled */
+    size_t prefetch_lines_; /* The cache lines prefetched per payload */
+    bbq_spill* spill_; /* The overflow tier, NULL if the queue has none (guarded by the queue lock) */
+};
+
+#define SOJOURN_EWMA_SHIFT 3 /* Each new sample weighs 1/8 */
+#define REMOVE_IF_STACK_ITEMS 32 /* remove_if collects up to this many removed items without allocating */
+#define SPILL_RECORD_HEADER sizeof(nm_uint32_t) /* The record size before each spilled record */
+#define SPILL_DEFAULT_BUFFER_BYTES ((size_t)1 << 20)
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define PREFETCH(address_) __builtin_prefetch((address_), 0, 3) /* For a read, into all the cache levels */
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #define PREFETCH(address_) _mm_prefetch((const char*)(address_), _MM_HINT_T0)
+#else
+    #define PREFETCH(address_) (void)(address_)
+#endif
+
+/* Prefetches the first cache lines of the payloads that the items point to - a macro, since GCC finds a function that only
+   prefetches free of side effects, and drops the calls to it */
+#define PREFETCH_PAYLOADS(bbq_, items_, count_) \
+    do \
+    { \
+        const char* payload_; \
+        size_t i_, line_; \
+        for(i_ = 0; i_ < (count_); ++i_) \
+        { \
+            payload_ = (const char*)(items_)[i_]; \
+            for(line_ = 0; line_ < (bbq_)->prefetch_lines_; ++line_, payload_ += CACHE_LINE_SIZE) \
+            { \
+                PREFETCH(payload_); \
+            } \
+        } \
+    } while(0)
+
+
+/* ------------------------------------------- BBQ internal helpers -------------------------------------------- */
+
+static void bbq_lock(nm_blocking_bounded_queue* bbq_)
+{
+    switch(bbq_->lock_kind_)
+    {
+    case NM_BBQ_LOCK_TICKET:
+        ticket_lock_acquire(&bbq_->spin_lock_.ticket_);
+        break;
+
+    case NM_BBQ_LOCK_MCS:
+        mcs_lock_acquire(&bbq_->spin_lock_.mcs_);
+        break;
+
+    case NM_BBQ_LOCK_COHORT:
+        cohort_lock_acquire(bbq_->spin_lock_.cohort_);
+        break;
+
+    default:
+        nm_mutex_lock(&bbq_->mtx_);
+    }
+}
+
+
+static void bbq_unlock(nm_blocking_bounded_queue* bbq_)
+{
+    switch(bbq_->lock_kind_)
+    {
+    case NM_BBQ_LOCK_TICKET:
+        ticket_lock_release(&bbq_->spin_lock_.ticket_);
+        break;
+
+    case NM_BBQ_LOCK_MCS:
+        mcs_lock_release(&bbq_->spin_lock_.mcs_);
+        break;
+
+    case NM_BBQ_LOCK_COHORT:
+        cohort_lock_release(bbq_->spin_lock_.cohort_);
+        break;
+
+    default:
+        nm_mutex_unlock(&bbq_->mtx_);
+    }
+}
+
+
+static int bbq_lock_init(nm_blocking_bounded_queue* bbq_, nm_bbq_lock_kind lock_kind_)
+{
+    bbq_->lock_kind_ = lock_kind_;
+    switch(lock_kind_)
+    {
+    case NM_BBQ_LOCK_MUTEX:
+        return nm_mutex_init(&bbq_->mtx_);
+
+    case NM_BBQ_LOCK_PRIORITY_INHERIT:
+        return nm_mutex_init_pi(&bbq_->mtx_);
+
+    case NM_BBQ_LOCK_TICKET:
+        ticket_lock_init(&bbq_->spin_lock_.ticket_);
+        return 0;
+
+    case NM_BBQ_LOCK_MCS:
+        mcs_lock_init(&bbq_->spin_lock_.mcs_);
+        return 0;
+
+    case NM_BBQ_LOCK_COHORT:
+        bbq_->spin_lock_.cohort_ = (cohort_lock*)malloc(sizeof(cohort_lock));
+        if(!bbq_->spin_lock_.cohort_)
+        {
+            return -1;
+        }
+
+        cohort_lock_init(bbq_->spin_lock_.cohort_);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+
+static void bbq_lock_destroy(nm_blocking_bounded_queue* bbq_)
+{
+    if(bbq_->lock_kind_ == NM_BBQ_LOCK_COHORT)
+    {
+        free(bbq_->spin_lock_.cohort_);
+    }
+    else if(bbq_->lock_kind_ == NM_BBQ_LOCK_MUTEX || bbq_->lock_kind_ == NM_BBQ_LOCK_PRIORITY_INHERIT)
+    {
+        nm_mutex_destroy(&bbq_->mtx_);
+    }
+}
+
+
+/* Returns 0 if the n_ units were acquired, -1 on timeout */
+static int semaphore_acquire_ms(nm_semaphore_t* sem_, unsigned int n_, unsigned long timeout_ms_)
+{
+    if(timeout_ms_ == NM_BBQ_WAIT_FOREVER)
+    {
+        nm_semaphore_acquire_n(sem_, n_);
+        return 0;
+    }
+
+    return nm_semaphore_acquire_n_until(sem_, n_, nm_time_now_ns() + (nm_uint64_t)timeout_ms_ * 1000000);
+}
+
+
+/* Waits for a slot unit on the given semaphore, and returns with the queue locked on success */
+static nm_bbq_status bbq_acquire_slot(nm_blocking_bounded_queue* bbq_, nm_semaphore_t* slots_, nm_atomic_value_t* waiters_,
+                                      nm_barrier_t* waiters_barrier_, unsigned long timeout_ms_)
+{
+    int wait_result;
+    int is_destroying;
+
+    if(nm_semaphore_try_acquire_n(slots_, 1)) /* Fast path - a slot unit is available, no need to register as a waiter */
+    {
+        bbq_lock(bbq_);
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            bbq_unlock(bbq_);
+            nm_semaphore_release_n(slots_, 1); /* Passes the unit on, it may be a close wakeup of a registered waiter */
+            return NM_BBQ_IS_CLOSED;
+        }
+
+        return NM_BBQ_SUCCESS;
+    }
+
+    if(timeout_ms_ == 0)
+    {
+        return NM_BBQ_TIMEOUT;
+    }
+
+    bbq_lock(bbq_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    ++(*waiters_);
+    bbq_unlock(bbq_);
+
+    wait_result = semaphore_acquire_ms(slots_, 1, timeout_ms_);
+
+    bbq_lock(bbq_);
+    --(*waiters_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        is_destroying = NM_ATOMIC_FLAG_LOAD(&bbq_->is_destroying_);
+        bbq_unlock(bbq_);
+
+        if(wait_result == 0)
+        {
+            nm_semaphore_release_n(slots_, 1); /* Passes the close wakeup on to the next waiter */
+        }
+
+        if(is_destroying)
+        {
+            nm_barrier_arrive(waiters_barrier_); /* Lets the destroying thread know that this thread has left the queue */
+        }
+
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(wait_result != 0)
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_TIMEOUT;
+    }
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+/* Must be called with the queue locked */
+static void bbq_unpark(nm_blocking_bounded_queue* bbq_, bbq_parked_taker* taker_)
+{
+    if(taker_->prev_)
+    {
+        taker_->prev_->next_ = taker_->next_;
+    }
+    else
+    {
+        bbq_->parked_head_ = taker_->next_;
+    }
+
+    if(taker_->next_)
+    {
+        taker_->next_->prev_ = taker_->prev_;
+    }
+    else
+    {
+        bbq_->parked_tail_ = taker_->prev_;
+    }
+
+    taker_->is_parked_ = 0;
+}
+
+
+/* Must be called with the queue locked, wakes up one parked taker according to the wake policy */
+static void bbq_wake_parked_taker(nm_blocking_bounded_queue* bbq_)
+{
+    bbq_parked_taker* taker = bbq_->wake_policy_ == NM_BBQ_WAKE_LIFO ? bbq_->parked_tail_ : bbq_->parked_head_;
+
+    if(taker)
+    {
+        bbq_unpark(bbq_, taker);
+        nm_semaphore_release_n(&taker->wakeup_, 1);
+    }
+}
+
+
+/* The wake policy variant of bbq_acquire_slot for takers - each blocked taker parks on its own semaphore */
+static nm_bbq_status bbq_acquire_item_parked(nm_blocking_bounded_queue* bbq_, unsigned long timeout_ms_)
+{
+    bbq_parked_taker taker;
+    nm_uint64_t deadline = 0;
+    nm_uint64_t now;
+    unsigned long wait_ms = timeout_ms_;
+    int wait_result;
+    int is_destroying;
+
+    if(timeout_ms_ != NM_BBQ_WAIT_FOREVER)
+    {
+        deadline = nm_time_now_ns() + (nm_uint64_t)timeout_ms_ * 1000000;
+    }
+
+    for(;;)
+    {
+        if(nm_semaphore_try_acquire_n(&bbq_->occupied_slots_, 1)) /* Fast path - an item is available, no need to park */
+        {
+            bbq_lock(bbq_);
+            if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+            {
+                bbq_unlock(bbq_);
+                nm_semaphore_release_n(&bbq_->occupied_slots_, 1);
+                return NM_BBQ_IS_CLOSED;
+            }
+
+            return NM_BBQ_SUCCESS;
+        }
+
+        bbq_lock(bbq_);
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            bbq_unlock(bbq_);
+            return NM_BBQ_IS_CLOSED;
+        }
+
+        /* Items are posted with the queue locked (see bbq_publish_items), so no wakeup can be missed here */
+        if(nm_semaphore_try_acquire_n(&bbq_->occupied_slots_, 1))
+        {
+            return NM_BBQ_SUCCESS;
+        }
+
+        if(wait_ms == 0 || nm_semaphore_init(&taker.wakeup_, 0) != 0)
+        {
+            bbq_unlock(bbq_);
+            return NM_BBQ_TIMEOUT;
+        }
+
+        taker.next_ = NULL;
+        taker.prev_ = bbq_->parked_tail_;
+        if(bbq_->parked_tail_)
+        {
+            bbq_->parked_tail_->next_ = &taker;
+        }
+        else
+        {
+            bbq_->parked_head_ = &taker;
+        }
+        bbq_->parked_tail_ = &taker;
+        taker.is_parked_ = 1;
+        ++bbq_->deq_waiters_;
+        bbq_unlock(bbq_);
+
+        wait_result = semaphore_acquire_ms(&taker.wakeup_, 1, wait_ms);
+
+        bbq_lock(bbq_);
+        --bbq_->deq_waiters_;
+        if(taker.is_parked_)
+        {
+            bbq_unpark(bbq_, &taker);
+        }
+        else if(wait_result != 0)
+        {
+            bbq_wake_parked_taker(bbq_); /* The wakeup arrived too late for this taker - passes it on */
+        }
+        nm_semaphore_destroy(&taker.wakeup_);
+
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            is_destroying = NM_ATOMIC_FLAG_LOAD(&bbq_->is_destroying_);
+            bbq_unlock(bbq_);
+
+            if(is_destroying)
+            {
+                nm_barrier_arrive(&bbq_->deq_waiters_barrier_);
+            }
+
+            return NM_BBQ_IS_CLOSED;
+        }
+        bbq_unlock(bbq_);
+
+        if(timeout_ms_ != NM_BBQ_WAIT_FOREVER)
+        {
+            now = nm_time_now_ns();
+            wait_ms = now < deadline ? (unsigned long)((deadline - now + 999999) / 1000000) : 0;
+        }
+    }
+}
+
+
+/* Must be called with the queue locked, makes count_ newly enqueued items visible to the takers, and unlocks the queue */
+static void bbq_publish_items(nm_blocking_bounded_queue* bbq_, unsigned int count_)
+{
+    unsigned int i;
+
+    if(bbq_->wake_policy_ == NM_BBQ_WAKE_DEFAULT)
+    {
+        bbq_unlock(bbq_);
+        if(count_ > 0)
+        {
+            nm_semaphore_release_n(&bbq_->occupied_slots_, count_);
+        }
+        return;
+    }
+
+    if(count_ > 0)
+    {
+        nm_semaphore_release_n(&bbq_->occupied_slots_, count_);
+    }
+
+    for(i = 0; i < count_ && bbq_->parked_head_; ++i)
+    {
+        bbq_wake_parked_taker(bbq_);
+    }
+    bbq_unlock(bbq_);
+}
+
+
+/* Checks that an item can be put in the queue's slots (any item can, unless the slots are compact) */
+static int bbq_is_encodable(const nm_blocking_bounded_queue* bbq_, const void* item_)
+{
+    size_t offset = (size_t)item_ - bbq_->compact_base_;
+
+    return !bbq_->compact_slots_
+           || ((size_t)item_ >= bbq_->compact_base_ && (offset & (((size_t)1 << bbq_->compact_shift_) - 1)) == 0
+               && (offset >> bbq_->compact_shift_) <= (size_t)0xFFFFFFFFUL);
+}
+
+
+/* Must be called with the queue locked, and with a free slot unit acquired */
+static void bbq_ring_put(nm_blocking_bounded_queue* bbq_, void* item_)
+{
+    queue_type* queue = &bbq_->queue_;
+
+    if(bbq_->put_stamps_)
+    {
+        bbq_->put_stamps_[queue->tail_] = nm_time_now_ns();
+    }
+
+    if(!bbq_->compact_slots_)
+    {
+        ENQUEUE(queue, item_);
+        return;
+    }
+
+    bbq_->compact_slots_[queue->tail_] = (nm_uint32_t)(((size_t)item_ - bbq_->compact_base_) >> bbq_->compact_shift_);
+    queue->tail_ = queue->tail_ + 1 == queue->capacity_ ? 0 : queue->tail_ + 1;
+    ++queue->items_count_;
+}
+
+
+/* Must be called with the queue locked, and with an occupied slot unit acquired */
+static void bbq_ring_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_)
+{
+    nm_uint64_t sojourn;
+    queue_type* queue = &bbq_->queue_;
+    size_t head = queue->head_;
+
+    if(!bbq_->compact_slots_)
+    {
+        DEQUEUE(queue, item_ptr_);
+    }
+    else
+    {
+        *item_ptr_ = (void*)(bbq_->compact_base_ + ((size_t)bbq_->compact_slots_[head] << bbq_->compact_shift_));
+        queue->head_ = head + 1 == queue->capacity_ ? 0 : head + 1;
+        --queue->items_count_;
+    }
+
+    if(bbq_->put_stamps_)
+    {
+        sojourn = nm_time_now_ns() - bbq_->put_stamps_[head];
+        if(sojourn > bbq_->sojourn_ewma_ns_)
+        {
+            bbq_->sojourn_ewma_ns_ += (sojourn - bbq_->sojourn_ewma_ns_) >> SOJOURN_EWMA_SHIFT;
+        }
+        else
+        {
+            bbq_->sojourn_ewma_ns_ -= (bbq_->sojourn_ewma_ns_ - sojourn) >> SOJOURN_EWMA_SHIFT;
+        }
+    }
+}
+
+
+/* Must be called with the queue locked, reallocates the ring (and the put stamps) to new_capacity_ slots */
+static int bbq_resize_ring(nm_blocking_bounded_queue* bbq_, size_t new_capacity_)
+{
+    nm_uint64_t* put_stamps = NULL;
+
+    if(bbq_->put_stamps_)
+    {
+        put_stamps = (nm_uint64_t*)malloc(new_capacity_ * sizeof(nm_uint64_t));
+        if(!put_stamps)
+        {
+            return -1;
+        }
+
+        /* The stamps follow their items to the beginning of the new ring */
+        ring_copy_span(put_stamps, bbq_->put_stamps_, sizeof(nm_uint64_t), bbq_->queue_.capacity_, bbq_->queue_.head_,
+                       bbq_->queue_.items_count_);
+    }
+
+    if(nm_queue_resize(&bbq_->queue_, new_capacity_) != NM_QUEUE_SUCCESS)
+    {
+        free(put_stamps);
+        return -1;
+    }
+
+    if(put_stamps)
+    {
+        free(bbq_->put_stamps_);
+        bbq_->put_stamps_ = put_stamps;
+    }
+
+    return 0;
+}
+
+
+/* Must be called with the queue locked, withholds freed slot units for a pending shrink, returns the units left to release */
+static unsigned int bbq_pay_shrink_debt(nm_blocking_bounded_queue* bbq_, unsigned int units_)
+{
+    unsigned int paid;
+
+    if(bbq_->shrink_debt_ == 0)
+    {
+        return units_;
+    }
+
+    paid = bbq_->shrink_debt_ < units_ ? (unsigned int)bbq_->shrink_debt_ : units_;
+    bbq_->shrink_debt_ -= paid;
+    if(bbq_->shrink_debt_ == 0)
+    {
+        /* No slot units beyond the new capacity are left, so the items fit - if the allocation fails,
+           the ring just stays larger than the capacity */
+        (void)bbq_resize_ring(bbq_, bbq_->capacity_);
+    }
+
+    return units_ - paid;
+}
+
+
+/* Acquires up to max_units_ units of the semaphore without blocking (in shrinking chunks), returns the acquired units */
+static size_t bbq_try_acquire_units(nm_semaphore_t* sem_, size_t max_units_)
+{
+    size_t acquired = 0;
+    unsigned int chunk = max_units_ < (size_t)INT_MAX ? (unsigned int)max_units_ : INT_MAX; /* No semaphore holds more */
+
+    while(acquired < max_units_ && chunk > 0)
+    {
+        if(chunk > max_units_ - acquired)
+        {
+            chunk = (unsigned int)(max_units_ - acquired);
+        }
+
+        if(nm_semaphore_try_acquire_n(sem_, chunk))
+        {
+            acquired += chunk;
+        }
+        else
+        {
+            chunk >>= 1;
+        }
+    }
+
+    return acquired;
+}
+
+
+/* Must be called with both queues locked, moves count_ items from the head of src_ to the tail of dst_
+   (whose slot units are already acquired) - each chunk ends where a ring wraps, so up to 4 copies are made */
+static void bbq_ring_move(nm_blocking_bounded_queue* dst_, nm_blocking_bounded_queue* src_, size_t count_)
+{
+    queue_type* dst = &dst_->queue_;
+    queue_type* src = &src_->queue_;
+    nm_uint64_t now = 0;
+    size_t chunk;
+    size_t i;
+
+    if(dst_->put_stamps_ && !src_->put_stamps_)
+    {
+        now = nm_time_now_ns(); /* The items are stamped as new, as when the tracking is turned on */
+    }
+
+    while(count_ > 0)
+    {
+        chunk = count_;
+        if(chunk > src->capacity_ - src->head_)
+        {
+            chunk = src->capacity_ - src->head_;
+        }
+        if(chunk > dst->capacity_ - dst->tail_)
+        {
+            chunk = dst->capacity_ - dst->tail_;
+        }
+
+        memcpy(dst->items_ + dst->tail_, src->items_ + src->head_, chunk * sizeof(void*));
+        memset(src->items_ + src->head_, 0, chunk * sizeof(void*));
+        if(dst_->put_stamps_ && src_->put_stamps_)
+        {
+            memcpy(dst_->put_stamps_ + dst->tail_, src_->put_stamps_ + src->head_, chunk * sizeof(nm_uint64_t));
+        }
+        else if(dst_->put_stamps_)
+        {
+            for(i = 0; i < chunk; ++i)
+            {
+                dst_->put_stamps_[dst->tail_ + i] = now;
+            }
+        }
+
+        dst->tail_ = (dst->tail_ + chunk) % dst->capacity_;
+        dst->items_count_ += chunk;
+        src->head_ = (src->head_ + chunk) % src->capacity_;
+        src->items_count_ -= chunk;
+        count_ -= chunk;
+    }
+}
+
+
+/* Must be called with the queue locked, removes up to max_count_ matching items in a single pass - the kept items
+   keep their order (and their put stamps), and the removed items are left in the slots that follow the new tail */
+static size_t bbq_ring_remove_if(nm_blocking_bounded_queue* bbq_, bbq_predicate_callback predicate_, void* context_, size_t max_count_)
+{
+    queue_type* queue = &bbq_->queue_;
+    size_t read = queue->head_;
+    size_t write = queue->head_;
+    size_t items_left = queue->items_count_;
+    size_t removed = 0;
+    void* item;
+
+    for(; items_left > 0 && removed < max_count_; --items_left)
+    {
+        item = queue->items_[read];
+        if(predicate_(item, context_))
+        {
+            ++removed;
+        }
+        else
+        {
+            if(removed > 0) /* Swaps, so the removed items gather between write and read */
+            {
+                queue->items_[read] = queue->items_[write];
+                queue->items_[write] = item;
+                if(bbq_->put_stamps_)
+                {
+                    bbq_->put_stamps_[write] = bbq_->put_stamps_[read];
+                }
+            }
+            if(++write == queue->capacity_)
+            {
+                write = 0;
+            }
+        }
+
+        if(++read == queue->capacity_)
+        {
+            read = 0;
+        }
+    }
+
+    for(; items_left > 0 && removed > 0; --items_left) /* The rest of the items are kept, shifted over the removed ones */
+    {
+        item = queue->items_[read];
+        queue->items_[read] = queue->items_[write];
+        queue->items_[write] = item;
+        if(bbq_->put_stamps_)
+        {
+            bbq_->put_stamps_[write] = bbq_->put_stamps_[read];
+        }
+        if(++write == queue->capacity_)
+        {
+            write = 0;
+        }
+
+        if(++read == queue->capacity_)
+        {
+            read = 0;
+        }
+    }
+
+    queue->tail_ = (queue->head_ + queue->items_count_ - removed) % queue->capacity_;
+    queue->items_count_ -= removed;
+
+    return removed;
+}
+
+
+/* Executes the operations that are published in the combining records, as the combiner */
+static void bbq_combine(nm_blocking_bounded_queue* bbq_)
+{
+    bbq_combining_record* record;
+    unsigned int puts = 0;
+    unsigned int takes = 0;
+    unsigned int executed;
+    unsigned int records_count;
+    unsigned int pass;
+    unsigned int i;
+    int is_valid;
+
+    bbq_lock(bbq_);
+    is_valid = NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_); /* Stable while the queue is locked */
+
+    for(pass = 0; pass < COMBINING_MAX_PASSES; ++pass)
+    {
+        executed = 0;
+        records_count = (unsigned int)NM_ATOMIC_INT_LOAD(&bbq_->combining_high_);
+        for(i = 0; i < records_count; ++i)
+        {
+            record = &bbq_->combining_records_[i];
+            switch(NM_ATOMIC_INT_LOAD(&record->state_))
+            {
+            case COMBINING_PUT:
+                if(is_valid)
+                {
+                    bbq_ring_put(bbq_, record->item_);
+                    ++puts;
+                }
+                break;
+
+            case COMBINING_TAKE:
+                if(is_valid)
+                {
+                    bbq_ring_take(bbq_, &record->item_);
+                    ++takes;
+                }
+                break;
+
+            default:
+                continue;
+            }
+
+            record->status_ = is_valid ? NM_BBQ_SUCCESS : NM_BBQ_IS_CLOSED;
+            NM_ATOMIC_INT_STORE(&record->state_, COMBINING_DONE);
+            ++executed;
+        }
+
+        if(executed == 0)
+        {
+            break;
+        }
+    }
+
+    takes = bbq_pay_shrink_debt(bbq_, takes);
+    bbq_publish_items(bbq_, puts); /* Wakes all the takers of this pass with a single release */
+    if(takes > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, takes);
+    }
+}
+
+
+/* Executes a put (item_) or a take (into item_ptr_), whose slot unit is already acquired, through the combiner */
+static nm_bbq_status bbq_combined_op(nm_blocking_bounded_queue* bbq_, bbq_combining_state op_, void* item_, void** item_ptr_)
+{
+    bbq_combining_record* record;
+    unsigned int i = combining_record_hint;
+    unsigned int tries = 0;
+    unsigned int spins = 0;
+    nm_atomic_int_t high;
+    nm_bbq_status status;
+
+    for(;;) /* Claims a publication record */
+    {
+        record = &bbq_->combining_records_[i];
+        if(NM_ATOMIC_INT_LOAD_RELAXED(&record->state_) == COMBINING_FREE
+           && NM_ATOMIC_INT_CAS(&record->state_, COMBINING_FREE, COMBINING_CLAIMED) == COMBINING_FREE)
+        {
+            break;
+        }
+
+        i = (i + 1) % COMBINING_RECORDS;
+        if(++tries % COMBINING_RECORDS == 0)
+        {
+            spin_wait(&spins);
+        }
+    }
+
+    combining_record_hint = i;
+    while((high = NM_ATOMIC_INT_LOAD(&bbq_->combining_high_)) <= (nm_atomic_int_t)i)
+    {
+        NM_ATOMIC_INT_CAS(&bbq_->combining_high_, high, (nm_atomic_int_t)i + 1);
+    }
+
+    record->item_ = item_;
+    NM_ATOMIC_INT_STORE(&record->state_, op_);
+
+    spins = 0;
+    while(NM_ATOMIC_INT_LOAD(&record->state_) != COMBINING_DONE)
+    {
+        if(NM_ATOMIC_INT_LOAD_RELAXED(&bbq_->is_combining_) == 0 && NM_ATOMIC_INT_CAS(&bbq_->is_combining_, 0, 1) == 0)
+        {
+            bbq_combine(bbq_); /* Executes this thread's own operation too */
+            NM_ATOMIC_INT_STORE(&bbq_->is_combining_, 0);
+        }
+        else
+        {
+            spin_wait(&spins);
+        }
+    }
+
+    if(item_ptr_)
+    {
+        *item_ptr_ = record->item_;
+    }
+    status = record->status_;
+    NM_ATOMIC_INT_STORE(&record->state_, COMBINING_FREE);
+
+    return status;
+}
+
+
+/* Marks the queue as invalid and wakes up all its waiters, returns 0 if the queue was already closed */
+static int bbq_invalidate(nm_blocking_bounded_queue* bbq_, int is_destroying_, size_t* enq_waiters_ptr_, size_t* deq_waiters_ptr_)
+{
+    int was_valid;
+
+    bbq_lock(bbq_);
+    was_valid = NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_);
+    NM_ATOMIC_FLAG_SET(&bbq_->is_valid_, 0);
+    NM_ATOMIC_FLAG_SET(&bbq_->is_destroying_, is_destroying_);
+    *enq_waiters_ptr_ = bbq_->enq_waiters_;
+    *deq_waiters_ptr_ = bbq_->deq_waiters_;
+
+    if(is_destroying_)
+    {
+        /* Every registered waiter meets the destroying thread on the barrier before leaving the queue */
+        nm_barrier_init(&bbq_->enq_waiters_barrier_, (unsigned int)*enq_waiters_ptr_ + 1);
+        nm_barrier_init(&bbq_->deq_waiters_barrier_, (unsigned int)*deq_waiters_ptr_ + 1);
+    }
+
+    while(bbq_->parked_head_)
+    {
+        bbq_wake_parked_taker(bbq_);
+    }
+    bbq_unlock(bbq_);
+
+    if(*enq_waiters_ptr_ > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, 1); /* Every woken waiter passes the wakeup on (see bbq_acquire_slot) */
+    }
+
+    if(*deq_waiters_ptr_ > 0)
+    {
+        nm_semaphore_release_n(&bbq_->occupied_slots_, 1);
+    }
+
+    return was_valid;
+}
+
+
+/* Turns on the sojourn time tracking of the queue, all the items that are already in the queue are stamped as new */
+static int bbq_enable_sojourn_tracking(nm_blocking_bounded_queue* bbq_)
+{
+    nm_uint64_t* put_stamps;
+    nm_uint64_t now;
+    size_t i;
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return -1; /* The items have no fixed slots to stamp */
+    }
+
+    bbq_lock(bbq_);
+    if(!bbq_->put_stamps_)
+    {
+        put_stamps = (nm_uint64_t*)malloc(bbq_->queue_.capacity_ * sizeof(nm_uint64_t));
+        if(!put_stamps)
+        {
+            bbq_unlock(bbq_);
+            return -1;
+        }
+
+        now = nm_time_now_ns();
+        for(i = 0; i < bbq_->queue_.capacity_; ++i)
+        {
+            put_stamps[i] = now;
+        }
+
+        bbq_->put_stamps_ = put_stamps;
+    }
+    bbq_unlock(bbq_);
+
+    return 0;
+}
+
+
+/* Returns the current latency signal of the queue: the max of the average sojourn time and the age of the oldest item */
+static nm_uint64_t bbq_latency_ns(nm_blocking_bounded_queue* bbq_)
+{
+    nm_uint64_t latency;
+    nm_uint64_t oldest_age = 0;
+
+    bbq_lock(bbq_);
+    latency = bbq_->sojourn_ewma_ns_;
+    if(bbq_->put_stamps_ && bbq_->queue_.items_count_ > 0)
+    {
+        oldest_age = nm_time_now_ns() - bbq_->put_stamps_[bbq_->queue_.head_];
+    }
+    else
+    {
+        bbq_->sojourn_ewma_ns_ >>= 1; /* No backlog - decays the average, since no takes will update it */
+    }
+    bbq_unlock(bbq_);
+
+    return latency > oldest_age ? latency : oldest_age;
+}
+
+
+/* ------------------------------------------ Unbounded mode helpers: ------------------------------------------ */
+
+/* The lock-free part is a FAA array queue (Ramalhete & Correia): putters and takers claim slots of the current
+   segment with fetch-and-add, and a taker that overtakes a putter poisons the slot so the putter retries elsewhere */
+
+static size_t lfq_segment_size(const nm_blocking_bounded_queue* bbq_)
+{
+    return sizeof(lfq_segment) + (bbq_->segment_capacity_ - 1) * sizeof(void*);
+}
+
+
+static lfq_segment* lfq_segment_create(const nm_blocking_bounded_queue* bbq_, size_t id_, void* first_item_)
+{
+    lfq_segment* segment = (lfq_segment*)calloc(1, lfq_segment_size(bbq_));
+
+    if(segment)
+    {
+        segment->id_ = id_;
+        segment->items_[0] = first_item_;
+        segment->enq_idx_ = first_item_ ? 1 : 0;
+    }
+
+    return segment;
+}
+
+
+static void lfq_segment_free(nm_epoch_node* node_)
+{
+    free(node_);
+}
+
+
+/* Accounts a linked (bytes_ > 0) or an unlinked (bytes_ < 0) segment, and calls the memory budget callback on a crossing */
+static void lfq_account(nm_blocking_bounded_queue* bbq_, int is_linked_)
+{
+    size_t used_bytes;
+
+    if(is_linked_)
+    {
+        used_bytes = NM_ATOMIC_VALUE_ADD(&bbq_->segments_bytes_, lfq_segment_size(bbq_));
+        if(bbq_->memory_budget_bytes_ > 0 && used_bytes > bbq_->memory_budget_bytes_ && bbq_->memory_budget_callback_
+           && NM_ATOMIC_INT_CAS(&bbq_->is_over_budget_, 0, 1) == 0)
+        {
+            bbq_->memory_budget_callback_(bbq_, used_bytes, bbq_->memory_budget_context_);
+        }
+    }
+    else
+    {
+        used_bytes = NM_ATOMIC_VALUE_SUB(&bbq_->segments_bytes_, lfq_segment_size(bbq_));
+        if(used_bytes <= bbq_->memory_budget_bytes_ && NM_ATOMIC_INT_LOAD_RELAXED(&bbq_->is_over_budget_))
+        {
+            NM_ATOMIC_INT_STORE(&bbq_->is_over_budget_, 0); /* Re-arms the callback */
+        }
+    }
+}
+
+
+/* Must be called in an epoch critical region, returns 1 if a new segment was linked, 0 if not, -1 on allocation failure */
+static int lfq_enqueue(nm_blocking_bounded_queue* bbq_, void* item_)
+{
+    lfq_segment* tail;
+    lfq_segment* next;
+    lfq_segment* segment;
+    nm_atomic_int_t idx;
+
+    for(;;)
+    {
+        tail = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&bbq_->lfq_tail_);
+        idx = NM_ATOMIC_INT_FETCH_ADD(&tail->enq_idx_, 1);
+        if((size_t)idx < bbq_->segment_capacity_)
+        {
+            if(NM_ATOMIC_PTR_CAS(&tail->items_[idx], NULL, item_) == NULL)
+            {
+                return 0;
+            }
+            continue; /* A taker poisoned the slot */
+        }
+
+        if(tail != NM_ATOMIC_PTR_LOAD(&bbq_->lfq_tail_))
+        {
+            continue;
+        }
+
+        next = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&tail->next_);
+        if(next)
+        {
+            (void)NM_ATOMIC_PTR_CAS(&bbq_->lfq_tail_, tail, next); /* Helps the putter that linked it */
+            continue;
+        }
+
+        segment = lfq_segment_create(bbq_, tail->id_ + 1, item_);
+        if(!segment)
+        {
+            return -1;
+        }
+
+        if(NM_ATOMIC_PTR_CAS(&tail->next_, NULL, segment) == NULL)
+        {
+            (void)NM_ATOMIC_PTR_CAS(&bbq_->lfq_tail_, tail, segment);
+            return 1;
+        }
+
+        free(segment); /* Another putter linked its segment first */
+    }
+}
+
+
+/* Must be called in an epoch critical region, returns 1 if an item was dequeued, 0 if the queue is empty */
+static int lfq_dequeue(nm_blocking_bounded_queue* bbq_, void** item_ptr_)
+{
+    lfq_segment* head;
+    lfq_segment* next;
+    nm_atomic_int_t idx;
+    void* item;
+
+    for(;;)
+    {
+        head = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&bbq_->lfq_head_);
+        if(NM_ATOMIC_INT_LOAD(&head->deq_idx_) >= NM_ATOMIC_INT_LOAD(&head->enq_idx_) && !NM_ATOMIC_PTR_LOAD(&head->next_))
+        {
+            return 0;
+        }
+
+        idx = NM_ATOMIC_INT_FETCH_ADD(&head->deq_idx_, 1);
+        if((size_t)idx < bbq_->segment_capacity_)
+        {
+            item = NM_ATOMIC_PTR_EXCHANGE(&head->items_[idx], LFQ_TAKEN);
+            if(item)
+            {
+                *item_ptr_ = item;
+                return 1;
+            }
+            continue; /* Overtook the slot's putter, which will retry */
+        }
+
+        next = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&head->next_);
+        if(!next)
+        {
+            return 0;
+        }
+
+        if(NM_ATOMIC_PTR_CAS(&bbq_->lfq_head_, head, next) == head)
+        {
+            lfq_account(bbq_, 0);
+            nm_epoch_retire(&head->retire_node_, lfq_segment_free);
+        }
+    }
+}
+
+
+static nm_bbq_status lfq_put(nm_blocking_bounded_queue* bbq_, void* item_)
+{
+    int result;
+
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(nm_epoch_enter() != 0)
+    {
+        return NM_BBQ_ALLOCATION_ERROR;
+    }
+    result = lfq_enqueue(bbq_, item_);
+    nm_epoch_exit();
+
+    if(result < 0)
+    {
+        return NM_BBQ_ALLOCATION_ERROR;
+    }
+
+    if(result > 0)
+    {
+        lfq_account(bbq_, 1);
+    }
+
+    nm_eventcount_notify_one(&bbq_->not_empty_);
+    return NM_BBQ_SUCCESS;
+}
+
+
+static int lfq_try_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_)
+{
+    int is_taken;
+
+    nm_epoch_enter(); /* The thread is already registered by lfq_take */
+    is_taken = lfq_dequeue(bbq_, item_ptr_);
+    nm_epoch_exit();
+
+    return is_taken;
+}
+
+
+static nm_bbq_status lfq_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_, unsigned long timeout_ms_)
+{
+    nm_bbq_status status;
+    nm_eventcount_key key;
+    nm_uint64_t deadline = DEADLINE_NEVER;
+
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(nm_epoch_enter() != 0)
+    {
+        return NM_BBQ_ALLOCATION_ERROR;
+    }
+    status = lfq_dequeue(bbq_, item_ptr_) ? NM_BBQ_SUCCESS : NM_BBQ_TIMEOUT;
+    nm_epoch_exit();
+
+    if(status == NM_BBQ_SUCCESS || timeout_ms_ == 0)
+    {
+        return status;
+    }
+
+    if(timeout_ms_ != NM_BBQ_WAIT_FOREVER)
+    {
+        deadline = nm_time_now_ns() + (nm_uint64_t)timeout_ms_ * 1000000;
+    }
+
+    /* A registered waiter keeps the queue alive - it must not touch the queue once it has unregistered */
+    NM_ATOMIC_VALUE_ADD(&bbq_->deq_waiters_, 1);
+    for(;;)
+    {
+        key = nm_eventcount_prepare_wait(&bbq_->not_empty_);
+        if(lfq_try_take(bbq_, item_ptr_))
+        {
+            nm_eventcount_cancel_wait(&bbq_->not_empty_);
+            status = NM_BBQ_SUCCESS;
+            break;
+        }
+
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            nm_eventcount_cancel_wait(&bbq_->not_empty_);
+            status = NM_BBQ_IS_CLOSED;
+            break;
+        }
+
+        if(nm_eventcount_commit_wait_until(&bbq_->not_empty_, key, deadline) != 0)
+        {
+            status = lfq_try_take(bbq_, item_ptr_) ? NM_BBQ_SUCCESS : NM_BBQ_TIMEOUT;
+            break;
+        }
+    }
+    NM_ATOMIC_VALUE_SUB(&bbq_->deq_waiters_, 1);
+
+    return status;
+}
+
+
+/* Returns an estimation of the items count - exact while no thread operates on the queue */
+static size_t lfq_size(nm_blocking_bounded_queue* bbq_)
+{
+    lfq_segment* head;
+    lfq_segment* tail;
+    size_t enq_idx;
+    size_t deq_idx;
+    size_t size = 0;
+
+    if(nm_epoch_enter() != 0)
+    {
+        return MAX_SIZE_T;
+    }
+
+    head = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&bbq_->lfq_head_);
+    tail = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&bbq_->lfq_tail_);
+    deq_idx = (size_t)NM_ATOMIC_INT_LOAD(&head->deq_idx_);
+    enq_idx = (size_t)NM_ATOMIC_INT_LOAD(&tail->enq_idx_);
+    deq_idx = deq_idx < bbq_->segment_capacity_ ? deq_idx : bbq_->segment_capacity_;
+    enq_idx = enq_idx < bbq_->segment_capacity_ ? enq_idx : bbq_->segment_capacity_;
+
+    if(tail->id_ > head->id_ || (tail->id_ == head->id_ && enq_idx > deq_idx)) /* The tail may lag behind the head */
+    {
+        size = (tail->id_ - head->id_) * bbq_->segment_capacity_ + enq_idx - deq_idx;
+    }
+    nm_epoch_exit();
+
+    return size;
+}
+
+
+/* Marks the queue as invalid and wakes up all its waiters, returns 0 if the queue was already closed */
+static int lfq_invalidate(nm_blocking_bounded_queue* bbq_, int is_destroying_)
+{
+    int was_valid;
+
+    bbq_lock(bbq_);
+    was_valid = NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_);
+    NM_ATOMIC_FLAG_SET(&bbq_->is_valid_, 0);
+    NM_ATOMIC_FLAG_SET(&bbq_->is_destroying_, is_destroying_);
+    bbq_unlock(bbq_);
+
+    nm_eventcount_notify_all(&bbq_->not_empty_);
+    return was_valid;
+}
+
+
+/* Waits for the blocked takers to leave, then frees the segments - no thread may operate on the queue anymore */
+static void lfq_destroy(nm_blocking_bounded_queue* bbq_, bbq_destruction_policy_callback callback_, void* callback_context_)
+{
+    lfq_segment* segment;
+    lfq_segment* next;
+    size_t deq_idx;
+    size_t enq_idx;
+    void* item;
+
+    lfq_invalidate(bbq_, 1);
+    while(NM_ATOMIC_VALUE_LOAD(&bbq_->deq_waiters_) > 0)
+    {
+        thread_yield();
+    }
+
+    for(segment = bbq_->lfq_head_; segment; segment = next)
+    {
+        next = segment->next_;
+        deq_idx = (size_t)segment->deq_idx_;
+        enq_idx = (size_t)segment->enq_idx_;
+        enq_idx = enq_idx < bbq_->segment_capacity_ ? enq_idx : bbq_->segment_capacity_;
+        for(; deq_idx < enq_idx; ++deq_idx)
+        {
+            item = segment->items_[deq_idx];
+            if(item && item != LFQ_TAKEN && callback_)
+            {
+                callback_(item, callback_context_);
+            }
+        }
+
+        free(segment); /* The retired segments are not linked anymore - they are freed by their epochs */
+    }
+
+    nm_eventcount_destroy(&bbq_->not_empty_);
+    nm_epoch_synchronize(); /* Frees this thread's retired segments, and the ones that exited threads left behind */
+}
+
+/* Copies up to max_items_ items in their queue order, walking the segments from the head without stopping the queue -
+   not an atomic snapshot, since the items keep moving during the walk */
+static size_t lfq_snapshot(nm_blocking_bounded_queue* bbq_, void** items_, size_t max_items_)
+{
+    lfq_segment* segment;
+    size_t idx;
+    size_t end_idx;
+    size_t copied = 0;
+    void* item;
+
+    if(nm_epoch_enter() != 0)
+    {
+        return MAX_SIZE_T;
+    }
+
+    segment = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&bbq_->lfq_head_);
+    idx = (size_t)NM_ATOMIC_INT_LOAD(&segment->deq_idx_);
+    while(segment && copied < max_items_)
+    {
+        end_idx = (size_t)NM_ATOMIC_INT_LOAD(&segment->enq_idx_);
+        end_idx = end_idx < bbq_->segment_capacity_ ? end_idx : bbq_->segment_capacity_;
+        for(; idx < end_idx && copied < max_items_; ++idx)
+        {
+            item = NM_ATOMIC_PTR_LOAD(&segment->items_[idx]);
+            if(item && item != LFQ_TAKEN) /* Skips the slots that are taken, or that are not filled yet */
+            {
+                items_[copied++] = item;
+            }
+        }
+
+        segment = (lfq_segment*)NM_ATOMIC_PTR_LOAD(&segment->next_);
+        idx = 0;
+    }
+    nm_epoch_exit();
+
+    return copied;
+}
+
+
+/* The transfer variant for an unbounded queue on one side: its segments are shared with lock-free operations in flight,
+   so the items are moved one by one - only the bounded side is locked, and an item leaves src_ only once dst_ has it */
+static nm_bbq_status lfq_transfer(nm_blocking_bounded_queue* dst_, nm_blocking_bounded_queue* src_, size_t max_items_,
+                                  size_t* transferred_ptr_)
+{
+    nm_blocking_bounded_queue* bounded = dst_->mode_ == NM_BBQ_MODE_UNBOUNDED ? src_ : dst_;
+    nm_bbq_status status = NM_BBQ_SUCCESS;
+    size_t units;
+    size_t moved = 0;
+    unsigned int free_units;
+    int result;
+    void* item;
+
+    if(bounded->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR; /* Neither side can hold an item that the other one fails to take */
+    }
+
+    if(nm_epoch_enter() != 0)
+    {
+        return NM_BBQ_ALLOCATION_ERROR;
+    }
+
+    bbq_lock(bounded);
+    if(!NM_ATOMIC_FLAG_LOAD(&dst_->is_valid_) || !NM_ATOMIC_FLAG_LOAD(&src_->is_valid_))
+    {
+        bbq_unlock(bounded);
+        nm_epoch_exit();
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(bounded == dst_)
+    {
+        units = bbq_try_acquire_units(&dst_->free_slots_, max_items_);
+        while(moved < units && lfq_dequeue(src_, &item))
+        {
+            bbq_ring_put(dst_, item);
+            ++moved;
+        }
+
+        if(units > moved)
+        {
+            nm_semaphore_release_n(&dst_->free_slots_, (unsigned int)(units - moved));
+        }
+        bbq_publish_items(dst_, (unsigned int)moved);
+    }
+    else
+    {
+        units = bbq_try_acquire_units(&src_->occupied_slots_, max_items_ < src_->queue_.items_count_ ? max_items_
+                                                                                                      : src_->queue_.items_count_);
+        while(moved < units)
+        {
+            result = lfq_enqueue(dst_, src_->queue_.items_[src_->queue_.head_]); /* Dequeued only once it is in dst_ */
+            if(result < 0)
+            {
+                status = NM_BBQ_ALLOCATION_ERROR;
+                break;
+            }
+
+            if(result > 0)
+            {
+                lfq_account(dst_, 1);
+            }
+            bbq_ring_take(src_, &item);
+            ++moved;
+        }
+
+        if(units > moved)
+        {
+            nm_semaphore_release_n(&src_->occupied_slots_, (unsigned int)(units - moved));
+        }
+        free_units = bbq_pay_shrink_debt(src_, (unsigned int)moved);
+        bbq_unlock(src_);
+
+        if(free_units > 0)
+        {
+            nm_semaphore_release_n(&src_->free_slots_, free_units);
+        }
+        if(moved > 0)
+        {
+            nm_eventcount_notify_all(&dst_->not_empty_);
+        }
+    }
+    nm_epoch_exit();
+
+    if(transferred_ptr_)
+    {
+        *transferred_ptr_ = moved;
+    }
+
+    return status;
+}
+
+/* -------------------------------------- End of Unbounded mode helpers ------------------------------------------ */
+
+
+/* -------------------------------------------- Spill tier helpers: -------------------------------------------- */
+
+#if defined(NM_FILE_WINDOWS)
+	static int spill_file_open(bbq_spill* spill_)
+	{
+		spill_->file_ = CreateFileA(spill_->path_, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+		return spill_->file_ == INVALID_HANDLE_VALUE ? -1 : 0;
+	}
+
+	static int spill_file_write(bbq_spill* spill_, const char* data_, size_t size_, nm_uint64_t offset_)
+	{
+		OVERLAPPED overlapped;
+		DWORD written;
+
+		while(size_ > 0)
+		{
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)offset_;
+			overlapped.OffsetHigh = (DWORD)(offset_ >> 32);
+			if(!WriteFile(spill_->file_, data_, (DWORD)size_, &written, &overlapped) || written == 0)
+			{
+				return -1;
+			}
+
+			data_ += written;
+			size_ -= written;
+			offset_ += written;
+		}
+		return 0;
+	}
+
+	static int spill_file_read(bbq_spill* spill_, char* data_, size_t size_, nm_uint64_t offset_)
+	{
+		OVERLAPPED overlapped;
+		DWORD bytes_read;
+
+		while(size_ > 0)
+		{
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)offset_;
+			overlapped.OffsetHigh = (DWORD)(offset_ >> 32);
+			if(!ReadFile(spill_->file_, data_, (DWORD)size_, &bytes_read, &overlapped) || bytes_read == 0)
+			{
+				return -1;
+			}
+
+			data_ += bytes_read;
+			size_ -= bytes_read;
+			offset_ += bytes_read;
+		}
+		return 0;
+	}
+
+	static int spill_file_truncate(bbq_spill* spill_)
+	{
+		LARGE_INTEGER zero;
+
+		zero.QuadPart = 0;
+		return SetFilePointerEx(spill_->file_, zero, NULL, FILE_BEGIN) && SetEndOfFile(spill_->file_) ? 0 : -1;
+	}
+
+	static void spill_file_close(bbq_spill* spill_)
+	{
+		CloseHandle(spill_->file_);
+		DeleteFileA(spill_->path_);
+	}
+#else
+	static int spill_file_open(bbq_spill* spill_)
+	{
+		spill_->fd_ = open(spill_->path_, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		return spill_->fd_ < 0 ? -1 : 0;
+	}
+
+	static int spill_file_write(bbq_spill* spill_, const char* data_, size_t size_, nm_uint64_t offset_)
+	{
+		ssize_t written;
+
+		while(size_ > 0)
+		{
+			written = pwrite(spill_->fd_, data_, size_, (off_t)offset_);
+			if(written <= 0)
+			{
+				if(written < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return -1;
+			}
+
+			data_ += written;
+			size_ -= (size_t)written;
+			offset_ += (nm_uint64_t)written;
+		}
+		return 0;
+	}
+
+	static int spill_file_read(bbq_spill* spill_, char* data_, size_t size_, nm_uint64_t offset_)
+	{
+		ssize_t bytes_read;
+
+		while(size_ > 0)
+		{
+			bytes_read = pread(spill_->fd_, data_, size_, (off_t)offset_);
+			if(bytes_read <= 0)
+			{
+				if(bytes_read < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return -1;
+			}
+
+			data_ += bytes_read;
+			size_ -= (size_t)bytes_read;
+			offset_ += (nm_uint64_t)bytes_read;
+		}
+		return 0;
+	}
+
+	static int spill_file_truncate(bbq_spill* spill_)
+	{
+		return ftruncate(spill_->fd_, 0) == 0 ? 0 : -1;
+	}
+
+	static void spill_file_close(bbq_spill* spill_)
+	{
+		close(spill_->fd_);
+		unlink(spill_->path_);
+	}
+#endif
+
+static bbq_spill* bbq_spill_create(const nm_bbq_config* config_)
+{
+    bbq_spill* spill = (bbq_spill*)calloc(1, sizeof(bbq_spill));
+    size_t path_size = strlen(config_->spill_path_) + 1;
+
+    if(!spill)
+    {
+        return NULL;
+    }
+
+    spill->buffer_bytes_ = config_->spill_buffer_bytes_ ? config_->spill_buffer_bytes_ : SPILL_DEFAULT_BUFFER_BYTES;
+    spill->path_ = (char*)malloc(path_size);
+    spill->write_buffer_ = (char*)malloc(spill->buffer_bytes_);
+    spill->flush_buffer_ = (char*)malloc(spill->buffer_bytes_);
+    spill->read_buffer_ = (char*)malloc(spill->buffer_bytes_);
+    if(!spill->path_ || !spill->write_buffer_ || !spill->flush_buffer_ || !spill->read_buffer_)
+    {
+        goto spill_create_failed;
+    }
+
+    if(nm_mutex_init(&spill->file_mtx_) != 0)
+    {
+        goto spill_create_failed;
+    }
+
+    memcpy(spill->path_, config_->spill_path_, path_size);
+    if(spill_file_open(spill) != 0)
+    {
+        goto file_open_failed;
+    }
+
+    NM_ATOMIC_INT_STORE(&spill->is_failed_, 0);
+    spill->encode_ = config_->spill_encode_;
+    spill->decode_ = config_->spill_decode_;
+    spill->release_ = config_->spill_release_;
+    spill->context_ = config_->spill_context_;
+    return spill;
+
+file_open_failed:
+    nm_mutex_destroy(&spill->file_mtx_);
+spill_create_failed:
+    free(spill->read_buffer_);
+    free(spill->flush_buffer_);
+    free(spill->write_buffer_);
+    free(spill->path_);
+    free(spill);
+    return NULL;
+}
+
+
+/* Closes and deletes the spill file (the spilled records that are left are discarded) */
+static void bbq_spill_destroy(bbq_spill* spill_)
+{
+    spill_file_close(spill_);
+    nm_mutex_destroy(&spill_->file_mtx_);
+    free(spill_->read_buffer_);
+    free(spill_->flush_buffer_);
+    free(spill_->write_buffer_);
+    free(spill_->path_);
+    free(spill_);
+}
+
+
+/* Must be called with the queue locked, publishes the failure state for the lock free check of puts and takes */
+static void bbq_spill_update_failure(bbq_spill* spill_)
+{
+    NM_ATOMIC_INT_STORE(&spill_->is_failed_, spill_->is_write_failed_ || spill_->held_slots_ > 0);
+}
+
+
+/* Must be called with the queue locked, and with no spilled items - restarts the spill at the beginning of the file,
+   which is truncated by the next write back (so a drained burst gives its disk space back). A pending write keeps
+   the offsets, the write back resets them once it is done */
+static void bbq_spill_reset(bbq_spill* spill_)
+{
+    if(spill_->flush_size_ > 0)
+    {
+        return;
+    }
+
+    spill_->is_truncate_pending_ |= spill_->write_offset_ > 0;
+    spill_->write_start_ = 0;
+    spill_->write_end_ = 0;
+    spill_->read_start_ = 0;
+    spill_->read_end_ = 0;
+    spill_->write_offset_ = 0;
+    spill_->read_offset_ = 0;
+}
+
+
+/* Does the pending truncate and write of the spill file, with the queue unlocked (the file mutex serializes them).
+   Returns 0 on success, -1 if the write failed (it stays pending, with its records) */
+static int bbq_spill_write_back(nm_blocking_bounded_queue* bbq_)
+{
+    bbq_spill* spill = bbq_->spill_;
+    const char* data;
+    nm_uint64_t offset;
+    size_t size;
+    int is_truncate;
+    int result = 0;
+
+    nm_mutex_lock(&spill->file_mtx_);
+    bbq_lock(bbq_);
+    while(result == 0 && (spill->is_truncate_pending_ || spill->flush_size_ > 0))
+    {
+        is_truncate = spill->is_truncate_pending_;
+        spill->is_truncate_pending_ = 0;
+        data = spill->flush_buffer_ + spill->flush_start_; /* Not swapped while the write is pending */
+        size = spill->flush_size_;
+        offset = spill->flush_offset_;
+        bbq_unlock(bbq_);
+
+        if(is_truncate)
+        {
+            (void)spill_file_truncate(spill); /* Best effort, the offsets restarted at 0 either way */
+        }
+
+        if(size > 0)
+        {
+            result = spill_file_write(spill, data, size, offset);
+        }
+
+        bbq_lock(bbq_);
+        if(size > 0)
+        {
+            spill->is_write_failed_ = result != 0;
+            if(result == 0)
+            {
+                spill->flush_size_ = 0;
+                if(spill->count_ == 0)
+                {
+                    bbq_spill_reset(spill);
+                }
+            }
+            bbq_spill_update_failure(spill);
+        }
+    }
+    bbq_unlock(bbq_);
+    nm_mutex_unlock(&spill->file_mtx_);
+
+    return result;
+}
+
+
+/* Reads the next written bytes of the file to the end of the read buffer, with the queue unlocked. The records before
+   them in the read buffer may be taken meanwhile, and the rest of the spill waits for them (see bbq_spill_fill).
+   Returns 0 on success, -1 if the read failed (the offsets are kept, so it can be retried) */
+static int bbq_spill_read_ahead(nm_blocking_bounded_queue* bbq_)
+{
+    bbq_spill* spill = bbq_->spill_;
+    nm_uint64_t offset;
+    size_t unread;
+    size_t size;
+    int result = 0;
+
+    nm_mutex_lock(&spill->file_mtx_);
+    bbq_lock(bbq_);
+    unread = spill->read_end_ - spill->read_start_;
+    memmove(spill->read_buffer_, spill->read_buffer_ + spill->read_start_, unread);
+    spill->read_start_ = 0;
+    spill->read_end_ = unread;
+
+    size = spill->buffer_bytes_ - unread;
+    offset = spill->flush_size_ > 0 ? spill->flush_offset_ : spill->write_offset_; /* The end of the written bytes */
+    if(offset - spill->read_offset_ < (nm_uint64_t)size)
+    {
+        size = (size_t)(offset - spill->read_offset_);
+    }
+    offset = spill->read_offset_;
+    spill->is_reading_ = size > 0;
+    bbq_unlock(bbq_);
+
+    if(size > 0)
+    {
+        result = spill_file_read(spill, spill->read_buffer_ + unread, size, offset);
+    }
+
+    bbq_lock(bbq_);
+    spill->is_reading_ = 0;
+    if(result == 0)
+    {
+        spill->read_end_ += size;
+        spill->read_offset_ += size;
+    }
+    bbq_unlock(bbq_);
+    nm_mutex_unlock(&spill->file_mtx_);
+
+    return result;
+}
+
+
+/* Must be called with the queue locked, appends the record of an item to the spill (and releases the item). A full
+   write buffer is swapped with the flush buffer, and is written by the caller once it unlocks the queue (is_write_due_).
+   Returns 0 on success, 1 if the record does not fit and the previous write is still pending, -1 if it cannot be encoded */
+static int bbq_spill_append(bbq_spill* spill_, void* item_, int* is_write_due_)
+{
+    size_t room = spill_->buffer_bytes_ - spill_->write_end_;
+    size_t max_size = spill_->buffer_bytes_ - SPILL_RECORD_HEADER;
+    size_t size = 0;
+    nm_uint32_t record_size;
+    char* buffer;
+
+    if(room > SPILL_RECORD_HEADER)
+    {
+        size = spill_->encode_(item_, spill_->write_buffer_ + spill_->write_end_ + SPILL_RECORD_HEADER, room - SPILL_RECORD_HEADER,
+                               spill_->context_);
+        if(size == 0 || size > max_size)
+        {
+            return -1;
+        }
+    }
+
+    if(room <= SPILL_RECORD_HEADER || size > room - SPILL_RECORD_HEADER)
+    {
+        if(spill_->flush_size_ > 0)
+        {
+            return 1;
+        }
+
+        buffer = spill_->flush_buffer_;
+        spill_->flush_buffer_ = spill_->write_buffer_;
+        spill_->flush_start_ = spill_->write_start_;
+        spill_->flush_size_ = spill_->write_end_ - spill_->write_start_;
+        spill_->flush_offset_ = spill_->write_offset_;
+        spill_->write_offset_ += spill_->flush_size_;
+        spill_->write_buffer_ = buffer;
+        spill_->write_start_ = 0;
+        spill_->write_end_ = 0;
+        *is_write_due_ |= spill_->flush_size_ > 0;
+
+        size = spill_->encode_(item_, spill_->write_buffer_ + SPILL_RECORD_HEADER, max_size, spill_->context_);
+        if(size == 0 || size > max_size)
+        {
+            return -1;
+        }
+    }
+
+    record_size = (nm_uint32_t)size;
+    memcpy(spill_->write_buffer_ + spill_->write_end_, &record_size, SPILL_RECORD_HEADER);
+    spill_->write_end_ += SPILL_RECORD_HEADER + size;
+    ++spill_->count_;
+
+    if(spill_->release_)
+    {
+        spill_->release_(item_, spill_->context_);
+    }
+    return 0;
+}
+
+
+/* Must be called with the queue locked, moves the next spilled bytes that are in memory to the read buffer (after its
+   unread bytes): the pending write, and then the write buffer (its bytes are never written). Returns 0 on success,
+   1 if the next bytes must be read from the file first (see bbq_spill_read_ahead), -1 if there are none */
+static int bbq_spill_fill(bbq_spill* spill_)
+{
+    size_t unread = spill_->read_end_ - spill_->read_start_;
+    size_t room = spill_->buffer_bytes_ - unread;
+    size_t size;
+
+    if(spill_->is_reading_ || spill_->read_offset_ < (spill_->flush_size_ > 0 ? spill_->flush_offset_ : spill_->write_offset_))
+    {
+        return 1;
+    }
+
+    memmove(spill_->read_buffer_, spill_->read_buffer_ + spill_->read_start_, unread);
+    spill_->read_start_ = 0;
+    spill_->read_end_ = unread;
+
+    if(spill_->read_offset_ < spill_->write_offset_) /* Inside the pending write */
+    {
+        size = spill_->write_offset_ - spill_->read_offset_ < (nm_uint64_t)room ? (size_t)(spill_->write_offset_ - spill_->read_offset_) : room;
+        memcpy(spill_->read_buffer_ + unread, spill_->flush_buffer_ + spill_->flush_start_ + (size_t)(spill_->read_offset_ - spill_->flush_offset_),
+               size);
+        spill_->read_offset_ += size;
+    }
+    else
+    {
+        size = spill_->write_end_ - spill_->write_start_ < room ? spill_->write_end_ - spill_->write_start_ : room;
+        memcpy(spill_->read_buffer_ + unread, spill_->write_buffer_ + spill_->write_start_, size);
+        spill_->write_start_ += size;
+    }
+
+    spill_->read_end_ += size;
+    return size > 0 ? 0 : -1; /* No more bytes for a record that the count says is there - the spill is inconsistent */
+}
+
+
+/* Must be called with the queue locked, takes the first spilled item. Returns 1 on success, 0 if there is none,
+   -1 if its record must be read from the file first. A record that fails to decode is dropped */
+static int bbq_spill_take(bbq_spill* spill_, void** item_ptr_)
+{
+    nm_uint32_t record_size = 0;
+    size_t available;
+    void* item;
+    int result;
+
+    while(spill_->count_ > 0)
+    {
+        available = spill_->read_end_ - spill_->read_start_;
+        if(available >= SPILL_RECORD_HEADER)
+        {
+            memcpy(&record_size, spill_->read_buffer_ + spill_->read_start_, SPILL_RECORD_HEADER);
+        }
+
+        if(available < SPILL_RECORD_HEADER || available - SPILL_RECORD_HEADER < record_size)
+        {
+            result = bbq_spill_fill(spill_);
+            if(result > 0)
+            {
+                return -1;
+            }
+
+            if(result < 0)
+            {
+                spill_->count_ = 0;
+                bbq_spill_reset(spill_);
+                return 0;
+            }
+            continue;
+        }
+
+        item = spill_->decode_(spill_->read_buffer_ + spill_->read_start_ + SPILL_RECORD_HEADER, record_size, spill_->context_);
+        spill_->read_start_ += SPILL_RECORD_HEADER + record_size;
+        if(--spill_->count_ == 0)
+        {
+            bbq_spill_reset(spill_);
+        }
+
+        if(item)
+        {
+            *item_ptr_ = item;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Must be called with the queue locked, frees count_ slots that were taken, and unlocks the queue. With a spill tier,
+   the first spilled items are moved to the freed slots first, and the rest of the slots are freed before the queue
+   is unlocked - so a put cannot find the ring full while nothing is spilled, and spill an item ahead of the ring.
+   When the next records are in the file, the refilled slots are published and the file is read with the queue
+   unlocked, the other slots wait for it - and are held for the next release if the read fails */
+static void bbq_release_slots(nm_blocking_bounded_queue* bbq_, unsigned int count_)
+{
+    bbq_spill* spill = bbq_->spill_;
+    unsigned int free_units;
+    unsigned int refilled = 0;
+    int is_truncate_due;
+    int result = 0;
+    void* item;
+
+    if(!spill)
+    {
+        free_units = bbq_pay_shrink_debt(bbq_, count_);
+        bbq_unlock(bbq_);
+
+        if(free_units > 0)
+        {
+            nm_semaphore_release_n(&bbq_->free_slots_, free_units);
+        }
+        return;
+    }
+
+    count_ += spill->held_slots_;
+    spill->held_slots_ = 0;
+    for(;;)
+    {
+        while(refilled < count_ && (result = bbq_spill_take(spill, &item)) > 0)
+        {
+            bbq_ring_put(bbq_, item);
+            ++refilled;
+        }
+
+        if(refilled == count_ || result == 0)
+        {
+            break;
+        }
+
+        bbq_publish_items(bbq_, refilled);
+        count_ -= refilled;
+        refilled = 0;
+
+        result = bbq_spill_read_ahead(bbq_);
+        bbq_lock(bbq_);
+        if(result != 0)
+        {
+            spill->held_slots_ += count_;
+            bbq_spill_update_failure(spill);
+            bbq_unlock(bbq_);
+            return;
+        }
+    }
+
+    if(refilled < count_)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, count_ - refilled);
+    }
+
+    bbq_spill_update_failure(spill); /* The held slots are refilled (or freed) */
+    is_truncate_due = spill->is_truncate_pending_;
+    bbq_publish_items(bbq_, refilled);
+
+    if(is_truncate_due)
+    {
+        (void)bbq_spill_write_back(bbq_);
+    }
+}
+
+
+/* Retries the failed file I/O - the pending write, and the refill of the held slots. Returns 0 once nothing failed */
+static int bbq_spill_recover(nm_blocking_bounded_queue* bbq_)
+{
+    (void)bbq_spill_write_back(bbq_);
+
+    bbq_lock(bbq_);
+    bbq_release_slots(bbq_, 0);
+
+    return NM_ATOMIC_INT_LOAD(&bbq_->spill_->is_failed_) ? -1 : 0;
+}
+
+
+/* Puts the items without blocking: in the ring while it has free slots and nothing is spilled, and in the spill after them.
+   The ring is never left with free slots while items are spilled (see bbq_release_slots), so the queue stays FIFO */
+static nm_bbq_status bbq_spill_put_items(nm_blocking_bounded_queue* bbq_, void** items_, size_t count_, size_t* put_count_ptr_)
+{
+    nm_bbq_status status = NM_BBQ_SUCCESS;
+    size_t units = 0;
+    size_t acquired;
+    size_t put_count = 0;
+    int is_write_due = 0;
+    int result;
+
+    *put_count_ptr_ = 0;
+    if(NM_ATOMIC_INT_LOAD_RELAXED(&bbq_->spill_->is_failed_) && bbq_spill_recover(bbq_) != 0)
+    {
+        return NM_BBQ_IO_ERROR;
+    }
+
+    bbq_lock(bbq_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    while(put_count < count_)
+    {
+        /* Also after waiting for a write - the takers may have drained the spill meanwhile, and the freed slots
+           come first again (an item spilled next to them would never be moved back) */
+        if(bbq_->spill_->count_ == 0)
+        {
+            acquired = bbq_try_acquire_units(&bbq_->free_slots_, count_ - put_count);
+            for(units += acquired; acquired > 0; --acquired)
+            {
+                bbq_ring_put(bbq_, items_[put_count++]);
+            }
+
+            if(put_count == count_)
+            {
+                break;
+            }
+        }
+
+        result = bbq_spill_append(bbq_->spill_, items_[put_count], &is_write_due);
+        if(result == 0)
+        {
+            ++put_count;
+            continue;
+        }
+
+        if(result < 0)
+        {
+            status = NM_BBQ_ALLOCATION_ERROR;
+            break;
+        }
+
+        /* Both buffers are full: waits for the pending write, with the queue unlocked */
+        bbq_publish_items(bbq_, (unsigned int)units);
+        units = 0;
+        is_write_due = 0;
+        if(bbq_spill_write_back(bbq_) != 0)
+        {
+            *put_count_ptr_ = put_count;
+            return NM_BBQ_IO_ERROR;
+        }
+
+        bbq_lock(bbq_);
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            status = NM_BBQ_IS_CLOSED;
+            break;
+        }
+    }
+
+    bbq_publish_items(bbq_, (unsigned int)units);
+    if(is_write_due)
+    {
+        (void)bbq_spill_write_back(bbq_); /* A failure is reported by the next put or take (the records stay in memory) */
+    }
+
+    *put_count_ptr_ = put_count;
+    return status;
+}
+
+/* ------------------------------------------- End of Spill tier helpers ------------------------------------------- */
+
+
+static nm_bbq_status bbq_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_, unsigned long timeout_ms_)
+{
+    nm_bbq_status status;
+
+    if(!bbq_ || !item_ptr_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_take(bbq_, item_ptr_, timeout_ms_);
+    }
+
+    if(bbq_->spill_ && NM_ATOMIC_INT_LOAD_RELAXED(&bbq_->spill_->is_failed_) && bbq_spill_recover(bbq_) != 0)
+    {
+        return NM_BBQ_IO_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_COMBINING && nm_semaphore_try_acquire_n(&bbq_->occupied_slots_, 1))
+    {
+        status = bbq_combined_op(bbq_, COMBINING_TAKE, NULL, item_ptr_);
+        if(status == NM_BBQ_IS_CLOSED)
+        {
+            nm_semaphore_release_n(&bbq_->occupied_slots_, 1); /* Passes the unit on, like bbq_acquire_slot */
+        }
+
+        return status;
+    }
+
+    if(bbq_->wake_policy_ == NM_BBQ_WAKE_DEFAULT)
+    {
+        status = bbq_acquire_slot(bbq_, &bbq_->occupied_slots_, &bbq_->deq_waiters_, &bbq_->deq_waiters_barrier_, timeout_ms_);
+    }
+    else
+    {
+        status = bbq_acquire_item_parked(bbq_, timeout_ms_);
+    }
+
+    if(status != NM_BBQ_SUCCESS)
+    {
+        return status;
+    }
+
+    bbq_ring_take(bbq_, item_ptr_);
+    bbq_release_slots(bbq_, 1);
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+/* Must be called with the queue locked, and with count_ occupied slot units acquired */
+static void bbq_ring_take_n(nm_blocking_bounded_queue* bbq_, void** items_, size_t count_)
+{
+    size_t i;
+
+    if(bbq_->put_stamps_ || bbq_->compact_slots_)
+    {
+        for(i = 0; i < count_; ++i) /* Every item samples its own sojourn time, or is decoded */
+        {
+            bbq_ring_take(bbq_, &items_[i]);
+        }
+        return;
+    }
+
+    (void)nm_queue_dequeue_n(&bbq_->queue_, items_, count_);
+}
+
+
+/* Puts the items in their order, in batches of the free slots that are available - blocks for the next free slot only if
+   is_blocking_ is set, otherwise returns when the queue is full */
+static nm_bbq_status bbq_put_items(nm_blocking_bounded_queue* bbq_, void** items_, size_t count_, size_t* put_count_ptr_, int is_blocking_)
+{
+    nm_bbq_status status = NM_BBQ_SUCCESS;
+    size_t put_count = 0;
+    size_t units;
+    size_t i;
+    int result;
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            status = NM_BBQ_IS_CLOSED;
+        }
+        else if(nm_epoch_enter() != 0)
+        {
+            status = NM_BBQ_ALLOCATION_ERROR;
+        }
+        else
+        {
+            for(; put_count < count_; ++put_count)
+            {
+                result = lfq_enqueue(bbq_, items_[put_count]);
+                if(result < 0)
+                {
+                    status = NM_BBQ_ALLOCATION_ERROR;
+                    break;
+                }
+
+                if(result > 0)
+                {
+                    lfq_account(bbq_, 1);
+                }
+            }
+            nm_epoch_exit();
+
+            if(put_count > 0)
+            {
+                nm_eventcount_notify_all(&bbq_->not_empty_);
+            }
+        }
+
+        *put_count_ptr_ = put_count;
+        return status;
+    }
+
+    if(bbq_->spill_)
+    {
+        return bbq_spill_put_items(bbq_, items_, count_, put_count_ptr_);
+    }
+
+    while(put_count < count_)
+    {
+        units = bbq_try_acquire_units(&bbq_->free_slots_, count_ - put_count);
+        if(units > 0)
+        {
+            bbq_lock(bbq_);
+            if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+            {
+                bbq_unlock(bbq_);
+                nm_semaphore_release_n(&bbq_->free_slots_, (unsigned int)units); /* Passes the units on, like bbq_acquire_slot */
+                status = NM_BBQ_IS_CLOSED;
+                break;
+            }
+        }
+        else
+        {
+            if(!is_blocking_)
+            {
+                break;
+            }
+
+            status = bbq_acquire_slot(bbq_, &bbq_->free_slots_, &bbq_->enq_waiters_, &bbq_->enq_waiters_barrier_, NM_BBQ_WAIT_FOREVER);
+            if(status != NM_BBQ_SUCCESS)
+            {
+                break;
+            }
+            units = 1 + bbq_try_acquire_units(&bbq_->free_slots_, count_ - put_count - 1);
+        }
+
+        for(i = 0; i < units; ++i)
+        {
+            bbq_ring_put(bbq_, items_[put_count + i]);
+        }
+        bbq_publish_items(bbq_, (unsigned int)units); /* A single wakeup step for the whole batch */
+        put_count += units;
+    }
+
+    *put_count_ptr_ = put_count;
+    return status;
+}
+
+
+/* Must be called with the producer locked, moves its staged items to the queue (the items that do not fit stay staged) */
+static nm_bbq_status producer_flush(nm_bbq_producer* producer_, int is_blocking_)
+{
+    nm_bbq_status status;
+    size_t put_count;
+
+    if(producer_->count_ == 0)
+    {
+        return NM_BBQ_SUCCESS;
+    }
+
+    NM_ATOMIC_INT_STORE(&producer_->is_flushing_, is_blocking_);
+    status = bbq_put_items(producer_->bbq_, producer_->items_, producer_->count_, &put_count, is_blocking_);
+    NM_ATOMIC_INT_STORE(&producer_->is_flushing_, 0);
+
+    producer_->count_ -= put_count;
+    memmove(producer_->items_, producer_->items_ + put_count, producer_->count_ * sizeof(void*));
+
+    return status;
+}
+
+
+/* Flushes the staged items of the registered producers without blocking - of all of them (the queue is being closed),
+   or of the ones whose time bound expired */
+static void bbq_flush_producers(nm_blocking_bounded_queue* bbq_, int is_closing_)
+{
+    nm_bbq_producer* producer;
+    nm_uint64_t now = nm_time_now_ns();
+    int is_locked;
+
+    nm_mutex_lock(&bbq_->producers_mtx_);
+    for(producer = bbq_->producers_; producer; producer = producer->next_)
+    {
+        /* The owner holds the producer only briefly, unless it is blocked in a flush - then it flushes its items itself
+           (and finds the queue closed, if it is) */
+        is_locked = nm_mutex_trylock(&producer->mtx_);
+        while(!is_locked && is_closing_ && !NM_ATOMIC_INT_LOAD(&producer->is_flushing_))
+        {
+            thread_yield();
+            is_locked = nm_mutex_trylock(&producer->mtx_);
+        }
+
+        if(!is_locked)
+        {
+            continue;
+        }
+
+        if(is_closing_ || (producer->count_ > 0 && producer->max_delay_ms_ != NM_BBQ_WAIT_FOREVER
+                           && now - producer->first_put_ns_ >= (nm_uint64_t)producer->max_delay_ms_ * 1000000))
+        {
+            (void)producer_flush(producer, 0);
+        }
+        nm_mutex_unlock(&producer->mtx_);
+    }
+    nm_mutex_unlock(&bbq_->producers_mtx_);
+}
+
+
+static void bbq_flusher(void* bbq_)
+{
+    nm_blocking_bounded_queue* bbq = (nm_blocking_bounded_queue*)bbq_;
+    unsigned long interval_ms;
+
+    for(;;)
+    {
+        nm_mutex_lock(&bbq->producers_mtx_);
+        interval_ms = bbq->flush_interval_ms_;
+        nm_mutex_unlock(&bbq->producers_mtx_);
+
+        if(semaphore_acquire_ms(&bbq->flusher_wakeup_, 1, interval_ms) == 0)
+        {
+            break; /* Woken up by nm_blocking_bounded_queue_destroy */
+        }
+
+        bbq_flush_producers(bbq, 0);
+    }
+}
+
+
+/* --------------------------- nm_blocking_bounded_queue main API functions implementation --------------------------- */
+
+void nm_bbq_config_init(nm_bbq_config* config_, size_t capacity_)
+{
+    if(config_)
+    {
+        config_->capacity_ = capacity_;
+        config_->wake_policy_ = NM_BBQ_WAKE_DEFAULT;
+        config_->lock_kind_ = NM_BBQ_LOCK_MUTEX;
+        config_->mode_ = NM_BBQ_MODE_LOCKED;
+        config_->memory_budget_bytes_ = 0;
+        config_->memory_budget_callback_ = NULL;
+        config_->memory_budget_context_ = NULL;
+        config_->prefetch_distance_ = 0;
+        config_->prefetch_bytes_ = 0;
+        config_->slots_ = NM_BBQ_SLOTS_POINTER;
+        config_->compact_base_ = NULL;
+        config_->compact_shift_ = 0;
+        config_->spill_path_ = NULL;
+        config_->spill_buffer_bytes_ = 0;
+        config_->spill_encode_ = NULL;
+        config_->spill_decode_ = NULL;
+        config_->spill_release_ = NULL;
+        config_->spill_context_ = NULL;
+    }
+}
+
+
+nm_blocking_bounded_queue* nm_blocking_bounded_queue_create(size_t init_capacity_)
+{
+    nm_bbq_config config;
+
+    nm_bbq_config_init(&config, init_capacity_);
+    return nm_blocking_bounded_queue_create_ex(&config);
+}
+
+
+nm_blocking_bounded_queue* nm_blocking_bounded_queue_create_ex(const nm_bbq_config* config_)
+{
+    nm_blocking_bounded_queue* bbq = NULL;
+    size_t init_capacity;
+
+    if(!config_)
+    {
+        return NULL;
+    }
+
+    init_capacity = config_->capacity_;
+    if(init_capacity == 0 || init_capacity > (size_t)INT_MAX
+       || (config_->mode_ != NM_BBQ_MODE_LOCKED && config_->mode_ != NM_BBQ_MODE_COMBINING
+           && config_->mode_ != NM_BBQ_MODE_UNBOUNDED))
+    {
+        return NULL;
+    }
+
+    if(config_->mode_ == NM_BBQ_MODE_UNBOUNDED
+       && (config_->wake_policy_ != NM_BBQ_WAKE_DEFAULT || init_capacity > (size_t)INT_MAX / 2)) /* Leaves room for overshooting FAAs */
+    {
+        return NULL;
+    }
+
+    if(config_->slots_ != NM_BBQ_SLOTS_POINTER
+       && (config_->slots_ != NM_BBQ_SLOTS_COMPACT || config_->mode_ == NM_BBQ_MODE_UNBOUNDED
+           || config_->compact_shift_ >= sizeof(size_t) * CHAR_BIT))
+    {
+        return NULL;
+    }
+
+    if(config_->spill_path_
+       && (config_->mode_ != NM_BBQ_MODE_LOCKED || config_->slots_ != NM_BBQ_SLOTS_POINTER || !config_->spill_encode_
+           || !config_->spill_decode_ || (config_->spill_buffer_bytes_ != 0 && config_->spill_buffer_bytes_ <= SPILL_RECORD_HEADER)
+           || (nm_uint64_t)config_->spill_buffer_bytes_ > 0xFFFFFFFFULL)) /* The record sizes are 32 bits */
+    {
+        return NULL;
+    }
+
+    bbq = (nm_blocking_bounded_queue*)calloc(1, sizeof(nm_blocking_bounded_queue));
+    if(!bbq)
+    {
+        return NULL;
+    }
+
+    bbq->mode_ = config_->mode_;
+    bbq->prefetch_distance_ = config_->prefetch_distance_;
+    bbq->prefetch_lines_ = config_->prefetch_bytes_ / CACHE_LINE_SIZE + (config_->prefetch_bytes_ % CACHE_LINE_SIZE != 0);
+    if(bbq->prefetch_lines_ == 0)
+    {
+        bbq->prefetch_lines_ = 1;
+    }
+
+    if(bbq->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        bbq->segment_capacity_ = init_capacity;
+        bbq->lfq_head_ = lfq_segment_create(bbq, 0, NULL);
+        if(!bbq->lfq_head_)
+        {
+            free(bbq);
+            return NULL;
+        }
+
+        bbq->lfq_tail_ = bbq->lfq_head_;
+        bbq->segments_bytes_ = lfq_segment_size(bbq);
+        bbq->memory_budget_bytes_ = config_->memory_budget_bytes_;
+        bbq->memory_budget_callback_ = config_->memory_budget_callback_;
+        bbq->memory_budget_context_ = config_->memory_budget_context_;
+        nm_eventcount_init(&bbq->not_empty_);
+    }
+    else if(config_->slots_ == NM_BBQ_SLOTS_COMPACT)
+    {
+        bbq->compact_slots_ = (nm_uint32_t*)calloc(init_capacity, sizeof(nm_uint32_t));
+        if(!bbq->compact_slots_)
+        {
+            free(bbq);
+            return NULL;
+        }
+
+        bbq->compact_base_ = (size_t)config_->compact_base_;
+        bbq->compact_shift_ = config_->compact_shift_;
+        NM_QUEUE_INIT((&bbq->queue_), init_capacity);
+        bbq->capacity_ = init_capacity;
+    }
+    else
+    {
+        bbq->queue_.items_ = (void**)calloc(init_capacity, sizeof(void*));
+        if(!bbq->queue_.items_)
+        {
+            free(bbq);
+            return NULL;
+        }
+
+        NM_QUEUE_INIT((&bbq->queue_), init_capacity);
+        bbq->capacity_ = init_capacity;
+    }
+
+    if(bbq->mode_ == NM_BBQ_MODE_COMBINING)
+    {
+        bbq->combining_block_ = calloc(COMBINING_RECORDS + 1, sizeof(bbq_combining_record)); /* One spare for the alignment */
+        if(!bbq->combining_block_)
+        {
+            goto combining_init_failed;
+        }
+
+        bbq->combining_records_ = (bbq_combining_record*)(((size_t)bbq->combining_block_ + CACHE_LINE_SIZE - 1)
+                                                          & ~(size_t)(CACHE_LINE_SIZE - 1));
+    }
+
+    if(bbq_lock_init(bbq, bbq->mode_ == NM_BBQ_MODE_UNBOUNDED ? NM_BBQ_LOCK_MUTEX : config_->lock_kind_) != 0)
+    {
+        goto lock_init_failed;
+    }
+
+    if(nm_semaphore_init(&bbq->free_slots_, (unsigned int)init_capacity) != 0)
+    {
+        goto free_slots_init_failed;
+    }
+
+    if(nm_semaphore_init(&bbq->occupied_slots_, 0) != 0)
+    {
+        goto occupied_slots_init_failed;
+    }
+
+    if(nm_mutex_init(&bbq->producers_mtx_) != 0)
+    {
+        goto producers_mtx_init_failed;
+    }
+
+    if(config_->spill_path_)
+    {
+        bbq->spill_ = bbq_spill_create(config_);
+        if(!bbq->spill_)
+        {
+            goto spill_init_failed;
+        }
+    }
+
+    NM_ATOMIC_VALUE_SET(&bbq->enq_waiters_, 0);
+    NM_ATOMIC_VALUE_SET(&bbq->deq_waiters_, 0);
+    NM_ATOMIC_FLAG_SET(&bbq->is_destroying_, 0);
+    bbq->wake_policy_ = config_->wake_policy_;
+    NM_ATOMIC_FLAG_SET(&bbq->is_valid_, 1);
+    return bbq;
+
+spill_init_failed:
+    nm_mutex_destroy(&bbq->producers_mtx_);
+producers_mtx_init_failed:
+    nm_semaphore_destroy(&bbq->occupied_slots_);
+occupied_slots_init_failed:
+    nm_semaphore_destroy(&bbq->free_slots_);
+free_slots_init_failed:
+    bbq_lock_destroy(bbq);
+lock_init_failed:
+    free(bbq->combining_block_);
+combining_init_failed:
+    free(bbq->queue_.items_);
+    free(bbq->compact_slots_);
+    free(bbq->lfq_head_);
+    free(bbq);
+    return NULL;
+}
+
+
+void nm_blocking_bounded_queue_destroy(nm_blocking_bounded_queue** bbq_, bbq_destruction_policy_callback callback_, void* callback_context_)
+{
+    nm_blocking_bounded_queue* bbq;
+    size_t enq_waiters;
+    size_t deq_waiters;
+    void* item;
+    int result;
+
+    if(!bbq_ || !*bbq_)
+    {
+        return;
+    }
+
+    bbq = *bbq_;
+    if(bbq->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        lfq_destroy(bbq, callback_, callback_context_);
+    }
+    else
+    {
+        bbq_invalidate(bbq, 1, &enq_waiters, &deq_waiters);
+
+        /* Waits for all the woken waiters to leave the queue */
+        nm_barrier_wait(&bbq->enq_waiters_barrier_);
+        nm_barrier_wait(&bbq->deq_waiters_barrier_);
+
+        while(!IS_EMPTY(&bbq->queue_))
+        {
+            bbq_ring_take(bbq, &item);
+            if(callback_)
+            {
+                callback_(item, callback_context_);
+            }
+        }
+
+        if(bbq->spill_)
+        {
+            while(callback_ && (result = bbq_spill_take(bbq->spill_, &item)) != 0) /* Without a destruction policy there is nothing to decode for */
+            {
+                if(result > 0)
+                {
+                    callback_(item, callback_context_);
+                }
+                else if(bbq_spill_read_ahead(bbq) != 0)
+                {
+                    break; /* The records that cannot be read are discarded */
+                }
+            }
+            bbq_spill_destroy(bbq->spill_);
+        }
+
+        nm_barrier_destroy(&bbq->enq_waiters_barrier_);
+        nm_barrier_destroy(&bbq->deq_waiters_barrier_);
+    }
+
+    if(bbq->has_flusher_)
+    {
+        nm_semaphore_release_n(&bbq->flusher_wakeup_, 1);
+        nm_thread_join(&bbq->flusher_);
+        nm_semaphore_destroy(&bbq->flusher_wakeup_);
+    }
+
+    nm_mutex_destroy(&bbq->producers_mtx_);
+    nm_semaphore_destroy(&bbq->occupied_slots_);
+    nm_semaphore_destroy(&bbq->free_slots_);
+    bbq_lock_destroy(bbq);
+    free(bbq->combining_block_);
+    free(bbq->put_stamps_);
+    free(bbq->queue_.items_);
+    free(bbq->compact_slots_);
+    free(bbq->standby_items_);
+    free(bbq);
+    *bbq_ = NULL;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_close(nm_blocking_bounded_queue* bbq_)
+{
+    size_t enq_waiters;
+    size_t deq_waiters;
+
+    if(!bbq_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    bbq_flush_producers(bbq_, 1); /* The staged items go in before the queue stops accepting items */
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_invalidate(bbq_, 0) ? NM_BBQ_SUCCESS : NM_BBQ_IS_CLOSED;
+    }
+
+    return bbq_invalidate(bbq_, 0, &enq_waiters, &deq_waiters) ? NM_BBQ_SUCCESS : NM_BBQ_IS_CLOSED;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_put(nm_blocking_bounded_queue* bbq_, void* item_)
+{
+    nm_bbq_status status;
+    size_t put_count;
+
+    if(!bbq_ || !item_ || !bbq_is_encodable(bbq_, item_))
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_put(bbq_, item_);
+    }
+
+    if(bbq_->spill_)
+    {
+        return bbq_spill_put_items(bbq_, &item_, 1, &put_count);
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_COMBINING && nm_semaphore_try_acquire_n(&bbq_->free_slots_, 1))
+    {
+        status = bbq_combined_op(bbq_, COMBINING_PUT, item_, NULL);
+        if(status == NM_BBQ_IS_CLOSED)
+        {
+            nm_semaphore_release_n(&bbq_->free_slots_, 1); /* Passes the unit on, like bbq_acquire_slot */
+        }
+
+        return status;
+    }
+
+    status = bbq_acquire_slot(bbq_, &bbq_->free_slots_, &bbq_->enq_waiters_, &bbq_->enq_waiters_barrier_, NM_BBQ_WAIT_FOREVER);
+    if(status != NM_BBQ_SUCCESS)
+    {
+        return status;
+    }
+
+    bbq_ring_put(bbq_, item_);
+    bbq_publish_items(bbq_, 1);
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_put_n(nm_blocking_bounded_queue* bbq_, void** items_, size_t count_, size_t* put_count_ptr_)
+{
+    nm_bbq_status status;
+    size_t put_count;
+    size_t i;
+
+    if(put_count_ptr_)
+    {
+        *put_count_ptr_ = 0;
+    }
+
+    if(!bbq_ || (!items_ && count_ > 0))
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    for(i = 0; i < count_; ++i)
+    {
+        if(!items_[i] || !bbq_is_encodable(bbq_, items_[i]))
+        {
+            return NM_BBQ_UNINITIALIZED_ERROR;
+        }
+    }
+
+    status = bbq_put_items(bbq_, items_, count_, &put_count, 1);
+    if(put_count_ptr_)
+    {
+        *put_count_ptr_ = put_count;
+    }
+
+    return status;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_)
+{
+    return bbq_take(bbq_, item_ptr_, NM_BBQ_WAIT_FOREVER);
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_take_timed(nm_blocking_bounded_queue* bbq_, void** item_ptr_, unsigned long timeout_ms_)
+{
+    return bbq_take(bbq_, item_ptr_, timeout_ms_);
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_take_n(nm_blocking_bounded_queue* bbq_, void** items_, size_t max_items_, size_t* taken_count_ptr_)
+{
+    nm_bbq_status status;
+    size_t taken_count;
+
+    if(taken_count_ptr_)
+    {
+        *taken_count_ptr_ = 0;
+    }
+
+    if(!bbq_ || !items_ || max_items_ == 0)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        status = lfq_take(bbq_, items_, NM_BBQ_WAIT_FOREVER);
+        if(status != NM_BBQ_SUCCESS)
+        {
+            return status;
+        }
+
+        nm_epoch_enter(); /* The thread is already registered by lfq_take */
+        for(taken_count = 1; taken_count < max_items_ && lfq_dequeue(bbq_, &items_[taken_count]); ++taken_count);
+        nm_epoch_exit();
+    }
+    else
+    {
+        if(bbq_->spill_ && NM_ATOMIC_INT_LOAD_RELAXED(&bbq_->spill_->is_failed_) && bbq_spill_recover(bbq_) != 0)
+        {
+            return NM_BBQ_IO_ERROR;
+        }
+
+        /* Blocks for the first item only, the rest are the items that are already there */
+        if(bbq_->wake_policy_ == NM_BBQ_WAKE_DEFAULT)
+        {
+            status = bbq_acquire_slot(bbq_, &bbq_->occupied_slots_, &bbq_->deq_waiters_, &bbq_->deq_waiters_barrier_,
+                                      NM_BBQ_WAIT_FOREVER);
+        }
+        else
+        {
+            status = bbq_acquire_item_parked(bbq_, NM_BBQ_WAIT_FOREVER);
+        }
+
+        if(status != NM_BBQ_SUCCESS)
+        {
+            return status;
+        }
+
+        taken_count = 1 + bbq_try_acquire_units(&bbq_->occupied_slots_, max_items_ - 1);
+        bbq_ring_take_n(bbq_, items_, taken_count);
+        bbq_release_slots(bbq_, (unsigned int)taken_count); /* A spill tier refills them in a single bulk move */
+    }
+
+    /* Outside of the lock: the misses on the payloads overlap each other, instead of stalling the caller one by one */
+    PREFETCH_PAYLOADS(bbq_, items_, taken_count < bbq_->prefetch_distance_ ? taken_count : bbq_->prefetch_distance_);
+
+    if(taken_count_ptr_)
+    {
+        *taken_count_ptr_ = taken_count;
+    }
+    return NM_BBQ_SUCCESS;
+}
+
+
+void nm_blocking_bounded_queue_prefetch(nm_blocking_bounded_queue* bbq_, void* const* items_, size_t count_)
+{
+    if(bbq_ && items_)
+    {
+        PREFETCH_PAYLOADS(bbq_, items_, count_);
+    }
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_resize(nm_blocking_bounded_queue* bbq_, size_t new_capacity_)
+{
+    size_t grow_units = 0;
+
+    if(!bbq_ || new_capacity_ == 0 || new_capacity_ > (size_t)INT_MAX)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED || bbq_->compact_slots_ || bbq_->spill_)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR; /* Has no capacity to change, or no pointer ring to reallocate */
+    }
+
+    bbq_lock(bbq_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(new_capacity_ > bbq_->capacity_)
+    {
+        if(new_capacity_ > bbq_->queue_.capacity_ && bbq_resize_ring(bbq_, new_capacity_) != 0)
+        {
+            bbq_unlock(bbq_);
+            return NM_BBQ_ALLOCATION_ERROR;
+        }
+
+        /* Cancels the units that a pending shrink did not withdraw yet, before adding new ones */
+        grow_units = new_capacity_ - bbq_->capacity_;
+        if(bbq_->shrink_debt_ >= grow_units)
+        {
+            bbq_->shrink_debt_ -= grow_units;
+            grow_units = 0;
+        }
+        else
+        {
+            grow_units -= bbq_->shrink_debt_;
+            bbq_->shrink_debt_ = 0;
+        }
+    }
+    else if(new_capacity_ < bbq_->capacity_)
+    {
+        /* Withdraws the free units that are available now, the takers pay the rest lazily */
+        bbq_->shrink_debt_ += bbq_->capacity_ - new_capacity_;
+        bbq_->shrink_debt_ -= bbq_try_acquire_units(&bbq_->free_slots_, bbq_->shrink_debt_);
+    }
+
+    bbq_->capacity_ = new_capacity_;
+    if(bbq_->shrink_debt_ == 0 && bbq_->queue_.capacity_ > new_capacity_)
+    {
+        (void)bbq_resize_ring(bbq_, new_capacity_); /* Best effort, as in bbq_pay_shrink_debt */
+    }
+    bbq_unlock(bbq_);
+
+    if(grow_units > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, (unsigned int)grow_units); /* Wakes the blocked producers */
+    }
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_drain_all(nm_blocking_bounded_queue* bbq_, nm_bbq_span* span_)
+{
+    void** standby = NULL;
+    size_t standby_capacity = 0;
+    void** items;
+    size_t capacity;
+    size_t head;
+    size_t drained;
+    size_t reserved;
+    size_t reserved_head;
+    size_t first_part;
+    size_t free_units;
+
+    if(!bbq_ || !span_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED || bbq_->compact_slots_ || bbq_->spill_)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR; /* Has no single ring buffer of items to swap */
+    }
+
+    span_->first_ = NULL;
+    span_->first_count_ = 0;
+    span_->second_ = NULL;
+    span_->second_count_ = 0;
+    span_->buffer_ = NULL;
+    span_->buffer_capacity_ = 0;
+
+    bbq_lock(bbq_);
+    for(;;) /* Gets an empty buffer of the ring's size - allocates it with the queue unlocked, if no standby fits */
+    {
+        if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+        {
+            bbq_unlock(bbq_);
+            free(standby);
+            return NM_BBQ_IS_CLOSED;
+        }
+
+        if(!standby && bbq_->standby_items_)
+        {
+            standby = bbq_->standby_items_;
+            standby_capacity = bbq_->standby_capacity_;
+            bbq_->standby_items_ = NULL;
+        }
+
+        if(standby && standby_capacity == bbq_->queue_.capacity_)
+        {
+            break;
+        }
+
+        capacity = bbq_->queue_.capacity_; /* The ring was resized since the standby was made */
+        bbq_unlock(bbq_);
+
+        free(standby);
+        standby = (void**)calloc(capacity, sizeof(void*));
+        if(!standby)
+        {
+            return NM_BBQ_ALLOCATION_ERROR;
+        }
+        standby_capacity = capacity;
+
+        bbq_lock(bbq_);
+    }
+
+    /* Only the items whose units are acquired here are drained - the rest are reserved by takers that wait for the lock */
+    drained = bbq_try_acquire_units(&bbq_->occupied_slots_, bbq_->queue_.items_count_);
+    if(drained == 0)
+    {
+        bbq_->standby_items_ = standby;
+        bbq_->standby_capacity_ = standby_capacity;
+        bbq_unlock(bbq_);
+        return NM_BBQ_SUCCESS;
+    }
+
+    items = bbq_->queue_.items_;
+    capacity = bbq_->queue_.capacity_;
+    head = bbq_->queue_.head_;
+    reserved = bbq_->queue_.items_count_ - drained;
+    reserved_head = (head + drained) % capacity;
+    first_part = capacity - reserved_head < reserved ? capacity - reserved_head : reserved;
+
+    /* The reserved items keep their slots (and so their put stamps) - copies them into the standby, in up to 2 copies */
+    memcpy(standby + reserved_head, items + reserved_head, first_part * sizeof(void*));
+    memcpy(standby, items, (reserved - first_part) * sizeof(void*));
+
+    bbq_->queue_.items_ = standby;
+    bbq_->queue_.head_ = reserved_head;
+    bbq_->queue_.items_count_ = reserved;
+    free_units = bbq_pay_shrink_debt(bbq_, (unsigned int)drained);
+    bbq_unlock(bbq_);
+
+    if(free_units > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, (unsigned int)free_units); /* Wakes the blocked producers */
+    }
+
+    span_->first_ = items + head;
+    span_->first_count_ = capacity - head < drained ? capacity - head : drained;
+    span_->second_count_ = drained - span_->first_count_;
+    span_->second_ = span_->second_count_ > 0 ? items : NULL;
+    span_->buffer_ = items;
+    span_->buffer_capacity_ = capacity;
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+void nm_blocking_bounded_queue_drain_release(nm_blocking_bounded_queue* bbq_, nm_bbq_span* span_)
+{
+    void** buffer;
+
+    if(!bbq_ || !span_ || !span_->buffer_)
+    {
+        return;
+    }
+
+    buffer = (void**)span_->buffer_;
+    memset(buffer, 0, span_->buffer_capacity_ * sizeof(void*)); /* The free slots of a ring are NULLs */
+
+    bbq_lock(bbq_);
+    if(!bbq_->standby_items_ && span_->buffer_capacity_ == bbq_->queue_.capacity_)
+    {
+        bbq_->standby_items_ = buffer;
+        bbq_->standby_capacity_ = span_->buffer_capacity_;
+        buffer = NULL;
+    }
+    bbq_unlock(bbq_);
+
+    free(buffer); /* A standby is already kept, or the ring was resized */
+    span_->buffer_ = NULL;
+    span_->first_ = NULL;
+    span_->second_ = NULL;
+    span_->first_count_ = 0;
+    span_->second_count_ = 0;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_transfer(nm_blocking_bounded_queue* dst_, nm_blocking_bounded_queue* src_, size_t max_items_,
+                                                size_t* transferred_ptr_)
+{
+    nm_blocking_bounded_queue* first;
+    nm_blocking_bounded_queue* second;
+    size_t units;
+    size_t moved;
+    unsigned int free_units = 0;
+
+    if(!dst_ || !src_ || dst_ == src_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(transferred_ptr_)
+    {
+        *transferred_ptr_ = 0;
+    }
+
+    if(dst_->compact_slots_ || src_->compact_slots_ || dst_->spill_ || src_->spill_)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR; /* The rings are moved as they are, slots of different kinds (or tiers) do not mix */
+    }
+
+    if(dst_->mode_ == NM_BBQ_MODE_UNBOUNDED || src_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_transfer(dst_, src_, max_items_, transferred_ptr_);
+    }
+
+    /* A fixed global (address) order, so two opposite transfers cannot deadlock */
+    first = (size_t)dst_ < (size_t)src_ ? dst_ : src_;
+    second = first == dst_ ? src_ : dst_;
+    bbq_lock(first);
+    bbq_lock(second);
+
+    if(!NM_ATOMIC_FLAG_LOAD(&dst_->is_valid_) || !NM_ATOMIC_FLAG_LOAD(&src_->is_valid_))
+    {
+        bbq_unlock(second);
+        bbq_unlock(first);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    /* Moves only items whose units are acquired on both sides - the rest belong to threads that wait for the locks */
+    units = bbq_try_acquire_units(&dst_->free_slots_, max_items_ < src_->queue_.items_count_ ? max_items_
+                                                                                             : src_->queue_.items_count_);
+    moved = bbq_try_acquire_units(&src_->occupied_slots_, units);
+    if(units > moved)
+    {
+        nm_semaphore_release_n(&dst_->free_slots_, (unsigned int)(units - moved));
+    }
+
+    if(moved > 0)
+    {
+        bbq_ring_move(dst_, src_, moved);
+        free_units = bbq_pay_shrink_debt(src_, (unsigned int)moved);
+    }
+
+    bbq_publish_items(dst_, (unsigned int)moved); /* Wakes the takers of dst_, and unlocks it */
+    bbq_unlock(src_);
+
+    if(free_units > 0)
+    {
+        nm_semaphore_release_n(&src_->free_slots_, free_units); /* Wakes the producers of src_ */
+    }
+
+    if(transferred_ptr_)
+    {
+        *transferred_ptr_ = moved;
+    }
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_take_if(nm_blocking_bounded_queue* bbq_, bbq_predicate_callback predicate_, void* context_,
+                                               void** item_ptr_)
+{
+    queue_type* queue;
+    size_t idx;
+    size_t prev_idx;
+    size_t i;
+    unsigned int free_units;
+
+    if(!bbq_ || !predicate_ || !item_ptr_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED || bbq_->compact_slots_ || bbq_->spill_)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR; /* Its items cannot be removed from the middle, or passed to the predicate in place */
+    }
+
+    bbq_lock(bbq_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    if(!nm_semaphore_try_acquire_n(&bbq_->occupied_slots_, 1)) /* All the items are reserved by blocked takers */
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_NOT_FOUND;
+    }
+
+    queue = &bbq_->queue_;
+    idx = queue->head_;
+    for(i = 0; i < queue->items_count_ && !predicate_(queue->items_[idx], context_); ++i)
+    {
+        if(++idx == queue->capacity_)
+        {
+            idx = 0;
+        }
+    }
+
+    if(i == queue->items_count_)
+    {
+        nm_semaphore_release_n(&bbq_->occupied_slots_, 1);
+        bbq_unlock(bbq_);
+        return NM_BBQ_NOT_FOUND;
+    }
+
+    *item_ptr_ = queue->items_[idx];
+    while(idx != queue->head_) /* Shifts the items before it by one slot - the cost is in the position of the match */
+    {
+        prev_idx = (idx + queue->capacity_ - 1) % queue->capacity_;
+        queue->items_[idx] = queue->items_[prev_idx];
+        if(bbq_->put_stamps_)
+        {
+            bbq_->put_stamps_[idx] = bbq_->put_stamps_[prev_idx];
+        }
+        idx = prev_idx;
+    }
+
+    queue->items_[queue->head_] = NULL;
+    queue->head_ = (queue->head_ + 1) % queue->capacity_;
+    --queue->items_count_;
+    free_units = bbq_pay_shrink_debt(bbq_, 1);
+    bbq_unlock(bbq_);
+
+    if(free_units > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, free_units);
+    }
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_blocking_bounded_queue_remove_if(nm_blocking_bounded_queue* bbq_, bbq_predicate_callback predicate_, void* context_,
+                                                 bbq_destruction_policy_callback release_, size_t* removed_ptr_)
+{
+    void* stack_items[REMOVE_IF_STACK_ITEMS];
+    void** removed_items = stack_items;
+    queue_type* queue;
+    size_t units;
+    size_t removed;
+    size_t idx;
+    size_t i;
+    unsigned int free_units = 0;
+
+    if(!bbq_ || !predicate_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(removed_ptr_)
+    {
+        *removed_ptr_ = 0;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED || bbq_->compact_slots_ || bbq_->spill_)
+    {
+        return NM_BBQ_UNSUPPORTED_ERROR;
+    }
+
+    bbq_lock(bbq_);
+    if(!NM_ATOMIC_FLAG_LOAD(&bbq_->is_valid_))
+    {
+        bbq_unlock(bbq_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    /* Only as many items as the acquired units are removed - the rest are reserved by blocked takers */
+    queue = &bbq_->queue_;
+    units = bbq_try_acquire_units(&bbq_->occupied_slots_, queue->items_count_);
+    removed = bbq_ring_remove_if(bbq_, predicate_, context_, units);
+    if(units > removed)
+    {
+        nm_semaphore_release_n(&bbq_->occupied_slots_, (unsigned int)(units - removed));
+    }
+
+    if(removed > 0)
+    {
+        if(release_ && removed > REMOVE_IF_STACK_ITEMS)
+        {
+            removed_items = (void**)malloc(removed * sizeof(void*));
+        }
+
+        if(release_ && removed_items) /* Released once the queue is unlocked */
+        {
+            ring_copy_span(removed_items, queue->items_, sizeof(void*), queue->capacity_, queue->tail_, removed);
+        }
+
+        idx = queue->tail_;
+        for(i = 0; i < removed; ++i)
+        {
+            if(release_ && !removed_items) /* No memory to collect them - releases them with the queue locked */
+            {
+                release_(queue->items_[idx], context_);
+            }
+            queue->items_[idx] = NULL;
+            idx = (idx + 1) % queue->capacity_;
+        }
+
+        free_units = bbq_pay_shrink_debt(bbq_, (unsigned int)removed);
+    }
+    bbq_unlock(bbq_);
+
+    if(free_units > 0)
+    {
+        nm_semaphore_release_n(&bbq_->free_slots_, free_units); /* Wakes the blocked producers */
+    }
+
+    if(release_ && removed_items && removed > 0)
+    {
+        for(i = 0; i < removed; ++i)
+        {
+            release_(removed_items[i], context_);
+        }
+    }
+
+    if(removed_items != stack_items)
+    {
+        free(removed_items);
+    }
+
+    if(removed_ptr_)
+    {
+        *removed_ptr_ = removed;
+    }
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+size_t nm_blocking_bounded_queue_snapshot(nm_blocking_bounded_queue* bbq_, void** items_, size_t max_items_)
+{
+    size_t copied;
+    size_t idx;
+    size_t i;
+
+    if(!bbq_ || !items_)
+    {
+        return MAX_SIZE_T;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_snapshot(bbq_, items_, max_items_);
+    }
+
+    /* The critical section is only the copy of the (up to) 2 spans of the ring */
+    bbq_lock(bbq_);
+    copied = bbq_->queue_.items_count_ < max_items_ ? bbq_->queue_.items_count_ : max_items_;
+    if(!bbq_->compact_slots_)
+    {
+        ring_copy_span(items_, bbq_->queue_.items_, sizeof(void*), bbq_->queue_.capacity_, bbq_->queue_.head_, copied);
+    }
+    else
+    {
+        for(i = 0, idx = bbq_->queue_.head_; i < copied; ++i, idx = idx + 1 == bbq_->queue_.capacity_ ? 0 : idx + 1)
+        {
+            items_[i] = (void*)(bbq_->compact_base_ + ((size_t)bbq_->compact_slots_[idx] << bbq_->compact_shift_));
+        }
+    }
+    bbq_unlock(bbq_);
+
+    return copied;
+}
+
+
+int nm_blocking_bounded_queue_contains(nm_blocking_bounded_queue* bbq_, const void* item_)
+{
+    size_t position;
+    nm_uint32_t slot;
+    size_t idx;
+    int is_found = 0;
+
+    if(!bbq_ || bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return -1;
+    }
+
+    if(bbq_->compact_slots_)
+    {
+        if(!bbq_is_encodable(bbq_, item_))
+        {
+            return 0; /* Could not have been put */
+        }
+
+        slot = (nm_uint32_t)(((size_t)item_ - bbq_->compact_base_) >> bbq_->compact_shift_);
+        bbq_lock(bbq_);
+        for(position = 0, idx = bbq_->queue_.head_; position < bbq_->queue_.items_count_ && !is_found; ++position)
+        {
+            is_found = bbq_->compact_slots_[idx] == slot;
+            idx = idx + 1 == bbq_->queue_.capacity_ ? 0 : idx + 1;
+        }
+        bbq_unlock(bbq_);
+
+        return is_found;
+    }
+
+    bbq_lock(bbq_);
+    position = nm_queue_find(&bbq_->queue_, item_);
+    bbq_unlock(bbq_);
+
+    return position != MAX_SIZE_T;
+}
+
+
+size_t nm_blocking_bounded_queue_size(nm_blocking_bounded_queue* bbq_)
+{
+    size_t size;
+
+    if(!bbq_)
+    {
+        return MAX_SIZE_T;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        return lfq_size(bbq_);
+    }
+
+    bbq_lock(bbq_);
+    size = bbq_->queue_.items_count_ + (bbq_->spill_ ? bbq_->spill_->count_ : 0);
+    bbq_unlock(bbq_);
+
+    return size;
+}
+
+
+int nm_blocking_bounded_queue_is_empty(nm_blocking_bounded_queue* bbq_)
+{
+    size_t size;
+    int is_empty;
+
+    if(!bbq_)
+    {
+        return -1;
+    }
+
+    if(bbq_->mode_ == NM_BBQ_MODE_UNBOUNDED)
+    {
+        size = lfq_size(bbq_);
+        return size == MAX_SIZE_T ? -1 : size == 0;
+    }
+
+    bbq_lock(bbq_);
+    is_empty = IS_EMPTY(&bbq_->queue_);
+    bbq_unlock(bbq_);
+
+    return is_empty;
+}
+
+/* ------------------------ End of nm_blocking_bounded_queue main API functions implementation ----------------------- */
+
+/* ------------------------------------------ End of Blocking Bounded Queue -------------------------------------- */
+
+
+/* -------------------------------------------- BBQ Consumer Group: ---------------------------------------------- */
+
+/* Defines: */
+
+#define CONSUMER_GROUP_DEFAULT_MIN_CONSUMERS 1
+#define CONSUMER_GROUP_DEFAULT_MAX_CONSUMERS 8
+#define CONSUMER_GROUP_DEFAULT_TARGET_SOJOURN_US 1000
+#define CONSUMER_GROUP_DEFAULT_SAMPLE_INTERVAL_MS 10
+#define CONSUMER_GROUP_DEFAULT_SCALE_UP_SAMPLES 3
+#define CONSUMER_GROUP_DEFAULT_IDLE_RETIRE_MS 2000
+#define CONSUMER_GROUP_DEFAULT_SCALE_DOWN_PERCENT 25
+
+typedef enum consumer_slot_state
+{
+    CONSUMER_SLOT_FREE,
+    CONSUMER_SLOT_RUNNING,
+    CONSUMER_SLOT_EXITED
+} consumer_slot_state;
+
+typedef struct consumer_slot
+{
+    nm_thread_t thread_;
+    consumer_slot_state state_;
+    nm_bbq_consumer_group* group_;
+} consumer_slot;
+
+struct nm_bbq_consumer_group
+{
+    nm_blocking_bounded_queue* bbq_;
+    bbq_consumer_callback callback_;
+    void* callback_context_;
+    nm_bbq_consumer_group_config config_;
+    consumer_slot* slots_;
+    nm_thread_t supervisor_;
+    nm_mutex_t mtx_; /* Guards the slots states and all the counters below */
+    nm_semaphore_t supervisor_wakeup_;
+    nm_semaphore_t retry_wait_; /* Never released - a consumer waits on it for a sample interval before it retries a failed take */
+    unsigned int active_consumers_;
+    unsigned int retire_requests_;
+    unsigned int samples_above_target_;
+    unsigned int samples_below_target_;
+    nm_atomic_flag_t is_running_;
+    nm_atomic_flag_t is_bbq_closed_;
+    int has_supervisor_;
+};
+
+
+/* ------------------------------------- Consumer group internal helpers --------------------------------------- */
+
+/* Must be called with the group locked, returns 0 if the consumer should keep running */
+static int consumer_try_retire(consumer_slot* slot_)
+{
+    nm_bbq_consumer_group* group = slot_->group_;
+
+    if(NM_ATOMIC_FLAG_LOAD(&group->is_running_) && !NM_ATOMIC_FLAG_LOAD(&group->is_bbq_closed_))
+    {
+        if(group->retire_requests_ == 0 || group->active_consumers_ <= group->config_.min_consumers_)
+        {
+            return 0;
+        }
+
+        --group->retire_requests_;
+    }
+
+    --group->active_consumers_;
+    slot_->state_ = CONSUMER_SLOT_EXITED; /* The supervisor (or the destroying thread) joins the exited thread */
+    return 1;
+}
+
+
+static void consumer_routine(void* slot_)
+{
+    consumer_slot* slot = (consumer_slot*)slot_;
+    nm_bbq_consumer_group* group = slot->group_;
+    nm_bbq_status status;
+    void* item;
+    int should_exit;
+
+    for(;;)
+    {
+        /* A consumer that waits for a whole sample interval is idle - it is parked in the queue until then */
+        status = nm_blocking_bounded_queue_take_timed(group->bbq_, &item, group->config_.sample_interval_ms_);
+        if(status == NM_BBQ_SUCCESS)
+        {
+            group->callback_(item, group->callback_context_);
+            if(NM_ATOMIC_FLAG_LOAD(&group->is_running_))
+            {
+                continue;
+            }
+        }
+        else if(status == NM_BBQ_IS_CLOSED)
+        {
+            NM_ATOMIC_FLAG_SET(&group->is_bbq_closed_, 1);
+        }
+        else if(status != NM_BBQ_TIMEOUT)
+        {
+            /* A failed take (NM_BBQ_IO_ERROR of a spill tier) is retried by the next take, after an idle interval */
+            (void)semaphore_acquire_ms(&group->retry_wait_, 1, group->config_.sample_interval_ms_);
+        }
+
+        nm_mutex_lock(&group->mtx_);
+        should_exit = consumer_try_retire(slot);
+        nm_mutex_unlock(&group->mtx_);
+
+        if(should_exit)
+        {
+            return;
+        }
+    }
+}
+
+
+/* Must be called with the group locked */
+static int consumer_group_spawn(nm_bbq_consumer_group* group_)
+{
+    unsigned int i;
+
+    for(i = 0; i < group_->config_.max_consumers_; ++i)
+    {
+        if(group_->slots_[i].state_ == CONSUMER_SLOT_FREE)
+        {
+            group_->slots_[i].state_ = CONSUMER_SLOT_RUNNING;
+            if(nm_thread_create(&group_->slots_[i].thread_, consumer_routine, &group_->slots_[i]) != 0)
+            {
+                group_->slots_[i].state_ = CONSUMER_SLOT_FREE;
+                return -1;
+            }
+
+            ++group_->active_consumers_;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Joins all the consumer threads that have exited, and frees their slots */
+static void consumer_group_reap(nm_bbq_consumer_group* group_)
+{
+    unsigned int i;
+    int is_exited;
+
+    for(i = 0; i < group_->config_.max_consumers_; ++i)
+    {
+        nm_mutex_lock(&group_->mtx_);
+        is_exited = group_->slots_[i].state_ == CONSUMER_SLOT_EXITED;
+        nm_mutex_unlock(&group_->mtx_);
+
+        if(is_exited)
+        {
+            nm_thread_join(&group_->slots_[i].thread_);
+
+            nm_mutex_lock(&group_->mtx_);
+            group_->slots_[i].state_ = CONSUMER_SLOT_FREE;
+            nm_mutex_unlock(&group_->mtx_);
+        }
+    }
+}
+
+
+/* Samples the queue latency, and scales the group up or down (with hysteresis) */
+static void consumer_group_scale(nm_bbq_consumer_group* group_, nm_uint64_t latency_ns_)
+{
+    nm_bbq_consumer_group_config* config = &group_->config_;
+    nm_uint64_t target_ns = (nm_uint64_t)config->target_sojourn_us_ * 1000;
+    nm_uint64_t low_watermark_ns = target_ns * config->scale_down_percent_ / 100;
+    unsigned long idle_samples = config->idle_retire_ms_ / config->sample_interval_ms_;
+
+    nm_mutex_lock(&group_->mtx_);
+    if(NM_ATOMIC_FLAG_LOAD(&group_->is_bbq_closed_))
+    {
+        nm_mutex_unlock(&group_->mtx_);
+        return;
+    }
+
+    if(latency_ns_ > target_ns)
+    {
+        group_->samples_below_target_ = 0;
+        group_->retire_requests_ = 0; /* The latency is high again - retiring consumers is no longer needed */
+        if(++group_->samples_above_target_ >= config->scale_up_samples_ && group_->active_consumers_ < config->max_consumers_)
+        {
+            consumer_group_spawn(group_);
+            group_->samples_above_target_ = 0;
+        }
+    }
+    else if(latency_ns_ < low_watermark_ns)
+    {
+        group_->samples_above_target_ = 0;
+        if(++group_->samples_below_target_ >= idle_samples
+           && group_->active_consumers_ > config->min_consumers_ + group_->retire_requests_)
+        {
+            ++group_->retire_requests_; /* The next consumer that stays idle for a whole interval retires */
+            group_->samples_below_target_ = 0;
+        }
+    }
+    else /* Inside the hysteresis band - the group size is right */
+    {
+        group_->samples_above_target_ = 0;
+        group_->samples_below_target_ = 0;
+    }
+
+    while(group_->active_consumers_ < config->min_consumers_ && consumer_group_spawn(group_) == 0);
+    nm_mutex_unlock(&group_->mtx_);
+}
+
+
+static void consumer_group_supervisor(void* group_)
+{
+    nm_bbq_consumer_group* group = (nm_bbq_consumer_group*)group_;
+
+    while(NM_ATOMIC_FLAG_LOAD(&group->is_running_))
+    {
+        if(semaphore_acquire_ms(&group->supervisor_wakeup_, 1, group->config_.sample_interval_ms_) == 0)
+        {
+            break; /* Woken up by nm_bbq_consumer_group_destroy */
+        }
+
+        consumer_group_reap(group);
+        consumer_group_scale(group, bbq_latency_ns(group->bbq_));
+    }
+}
+
+
+/* ------------------------------ nm_bbq_consumer_group main API functions implementation ------------------------------ */
+
+void nm_bbq_consumer_group_config_init(nm_bbq_consumer_group_config* config_)
+{
+    if(config_)
+    {
+        config_->min_consumers_ = CONSUMER_GROUP_DEFAULT_MIN_CONSUMERS;
+        config_->max_consumers_ = CONSUMER_GROUP_DEFAULT_MAX_CONSUMERS;
+        config_->target_sojourn_us_ = CONSUMER_GROUP_DEFAULT_TARGET_SOJOURN_US;
+        config_->sample_interval_ms_ = CONSUMER_GROUP_DEFAULT_SAMPLE_INTERVAL_MS;
+        config_->scale_up_samples_ = CONSUMER_GROUP_DEFAULT_SCALE_UP_SAMPLES;
+        config_->idle_retire_ms_ = CONSUMER_GROUP_DEFAULT_IDLE_RETIRE_MS;
+        config_->scale_down_percent_ = CONSUMER_GROUP_DEFAULT_SCALE_DOWN_PERCENT;
+    }
+}
+
+
+nm_bbq_consumer_group* nm_bbq_consumer_group_create(nm_blocking_bounded_queue* bbq_, bbq_consumer_callback callback_, void* callback_context_, const nm_bbq_consumer_group_config* config_)
+{
+    nm_bbq_consumer_group* group = NULL;
+    unsigned int i;
+
+    if(!bbq_ || !callback_)
+    {
+        return NULL;
+    }
+
+    group = (nm_bbq_consumer_group*)calloc(1, sizeof(nm_bbq_consumer_group));
+    if(!group)
+    {
+        return NULL;
+    }
+
+    if(config_)
+    {
+        group->config_ = *config_;
+    }
+    else
+    {
+        nm_bbq_consumer_group_config_init(&group->config_);
+    }
+
+    if(group->config_.max_consumers_ == 0 || group->config_.max_consumers_ < group->config_.min_consumers_
+       || group->config_.sample_interval_ms_ == 0 || group->config_.sample_interval_ms_ == NM_BBQ_WAIT_FOREVER)
+    {
+        free(group);
+        return NULL;
+    }
+
+    group->slots_ = (consumer_slot*)calloc(group->config_.max_consumers_, sizeof(consumer_slot));
+    if(!group->slots_)
+    {
+        free(group);
+        return NULL;
+    }
+
+    for(i = 0; i < group->config_.max_consumers_; ++i)
+    {
+        group->slots_[i].state_ = CONSUMER_SLOT_FREE;
+        group->slots_[i].group_ = group;
+    }
+
+    group->bbq_ = bbq_;
+    group->callback_ = callback_;
+    group->callback_context_ = callback_context_;
+    NM_ATOMIC_FLAG_SET(&group->is_running_, 1);
+    NM_ATOMIC_FLAG_SET(&group->is_bbq_closed_, 0);
+
+    if(bbq_enable_sojourn_tracking(bbq_) != 0)
+    {
+        goto sojourn_tracking_failed;
+    }
+
+    if(nm_mutex_init(&group->mtx_) != 0)
+    {
+        goto sojourn_tracking_failed;
+    }
+
+    if(nm_semaphore_init(&group->supervisor_wakeup_, 0) != 0)
+    {
+        goto wakeup_init_failed;
+    }
+
+    if(nm_semaphore_init(&group->retry_wait_, 0) != 0)
+    {
+        goto retry_wait_init_failed;
+    }
+
+    nm_mutex_lock(&group->mtx_);
+    while(group->active_consumers_ < group->config_.min_consumers_ && consumer_group_spawn(group) == 0);
+    nm_mutex_unlock(&group->mtx_);
+
+    if(nm_thread_create(&group->supervisor_, consumer_group_supervisor, group) != 0)
+    {
+        nm_bbq_consumer_group_destroy(&group); /* Stops the consumers that were already spawned */
+        return NULL;
+    }
+
+    group->has_supervisor_ = 1;
+    return group;
+
+retry_wait_init_failed:
+    nm_semaphore_destroy(&group->supervisor_wakeup_);
+wakeup_init_failed:
+    nm_mutex_destroy(&group->mtx_);
+sojourn_tracking_failed:
+    free(group->slots_);
+    free(group);
+    return NULL;
+}
+
+
+void nm_bbq_consumer_group_destroy(nm_bbq_consumer_group** group_)
+{
+    nm_bbq_consumer_group* group;
+    unsigned int i;
+
+    if(!group_ || !*group_)
+    {
+        return;
+    }
+
+    group = *group_;
+    NM_ATOMIC_FLAG_SET(&group->is_running_, 0);
+    nm_semaphore_release_n(&group->supervisor_wakeup_, 1);
+
+    if(group->has_supervisor_)
+    {
+        nm_thread_join(&group->supervisor_);
+    }
+
+    /* Every consumer exits after its current element, or after its current idle interval */
+    for(i = 0; i < group->config_.max_consumers_; ++i)
+    {
+        if(group->slots_[i].state_ != CONSUMER_SLOT_FREE)
+        {
+            nm_thread_join(&group->slots_[i].thread_);
+        }
+    }
+
+    nm_semaphore_destroy(&group->retry_wait_);
+    nm_semaphore_destroy(&group->supervisor_wakeup_);
+    nm_mutex_destroy(&group->mtx_);
+    free(group->slots_);
+    free(group);
+    *group_ = NULL;
+}
+
+
+unsigned int nm_bbq_consumer_group_size(nm_bbq_consumer_group* group_)
+{
+    unsigned int size;
+
+    if(!group_)
+    {
+        return 0;
+    }
+
+    nm_mutex_lock(&group_->mtx_);
+    size = group_->active_consumers_;
+    nm_mutex_unlock(&group_->mtx_);
+
+    return size;
+}
+
+/* --------------------------- End of nm_bbq_consumer_group main API functions implementation --------------------------- */
+
+/* ------------------------------------------ End of BBQ Consumer Group ------------------------------------------ */
+
+
+/* ------------------------------------------------ BBQ Producer: ------------------------------------------------ */
+
+/* Defines: */
+
+#define PRODUCER_MIN_FLUSH_INTERVAL_MS 1
+
+
+/* -------------------------------------- nm_bbq_producer main API functions implementation -------------------------------------- */
+
+nm_bbq_producer* nm_bbq_producer_create(nm_blocking_bounded_queue* bbq_, size_t batch_size_, unsigned long max_delay_ms_)
+{
+    nm_bbq_producer* producer;
+    unsigned long interval_ms;
+
+    if(!bbq_ || batch_size_ == 0 || batch_size_ > ((size_t)-1 - sizeof(nm_bbq_producer)) / sizeof(void*))
+    {
+        return NULL;
+    }
+
+    producer = (nm_bbq_producer*)calloc(1, sizeof(nm_bbq_producer) + (batch_size_ - 1) * sizeof(void*));
+    if(!producer)
+    {
+        return NULL;
+    }
+
+    if(nm_mutex_init(&producer->mtx_) != 0)
+    {
+        free(producer);
+        return NULL;
+    }
+
+    producer->bbq_ = bbq_;
+    producer->batch_size_ = batch_size_;
+    producer->max_delay_ms_ = max_delay_ms_;
+
+    nm_mutex_lock(&bbq_->producers_mtx_);
+    if(max_delay_ms_ != NM_BBQ_WAIT_FOREVER)
+    {
+        /* Samples twice per time bound, so an expired batch waits at most half of its bound more */
+        interval_ms = max_delay_ms_ / 2 > PRODUCER_MIN_FLUSH_INTERVAL_MS ? max_delay_ms_ / 2 : PRODUCER_MIN_FLUSH_INTERVAL_MS;
+        if(!bbq_->has_flusher_)
+        {
+            bbq_->flush_interval_ms_ = interval_ms;
+            if(nm_semaphore_init(&bbq_->flusher_wakeup_, 0) != 0)
+            {
+                goto flusher_init_failed;
+            }
+
+            if(nm_thread_create(&bbq_->flusher_, bbq_flusher, bbq_) != 0)
+            {
+                nm_semaphore_destroy(&bbq_->flusher_wakeup_);
+                goto flusher_init_failed;
+            }
+            bbq_->has_flusher_ = 1;
+        }
+        else if(interval_ms < bbq_->flush_interval_ms_)
+        {
+            bbq_->flush_interval_ms_ = interval_ms; /* Taken by the flusher on its next sample */
+        }
+    }
+
+    producer->next_ = bbq_->producers_;
+    if(bbq_->producers_)
+    {
+        bbq_->producers_->prev_ = producer;
+    }
+    bbq_->producers_ = producer;
+    nm_mutex_unlock(&bbq_->producers_mtx_);
+
+    return producer;
+
+flusher_init_failed:
+    nm_mutex_unlock(&bbq_->producers_mtx_);
+    nm_mutex_destroy(&producer->mtx_);
+    free(producer);
+    return NULL;
+}
+
+
+void nm_bbq_producer_destroy(nm_bbq_producer** producer_, bbq_destruction_policy_callback callback_, void* callback_context_)
+{
+    nm_bbq_producer* producer;
+    nm_blocking_bounded_queue* bbq;
+    size_t i;
+
+    if(!producer_ || !*producer_)
+    {
+        return;
+    }
+
+    producer = *producer_;
+    bbq = producer->bbq_;
+
+    nm_mutex_lock(&bbq->producers_mtx_); /* Unregisters first, so no other thread flushes it anymore */
+    if(producer->prev_)
+    {
+        producer->prev_->next_ = producer->next_;
+    }
+    else
+    {
+        bbq->producers_ = producer->next_;
+    }
+
+    if(producer->next_)
+    {
+        producer->next_->prev_ = producer->prev_;
+    }
+    nm_mutex_unlock(&bbq->producers_mtx_);
+
+    (void)producer_flush(producer, 1);
+    for(i = 0; i < producer->count_; ++i) /* The items that the closed queue did not accept */
+    {
+        if(callback_)
+        {
+            callback_(producer->items_[i], callback_context_);
+        }
+    }
+
+    nm_mutex_destroy(&producer->mtx_);
+    free(producer);
+    *producer_ = NULL;
+}
+
+
+nm_bbq_status nm_bbq_producer_put(nm_bbq_producer* producer_, void* item_)
+{
+    nm_bbq_status status = NM_BBQ_SUCCESS;
+
+    if(!producer_ || !item_ || !bbq_is_encodable(producer_->bbq_, item_))
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(!NM_ATOMIC_FLAG_LOAD(&producer_->bbq_->is_valid_))
+    {
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    nm_mutex_lock(&producer_->mtx_);
+    if(producer_->count_ == producer_->batch_size_) /* A previous flush failed */
+    {
+        status = producer_flush(producer_, 1);
+        if(producer_->count_ == producer_->batch_size_)
+        {
+            nm_mutex_unlock(&producer_->mtx_);
+            return status;
+        }
+    }
+
+    if(producer_->count_ == 0 && producer_->max_delay_ms_ != NM_BBQ_WAIT_FOREVER)
+    {
+        producer_->first_put_ns_ = nm_time_now_ns(); /* A single clock read per batch */
+    }
+
+    producer_->items_[producer_->count_++] = item_;
+    if(producer_->count_ == producer_->batch_size_)
+    {
+        status = producer_flush(producer_, 1);
+    }
+    nm_mutex_unlock(&producer_->mtx_);
+
+    return status;
+}
+
+
+nm_bbq_status nm_bbq_producer_flush(nm_bbq_producer* producer_)
+{
+    nm_bbq_status status;
+
+    if(!producer_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    nm_mutex_lock(&producer_->mtx_);
+    status = producer_flush(producer_, 1);
+    nm_mutex_unlock(&producer_->mtx_);
+
+    return status;
+}
+
+
+size_t nm_bbq_producer_staged_count(nm_bbq_producer* producer_)
+{
+    size_t count;
+
+    if(!producer_)
+    {
+        return MAX_SIZE_T;
+    }
+
+    nm_mutex_lock(&producer_->mtx_);
+    count = producer_->count_;
+    nm_mutex_unlock(&producer_->mtx_);
+
+    return count;
+}
+
+/* ----------------------------------- End of nm_bbq_producer main API functions implementation ----------------------------------- */
+
+/* --------------------------------------------- End of BBQ Producer --------------------------------------------- */
+
+
+/* ----------------------------------------------- Persistent Queue: --------------------------------------------- */
+
+/* Defines: */
+
+#define PQ_MAGIC 0x5150514242514D4EULL /* "NMQBBQPQ" */
+#define PQ_VERSION 1
+#define PQ_HEADER_COPY_SIZE 512 /* A header copy per sector, so a torn header write can tear only one of the copies */
+#define PQ_DATA_OFFSET 4096 /* The records start after the header page */
+#define PQ_CHECKSUM_BASIS 2166136261U /* FNV-1a */
+#define PQ_CHECKSUM_PRIME 16777619U
+#define PQ_DEFAULT_COMMIT_INTERVAL_MS 10
+
+/* The file header (2 copies - the valid one with the newer generation is the current one) */
+typedef struct pq_header
+{
+    nm_uint64_t magic_;
+    nm_uint64_t generation_;
+    nm_uint64_t head_; /* The sequence number of the first record that was not taken */
+    nm_uint64_t tail_; /* The sequence number after the last committed record */
+    nm_uint64_t capacity_;
+    nm_uint64_t record_size_;
+    nm_uint32_t version_;
+    nm_uint32_t checksum_; /* Of all the fields above */
+} pq_header;
+
+/* The header of a record slot, followed by record_size_ bytes of data */
+typedef struct pq_record
+{
+    nm_uint64_t seq_; /* The commit marker: the sequence number of the record + 1, written after the data (0 - never written) */
+    nm_uint32_t size_;
+    nm_uint32_t checksum_; /* Of the sequence number, the size and the data */
+} pq_record;
+
+struct nm_persistent_queue
+{
+    char* map_;
+    size_t map_size_;
+    size_t slot_size_;
+    size_t capacity_;
+    size_t record_size_;
+    nm_uint64_t head_; /* The next record to take */
+    nm_uint64_t tail_; /* The next record to put */
+    nm_uint64_t durable_head_; /* The head of the last commit - only the slots of the records before it may be reused */
+    nm_uint64_t durable_tail_;
+    nm_uint64_t generation_; /* Of the last written header (guarded by commit_mtx_) */
+    size_t uncommitted_; /* Puts and takes since the last commit */
+    nm_uint64_t first_uncommitted_ns_;
+    size_t commit_items_;
+    unsigned long commit_interval_ms_;
+    nm_mutex_t mtx_; /* Guards the positions, the counters and the flags */
+    nm_mutex_t commit_mtx_; /* Serializes the commits */
+    nm_cond_t not_empty_;
+    nm_cond_t not_full_;
+    nm_cond_t committer_wakeup_;
+    nm_thread_t committer_;
+    int has_committer_;
+    int is_commit_requested_;
+    int is_closed_;
+    int is_destroying_;
+#if defined(NM_FILE_WINDOWS)
+    HANDLE file_;
+    HANDLE mapping_;
+#else
+    int fd_;
+#endif
+};
+
+
+/* ---------------------------------------- Persistent Queue file helpers ---------------------------------------- */
+
+#if defined(NM_FILE_WINDOWS)
+	/* Opens (or creates, with size_ zero bytes) the file and maps all of it, returns 1 if the file was created, -1 on failure */
+	static int pq_file_open(nm_persistent_queue* pq_, const char* path_, size_t size_)
+	{
+		LARGE_INTEGER file_size;
+		int is_new;
+
+		pq_->file_ = CreateFileA(path_, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(pq_->file_ == INVALID_HANDLE_VALUE)
+		{
+			return -1;
+		}
+
+		if(!GetFileSizeEx(pq_->file_, &file_size))
+		{
+			goto file_failed;
+		}
+
+		is_new = file_size.QuadPart == 0;
+		if(!is_new && (nm_uint64_t)file_size.QuadPart != (nm_uint64_t)size_)
+		{
+			goto file_failed;
+		}
+
+		/* Extends a new file (with zeros) to the size of the mapping */
+		pq_->mapping_ = CreateFileMappingA(pq_->file_, NULL, PAGE_READWRITE, (DWORD)((nm_uint64_t)size_ >> 32), (DWORD)size_, NULL);
+		if(!pq_->mapping_)
+		{
+			goto file_failed;
+		}
+
+		pq_->map_ = (char*)MapViewOfFile(pq_->mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if(!pq_->map_)
+		{
+			CloseHandle(pq_->mapping_);
+			goto file_failed;
+		}
+
+		pq_->map_size_ = size_;
+		return is_new;
+
+	file_failed:
+		CloseHandle(pq_->file_);
+		return -1;
+	}
+
+	/* Writes the mapped range to the disk, returns 0 on success, -1 on failure */
+	static int pq_file_sync(nm_persistent_queue* pq_, size_t offset_, size_t length_)
+	{
+		if(!FlushViewOfFile(pq_->map_ + offset_, length_) || !FlushFileBuffers(pq_->file_))
+		{
+			return -1;
+		}
+		return 0;
+	}
+
+	static void pq_file_close(nm_persistent_queue* pq_)
+	{
+		UnmapViewOfFile(pq_->map_);
+		CloseHandle(pq_->mapping_);
+		CloseHandle(pq_->file_);
+	}
+#else
+	static int pq_file_open(nm_persistent_queue* pq_, const char* path_, size_t size_)
+	{
+		struct stat file_stat;
+		void* map;
+		int is_new;
+
+		pq_->fd_ = open(path_, O_RDWR | O_CREAT, 0644);
+		if(pq_->fd_ < 0)
+		{
+			return -1;
+		}
+
+		if(fstat(pq_->fd_, &file_stat) != 0)
+		{
+			goto file_failed;
+		}
+
+		is_new = file_stat.st_size == 0;
+		if(is_new ? ftruncate(pq_->fd_, (off_t)size_) != 0 : (nm_uint64_t)file_stat.st_size != (nm_uint64_t)size_)
+		{
+			goto file_failed;
+		}
+
+		map = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, pq_->fd_, 0);
+		if(map == MAP_FAILED)
+		{
+			goto file_failed;
+		}
+
+		pq_->map_ = (char*)map;
+		pq_->map_size_ = size_;
+		return is_new;
+
+	file_failed:
+		close(pq_->fd_);
+		return -1;
+	}
+
+	/* msync with MS_SYNC writes the dirty pages of the range and their file data (like fdatasync on the range) */
+	static int pq_file_sync(nm_persistent_queue* pq_, size_t offset_, size_t length_)
+	{
+		size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+		size_t start = offset_ - offset_ % page_size; /* msync needs a page aligned address */
+
+		return msync(pq_->map_ + start, offset_ + length_ - start, MS_SYNC) == 0 ? 0 : -1;
+	}
+
+	static void pq_file_close(nm_persistent_queue* pq_)
+	{
+		munmap(pq_->map_, pq_->map_size_);
+		close(pq_->fd_);
+	}
+#endif
+
+static nm_uint32_t pq_checksum(nm_uint32_t hash_, const void* data_, size_t size_)
+{
+    const unsigned char* bytes = (const unsigned char*)data_;
+    size_t i;
+
+    for(i = 0; i < size_; ++i)
+    {
+        hash_ = (hash_ ^ bytes[i]) * PQ_CHECKSUM_PRIME;
+    }
+    return hash_;
+}
+
+static pq_record* pq_record_at(nm_persistent_queue* pq_, nm_uint64_t seq_)
+{
+    return (pq_record*)(pq_->map_ + PQ_DATA_OFFSET + (size_t)(seq_ % pq_->capacity_) * pq_->slot_size_);
+}
+
+static nm_uint32_t pq_record_checksum(nm_uint64_t seq_, nm_uint32_t size_, const pq_record* record_)
+{
+    nm_uint32_t hash = pq_checksum(PQ_CHECKSUM_BASIS, &seq_, sizeof(seq_));
+
+    hash = pq_checksum(hash, &size_, sizeof(size_));
+    return pq_checksum(hash, record_ + 1, size_);
+}
+
+/* A record is complete if it has the commit marker of its sequence number, and its checksum matches */
+static int pq_is_record_complete(nm_persistent_queue* pq_, nm_uint64_t seq_)
+{
+    pq_record* record = pq_record_at(pq_, seq_);
+
+    return record->seq_ == seq_ + 1 && record->size_ <= pq_->record_size_ &&
+           record->checksum_ == pq_record_checksum(seq_, record->size_, record);
+}
+
+static pq_header* pq_header_copy(nm_persistent_queue* pq_, nm_uint64_t generation_)
+{
+    return (pq_header*)(pq_->map_ + (size_t)(generation_ % 2) * PQ_HEADER_COPY_SIZE);
+}
+
+static int pq_is_header_valid(nm_persistent_queue* pq_, const pq_header* header_)
+{
+    return header_->magic_ == PQ_MAGIC && header_->version_ == PQ_VERSION &&
+           header_->capacity_ == (nm_uint64_t)pq_->capacity_ && header_->record_size_ == (nm_uint64_t)pq_->record_size_ &&
+           header_->checksum_ == pq_checksum(PQ_CHECKSUM_BASIS, header_, offsetof(pq_header, checksum_)) &&
+           header_->head_ <= header_->tail_ && header_->tail_ - header_->head_ <= (nm_uint64_t)pq_->capacity_;
+}
+
+/* Writes the next generation of the header (to the older copy, so the current one survives a torn write) and syncs it */
+static int pq_write_header(nm_persistent_queue* pq_, nm_uint64_t head_, nm_uint64_t tail_)
+{
+    pq_header* header = pq_header_copy(pq_, pq_->generation_ + 1);
+
+    header->magic_ = PQ_MAGIC;
+    header->generation_ = pq_->generation_ + 1;
+    header->head_ = head_;
+    header->tail_ = tail_;
+    header->capacity_ = (nm_uint64_t)pq_->capacity_;
+    header->record_size_ = (nm_uint64_t)pq_->record_size_;
+    header->version_ = PQ_VERSION;
+    header->checksum_ = pq_checksum(PQ_CHECKSUM_BASIS, header, offsetof(pq_header, checksum_));
+
+    if(pq_file_sync(pq_, 0, PQ_DATA_OFFSET) != 0)
+    {
+        return -1;
+    }
+
+    ++pq_->generation_;
+    return 0;
+}
+
+/* Syncs the slots of the records [from_seq_, to_seq_) (at most capacity_ records, in up to 2 ranges) */
+static int pq_sync_records(nm_persistent_queue* pq_, nm_uint64_t from_seq_, nm_uint64_t to_seq_)
+{
+    size_t count = (size_t)(to_seq_ - from_seq_);
+    size_t first = (size_t)(from_seq_ % pq_->capacity_);
+    size_t first_part = pq_->capacity_ - first < count ? pq_->capacity_ - first : count;
+
+    if(count == 0)
+    {
+        return 0;
+    }
+
+    if(pq_file_sync(pq_, PQ_DATA_OFFSET + first * pq_->slot_size_, first_part * pq_->slot_size_) != 0)
+    {
+        return -1;
+    }
+
+    return count == first_part ? 0 : pq_file_sync(pq_, PQ_DATA_OFFSET, (count - first_part) * pq_->slot_size_);
+}
+
+/* Commits the positions: the records are synced before the header, so a committed header never counts
+   a record that is not on the disk. The queue is not locked while syncing */
+static int pq_commit(nm_persistent_queue* pq_)
+{
+    nm_uint64_t head, tail, durable_tail;
+    int result;
+
+    nm_mutex_lock(&pq_->commit_mtx_);
+    nm_mutex_lock(&pq_->mtx_);
+    head = pq_->head_;
+    tail = pq_->tail_;
+    durable_tail = pq_->durable_tail_;
+    if(head == pq_->durable_head_ && tail == durable_tail)
+    {
+        nm_mutex_unlock(&pq_->mtx_);
+        nm_mutex_unlock(&pq_->commit_mtx_);
+        return 0;
+    }
+    pq_->uncommitted_ = 0;
+    nm_mutex_unlock(&pq_->mtx_);
+
+    result = pq_sync_records(pq_, durable_tail, tail);
+    if(result == 0)
+    {
+        result = pq_write_header(pq_, head, tail);
+    }
+
+    nm_mutex_lock(&pq_->mtx_);
+    if(result == 0)
+    {
+        pq_->durable_head_ = head;
+        pq_->durable_tail_ = tail;
+        nm_cond_broadcast(&pq_->not_full_); /* The slots of the taken records may be reused */
+    }
+    nm_mutex_unlock(&pq_->mtx_);
+    nm_mutex_unlock(&pq_->commit_mtx_);
+
+    return result;
+}
+
+/* Counts a put or a take for the group commit (the queue is locked) */
+static void pq_note_change(nm_persistent_queue* pq_)
+{
+    if(pq_->uncommitted_++ == 0)
+    {
+        pq_->first_uncommitted_ns_ = nm_time_now_ns();
+        if(pq_->has_committer_)
+        {
+            nm_cond_signal(&pq_->committer_wakeup_); /* Starts the time bound */
+        }
+    }
+
+    if(pq_->commit_items_ > 0 && pq_->uncommitted_ == pq_->commit_items_ && pq_->has_committer_)
+    {
+        pq_->is_commit_requested_ = 1;
+        nm_cond_signal(&pq_->committer_wakeup_);
+    }
+}
+
+static void pq_committer(void* pq_)
+{
+    nm_persistent_queue* pq = (nm_persistent_queue*)pq_;
+    nm_uint64_t deadline_ns;
+
+    nm_mutex_lock(&pq->mtx_);
+    while(!pq->is_destroying_)
+    {
+        if(pq->uncommitted_ == 0 || (!pq->is_commit_requested_ && pq->commit_interval_ms_ == 0))
+        {
+            nm_cond_wait(&pq->committer_wakeup_, &pq->mtx_);
+            continue;
+        }
+
+        deadline_ns = pq->first_uncommitted_ns_ + (nm_uint64_t)pq->commit_interval_ms_ * 1000000;
+        if(!pq->is_commit_requested_ && nm_time_now_ns() < deadline_ns)
+        {
+            (void)nm_cond_wait_until(&pq->committer_wakeup_, &pq->mtx_, deadline_ns);
+            continue;
+        }
+
+        pq->is_commit_requested_ = 0;
+        nm_mutex_unlock(&pq->mtx_);
+        (void)pq_commit(pq); /* A failed commit is retried on the next change */
+        nm_mutex_lock(&pq->mtx_);
+    }
+    nm_mutex_unlock(&pq->mtx_);
+}
+
+/* The second header copy is written only by the second header write, so a blank one means that the file was
+   created and never committed (a crash between sizing the file and the first header, or during that header) */
+static int pq_is_header_copy_blank(nm_persistent_queue* pq_, nm_uint64_t generation_)
+{
+    const char* bytes = (const char*)pq_header_copy(pq_, generation_);
+    size_t i;
+
+    for(i = 0; i < PQ_HEADER_COPY_SIZE; ++i)
+    {
+        if(bytes[i] != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Recovers the positions of an existing file, returns 0 on success, 1 if the file was never committed (so it is
+   initialized as a new one), -1 if the file has no valid header */
+static int pq_recover(nm_persistent_queue* pq_)
+{
+    pq_header* headers[2];
+    pq_header* current = NULL;
+    pq_record* record;
+    nm_uint64_t seq;
+    size_t i;
+    int is_cleared = 0;
+
+    headers[0] = pq_header_copy(pq_, 0);
+    headers[1] = pq_header_copy(pq_, 1);
+    for(i = 0; i < 2; ++i)
+    {
+        if(pq_is_header_valid(pq_, headers[i]) && (!current || headers[i]->generation_ > current->generation_))
+        {
+            current = headers[i];
+        }
+    }
+
+    if(!current)
+    {
+        return pq_is_header_copy_blank(pq_, 2) ? 1 : -1;
+    }
+
+    /* The complete records after the committed head - the committed ones, and the ones that reached the disk after the commit */
+    pq_->generation_ = current->generation_;
+    pq_->head_ = current->head_;
+    for(seq = current->head_; seq - current->head_ < (nm_uint64_t)pq_->capacity_ && pq_is_record_complete(pq_, seq); ++seq);
+    pq_->tail_ = seq;
+
+    /* Clears the markers of the complete records after the first incomplete one, so they never join the queue later on */
+    for(i = 0; i < pq_->capacity_; ++i)
+    {
+        record = (pq_record*)(pq_->map_ + PQ_DATA_OFFSET + i * pq_->slot_size_);
+        if(record->seq_ > pq_->tail_)
+        {
+            record->seq_ = 0;
+            is_cleared = 1;
+        }
+    }
+
+    if(is_cleared && pq_file_sync(pq_, PQ_DATA_OFFSET, pq_->capacity_ * pq_->slot_size_) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static nm_bbq_status pq_take(nm_persistent_queue* pq_, void* buffer_, size_t buffer_size_, size_t* size_ptr_, unsigned long timeout_ms_)
+{
+    pq_record* record;
+    nm_uint64_t deadline_ns = 0;
+
+    if(!pq_ || !buffer_ || !size_ptr_ || buffer_size_ < pq_->record_size_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    if(timeout_ms_ != NM_BBQ_WAIT_FOREVER)
+    {
+        deadline_ns = nm_time_now_ns() + (nm_uint64_t)timeout_ms_ * 1000000;
+    }
+
+    nm_mutex_lock(&pq_->mtx_);
+    while(pq_->head_ == pq_->tail_ && !pq_->is_closed_)
+    {
+        if(timeout_ms_ == NM_BBQ_WAIT_FOREVER)
+        {
+            nm_cond_wait(&pq_->not_empty_, &pq_->mtx_);
+        }
+        else if(nm_cond_wait_until(&pq_->not_empty_, &pq_->mtx_, deadline_ns) != 0 && pq_->head_ == pq_->tail_ && !pq_->is_closed_)
+        {
+            nm_mutex_unlock(&pq_->mtx_);
+            return NM_BBQ_TIMEOUT;
+        }
+    }
+
+    if(pq_->is_closed_)
+    {
+        nm_mutex_unlock(&pq_->mtx_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    record = pq_record_at(pq_, pq_->head_);
+    memcpy(buffer_, record + 1, record->size_);
+    *size_ptr_ = record->size_;
+    ++pq_->head_;
+    pq_note_change(pq_);
+    nm_cond_signal(&pq_->not_full_); /* A blocked putter commits the freed slot itself (its commit wakes the others) */
+    nm_mutex_unlock(&pq_->mtx_);
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+/* -------------------------------------- nm_persistent_queue main API functions implementation -------------------------------------- */
+
+void nm_persistent_queue_config_init(nm_persistent_queue_config* config_, const char* path_, size_t capacity_, size_t record_size_)
+{
+    if(config_)
+    {
+        config_->path_ = path_;
+        config_->capacity_ = capacity_;
+        config_->record_size_ = record_size_;
+        config_->commit_items_ = 0;
+        config_->commit_interval_ms_ = PQ_DEFAULT_COMMIT_INTERVAL_MS;
+    }
+}
+
+
+nm_persistent_queue* nm_persistent_queue_open(const nm_persistent_queue_config* config_)
+{
+    nm_persistent_queue* pq;
+    size_t slot_size;
+    int is_new;
+
+    if(!config_ || !config_->path_ || config_->capacity_ == 0 || config_->record_size_ == 0 ||
+       config_->record_size_ > (nm_uint32_t)-1 - sizeof(pq_record))
+    {
+        return NULL;
+    }
+
+    slot_size = (sizeof(pq_record) + config_->record_size_ + sizeof(nm_uint64_t) - 1) / sizeof(nm_uint64_t) * sizeof(nm_uint64_t);
+    if(config_->capacity_ > (MAX_SIZE_T - PQ_DATA_OFFSET) / slot_size)
+    {
+        return NULL;
+    }
+
+    pq = (nm_persistent_queue*)calloc(1, sizeof(nm_persistent_queue));
+    if(!pq)
+    {
+        return NULL;
+    }
+
+    pq->slot_size_ = slot_size;
+    pq->capacity_ = config_->capacity_;
+    pq->record_size_ = config_->record_size_;
+    pq->commit_items_ = config_->commit_items_;
+    pq->commit_interval_ms_ = config_->commit_interval_ms_;
+
+    if(nm_mutex_init(&pq->mtx_) != 0)
+    {
+        goto mtx_init_failed;
+    }
+
+    if(nm_mutex_init(&pq->commit_mtx_) != 0)
+    {
+        goto commit_mtx_init_failed;
+    }
+
+    if(nm_cond_init(&pq->not_empty_) != 0)
+    {
+        goto not_empty_init_failed;
+    }
+
+    if(nm_cond_init(&pq->not_full_) != 0)
+    {
+        goto not_full_init_failed;
+    }
+
+    if(nm_cond_init(&pq->committer_wakeup_) != 0)
+    {
+        goto committer_wakeup_init_failed;
+    }
+
+    is_new = pq_file_open(pq, config_->path_, PQ_DATA_OFFSET + config_->capacity_ * slot_size);
+    if(is_new < 0)
+    {
+        goto file_open_failed;
+    }
+
+    if(!is_new)
+    {
+        is_new = pq_recover(pq);
+        if(is_new < 0)
+        {
+            goto recovery_failed;
+        }
+    }
+
+    if(is_new ? pq_write_header(pq, 0, 0) != 0 : pq_write_header(pq, pq->head_, pq->tail_) != 0)
+    {
+        goto recovery_failed;
+    }
+    pq->durable_head_ = pq->head_;
+    pq->durable_tail_ = pq->tail_;
+
+    if(pq->commit_items_ > 0 || pq->commit_interval_ms_ > 0)
+    {
+        if(nm_thread_create(&pq->committer_, pq_committer, pq) != 0)
+        {
+            goto recovery_failed;
+        }
+        pq->has_committer_ = 1;
+    }
+
+    return pq;
+
+recovery_failed:
+    pq_file_close(pq);
+file_open_failed:
+    nm_cond_destroy(&pq->committer_wakeup_);
+committer_wakeup_init_failed:
+    nm_cond_destroy(&pq->not_full_);
+not_full_init_failed:
+    nm_cond_destroy(&pq->not_empty_);
+not_empty_init_failed:
+    nm_mutex_destroy(&pq->commit_mtx_);
+commit_mtx_init_failed:
+    nm_mutex_destroy(&pq->mtx_);
+mtx_init_failed:
+    free(pq);
+    return NULL;
+}
+
+
+void nm_persistent_queue_destroy(nm_persistent_queue** pq_)
+{
+    nm_persistent_queue* pq;
+
+    if(!pq_ || !*pq_)
+    {
+        return;
+    }
+
+    pq = *pq_;
+
+    nm_mutex_lock(&pq->mtx_);
+    pq->is_destroying_ = 1;
+    pq->is_closed_ = 1;
+    nm_cond_signal(&pq->committer_wakeup_);
+    nm_mutex_unlock(&pq->mtx_);
+
+    if(pq->has_committer_)
+    {
+        nm_thread_join(&pq->committer_);
+    }
+
+    (void)pq_commit(pq);
+    pq_file_close(pq);
+
+    nm_cond_destroy(&pq->committer_wakeup_);
+    nm_cond_destroy(&pq->not_full_);
+    nm_cond_destroy(&pq->not_empty_);
+    nm_mutex_destroy(&pq->commit_mtx_);
+    nm_mutex_destroy(&pq->mtx_);
+    free(pq);
+    *pq_ = NULL;
+}
+
+
+nm_bbq_status nm_persistent_queue_close(nm_persistent_queue* pq_)
+{
+    if(!pq_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    nm_mutex_lock(&pq_->mtx_);
+    if(pq_->is_closed_)
+    {
+        nm_mutex_unlock(&pq_->mtx_);
+        return NM_BBQ_IS_CLOSED;
+    }
+
+    pq_->is_closed_ = 1;
+    nm_cond_broadcast(&pq_->not_empty_);
+    nm_cond_broadcast(&pq_->not_full_);
+    nm_mutex_unlock(&pq_->mtx_);
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_persistent_queue_put(nm_persistent_queue* pq_, const void* record_, size_t size_)
+{
+    pq_record* record;
+
+    if(!pq_ || !record_ || size_ > pq_->record_size_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    nm_mutex_lock(&pq_->mtx_);
+    for(;;)
+    {
+        if(pq_->is_closed_)
+        {
+            nm_mutex_unlock(&pq_->mtx_);
+            return NM_BBQ_IS_CLOSED;
+        }
+
+        if(pq_->tail_ - pq_->durable_head_ < (nm_uint64_t)pq_->capacity_)
+        {
+            break;
+        }
+
+        if(pq_->head_ != pq_->durable_head_) /* Frees the slots of the records that were taken since the last commit */
+        {
+            nm_mutex_unlock(&pq_->mtx_);
+            if(pq_commit(pq_) != 0)
+            {
+                return NM_BBQ_IO_ERROR;
+            }
+            nm_mutex_lock(&pq_->mtx_);
+            continue;
+        }
+
+        nm_cond_wait(&pq_->not_full_, &pq_->mtx_);
+    }
+
+    record = pq_record_at(pq_, pq_->tail_);
+    memcpy(record + 1, record_, size_);
+    record->size_ = (nm_uint32_t)size_;
+    record->checksum_ = pq_record_checksum(pq_->tail_, record->size_, record);
+    record->seq_ = pq_->tail_ + 1;
+    ++pq_->tail_;
+    pq_note_change(pq_);
+    nm_cond_signal(&pq_->not_empty_);
+    nm_mutex_unlock(&pq_->mtx_);
+
+    return NM_BBQ_SUCCESS;
+}
+
+
+nm_bbq_status nm_persistent_queue_take(nm_persistent_queue* pq_, void* buffer_, size_t buffer_size_, size_t* size_ptr_)
+{
+    return pq_take(pq_, buffer_, buffer_size_, size_ptr_, NM_BBQ_WAIT_FOREVER);
+}
+
+
+nm_bbq_status nm_persistent_queue_take_timed(nm_persistent_queue* pq_, void* buffer_, size_t buffer_size_, size_t* size_ptr_, unsigned long timeout_ms_)
+{
+    return pq_take(pq_, buffer_, buffer_size_, size_ptr_, timeout_ms_);
+}
+
+
+nm_bbq_status nm_persistent_queue_commit(nm_persistent_queue* pq_)
+{
+    if(!pq_)
+    {
+        return NM_BBQ_UNINITIALIZED_ERROR;
+    }
+
+    return pq_commit(pq_) == 0 ? NM_BBQ_SUCCESS : NM_BBQ_IO_ERROR;
+}
+
+
+size_t nm_persistent_queue_size(nm_persistent_queue* pq_)
+{
+    size_t size;
+
+    if(!pq_)
+    {
+        return MAX_SIZE_T;
+    }
+
+    nm_mutex_lock(&pq_->mtx_);
+    size = (size_t)(pq_->tail_ - pq_->head_);
+    nm_mutex_unlock(&pq_->mtx_);
+
+    return size;
+}
+
+/* ----------------------------------- End of nm_persistent_queue main API functions implementation ----------------------------------- */
+
+/* ----------------------------------------------- End of Persistent Queue --------------------------------------- */
@@ -20,6 +20,27 @@
 /* Defines: */
 #define UNUSED(x) (void)(x)
 
+#if defined(_MSC_VER)
+    #define NM_INLINE static __inline
+#elif defined(__GNUC__) || defined(__clang__)
+    #define NM_INLINE static __inline__
+#else
+    #define NM_INLINE static
+#endif
+
+/* Build modes (define before including this header):
+ * NM_BBQ_INLINE - exposes the nm_queue layout, and defines its hot path functions (nm_queue_enqueue, nm_queue_dequeue,
+ *                 nm_queue_is_empty and nm_queue_capacity) as static inline functions, that do not validate their arguments
+ *                 (the caller guarantees them). The library itself is built the same way in both modes.
+ * NM_BBQ_DEBUG - the inline functions validate their arguments with assert
+ */
+#if defined(NM_BBQ_DEBUG)
+    #include <assert.h>
+    #define NM_BBQ_ASSERT(cond_) assert(cond_)
+#else
+    #define NM_BBQ_ASSERT(cond_) ((void)0)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -33,11 +54,23 @@ typedef enum nm_queue_status
     NM_QUEUE_SUCCESS,
     NM_QUEUE_UNINITIALIZED_ERROR,
     NM_QUEUE_OVERFLOW_ERROR,
-    NM_QUEUE_UNDERFLOW_ERROR
+    NM_QUEUE_UNDERFLOW_ERROR,
+    NM_QUEUE_ALLOCATION_ERROR
 } nm_queue_status;
 
 typedef struct nm_queue nm_queue;
 
+#if defined(NM_BBQ_INLINE) || defined(NM_BBQ_IMPLEMENTATION)
+struct nm_queue /* Private - exposed for the inline functions only */
+{
+	void** items_;
+	size_t capacity_;
+	size_t head_;
+	size_t tail_;
+	size_t items_count_;
+};
+#endif /* NM_BBQ_INLINE || NM_BBQ_IMPLEMENTATION */
+
 /**
  * @brief An action callback function that will be called on each element of the queue when destroying the queue
  * @param[in] element_: A pointer to an element to destroy
@@ -88,8 +121,27 @@ void nm_queue_destroy(nm_queue** queue_, destroy_item_callback callback_);
  * @retval NM_QUEUE_OVERFLOW_ERROR on error - reached size limit, no more room to add another item
  *
  * @warning If item_ is NULL: function will fail and return NM_QUEUE_UNINITIALIZED_ERROR
+ *          (NM_BBQ_INLINE: the pointers are not checked, unless NM_BBQ_DEBUG is defined)
  */
+#if !defined(NM_BBQ_INLINE)
 nm_queue_status nm_queue_enqueue(nm_queue* queue_, void* item_);
+#else
+NM_INLINE nm_queue_status nm_queue_enqueue(nm_queue* queue_, void* item_)
+{
+	NM_BBQ_ASSERT(queue_ && item_);
+
+	if(queue_->capacity_ == queue_->items_count_) /* The queue is full */
+	{
+		return NM_QUEUE_OVERFLOW_ERROR;
+	}
+
+	queue_->items_[queue_->tail_++] = item_;
+	queue_->tail_ %= queue_->capacity_;
+	++queue_->items_count_;
+
+	return NM_QUEUE_SUCCESS;
+}
+#endif /* NM_BBQ_INLINE */
 
 
 /**
@@ -102,8 +154,39 @@ nm_queue_status nm_queue_enqueue(nm_queue* queue_, void* item_);
  * @retval NM_QUEUE_UNDERFLOW_ERROR on error - queue is empty, no more items to remove
  *
  * @warning If item_ptr_ is NULL: function will fail and return NM_QUEUE_UNINITIALIZED_ERROR
+ *          (NM_BBQ_INLINE: the pointers are not checked, unless NM_BBQ_DEBUG is defined)
  */
+#if !defined(NM_BBQ_INLINE)
 nm_queue_status nm_queue_dequeue(nm_queue* queue_, void** item_ptr_);
+#else
+NM_INLINE nm_queue_status nm_queue_dequeue(nm_queue* queue_, void** item_ptr_)
+{
+	NM_BBQ_ASSERT(queue_ && item_ptr_);
+
+	if(queue_->items_count_ == 0) /* The queue is empty */
+	{
+		return NM_QUEUE_UNDERFLOW_ERROR;
+	}
+
+	*item_ptr_ = queue_->items_[queue_->head_];
+	queue_->items_[queue_->head_++] = NULL;
+	queue_->head_ %= queue_->capacity_;
+	--queue_->items_count_;
+
+	return NM_QUEUE_SUCCESS;
+}
+#endif /* NM_BBQ_INLINE */
+
+
+/**
+ * @brief Removes up to max_items_ items from the beginning of the queue (in up to 2 copies)
+ * @param[in] queue_: A queue to remove the items from
+ * @param[out] items_: An array of at least max_items_ elements, to return the removed items in (in their queue order)
+ * @param[in] max_items_: The maximum number of items to remove
+ * @return size_t - the number of removed items (0 if the queue is empty), on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ */
+size_t nm_queue_dequeue_n(nm_queue* queue_, void** items_, size_t max_items_);
 
 
 /**
@@ -111,7 +194,15 @@ nm_queue_status nm_queue_dequeue(nm_queue* queue_, void** item_ptr_);
  * @param[in] queue_: A queue to check if is empty
  * @return int - 0 if queue is not empty or 1 if queue is empty, on success / -1, on failure
  */
+#if !defined(NM_BBQ_INLINE)
 int nm_queue_is_empty(nm_queue* queue_);
+#else
+NM_INLINE int nm_queue_is_empty(nm_queue* queue_)
+{
+	NM_BBQ_ASSERT(queue_);
+	return queue_->items_count_ == 0;
+}
+#endif /* NM_BBQ_INLINE */
 
 
 /**
@@ -120,7 +211,29 @@ int nm_queue_is_empty(nm_queue* queue_);
  * @return size_t - queue's capacity, on success
             / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
  */
+#if !defined(NM_BBQ_INLINE)
 size_t nm_queue_capacity(nm_queue* queue_);
+#else
+NM_INLINE size_t nm_queue_capacity(nm_queue* queue_)
+{
+	NM_BBQ_ASSERT(queue_);
+	return queue_->capacity_;
+}
+#endif /* NM_BBQ_INLINE */
+
+
+/**
+ * @brief Changes the capacity of the queue, keeping its items and their order
+ * @details The items are moved to a new buffer, starting at its beginning (in up to 2 copies of the live items)
+ * @param[in] queue_: A queue to resize
+ * @param[in] new_capacity_: The new capacity of the queue
+ * @return nm_queue_status - success or error status code
+ * @retval NM_QUEUE_SUCCESS on success
+ * @retval NM_QUEUE_UNINITIALIZED_ERROR on error - a given pointer is NULL, or new_capacity_ is 0
+ * @retval NM_QUEUE_OVERFLOW_ERROR on error - the queue holds more than new_capacity_ items
+ * @retval NM_QUEUE_ALLOCATION_ERROR on error - the new buffer could not be allocated (the queue is left unchanged)
+ */
+nm_queue_status nm_queue_resize(nm_queue* queue_, size_t new_capacity_);
 
 
 /**
@@ -136,22 +249,95 @@ size_t nm_queue_capacity(nm_queue* queue_);
  */
 size_t nm_queue_for_each(nm_queue* queue_, action_callback callback_, void* context_);
 
+
+/**
+ * @brief Finds the first occurrence of an item (by its pointer value) in the queue
+ * @details Compares several items per instruction where the CPU allows it (AVX2 / SSE2, detected at runtime)
+ * @param[in] queue_: A queue to search in
+ * @param[in] item_: The item to find
+ * @return size_t - the position of the item from the beginning of the queue (0 - the next item to dequeue), on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), if the item is not in the queue or on failure
+ */
+size_t nm_queue_find(nm_queue* queue_, const void* item_);
+
+
+/**
+ * @brief Counts the occurrences of an item (by its pointer value) in the queue
+ * @details Compares several items per instruction where the CPU allows it (AVX2 / SSE2, detected at runtime)
+ * @param[in] queue_: A queue to search in
+ * @param[in] item_: The item to count
+ * @return size_t - the number of occurrences of the item, on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ */
+size_t nm_queue_count_eq(nm_queue* queue_, const void* item_);
+
 /* --------------------------------------- End of nm_queue main API functions ---------------------------------- */
 /* ------------------------------------------- End of Underlying queue ----------------------------------------- */
 
 /* ----------------------------------------------- Sync utils: ------------------------------------------------- */
 
-/* TODO: define the Atomic functionallity (meet the required OS only - Win and Linux), but use the code from below in {#else} case */
 /* Atomics: */
 typedef size_t nm_atomic_value_t;
-#define NM_ATOMIC_VALUE_SET(atomic_val_, new_val_) (*atomic_val_) = (new_val_)
-#define NM_ATOMIC_VALUE_SET_IF(atomic_val_, cond_val_, new_val_) if((*atomic_val_) == (cond_val_)) { (*atomic_val_) = (new_val_); }
-#define NM_ATOMIC_VALUE_ADD(atomic_val_, val_to_add_) (*atomic_val_) += (val_to_add)
-#define NM_ATOMIC_VALUE_SUB(atomic_val_, val_to_add_) (*atomic_val_) -= (val_to_add)
 typedef unsigned char nm_atomic_flag_t;
-#define NM_ATOMIC_FLAG_SET(atomic_flag_, new_val_) (*atomic_flag_) = (new_val_)
-#define NM_ATOMIC_FLAG_SET_IF(atomic_flag_, cond_val_, new_val_) if((*atomic_flag_) == (cond_val_)) { (*atomic_flag_) = (new_val_); }
-#define NM_ATOMIC_FLAG_LOAD(atomic_flag_) (*atomic_flag_)
+typedef int nm_atomic_int_t; /* 32 bits on all the supported environments - can also be used as a futex word */
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define NM_ATOMIC_VALUE_LOAD(atomic_val_) __atomic_load_n((atomic_val_), __ATOMIC_ACQUIRE)
+    #define NM_ATOMIC_VALUE_SET(atomic_val_, new_val_) __atomic_store_n((atomic_val_), (new_val_), __ATOMIC_RELEASE)
+    #define NM_ATOMIC_VALUE_SET_IF(atomic_val_, cond_val_, new_val_) { (void)__sync_val_compare_and_swap((atomic_val_), (cond_val_), (new_val_)); }
+    #define NM_ATOMIC_VALUE_ADD(atomic_val_, val_to_add_) __atomic_add_fetch((atomic_val_), (val_to_add_), __ATOMIC_SEQ_CST)
+    #define NM_ATOMIC_VALUE_SUB(atomic_val_, val_to_sub_) __atomic_sub_fetch((atomic_val_), (val_to_sub_), __ATOMIC_SEQ_CST)
+    /* Returns the previous value - the exchange took place if it equals to expected_val_ */
+    #define NM_ATOMIC_VALUE_CAS(atomic_val_, expected_val_, new_val_) __sync_val_compare_and_swap((atomic_val_), (expected_val_), (new_val_))
+    #define NM_ATOMIC_FLAG_SET(atomic_flag_, new_val_) __atomic_store_n((atomic_flag_), (nm_atomic_flag_t)(new_val_), __ATOMIC_RELEASE)
+    #define NM_ATOMIC_FLAG_SET_IF(atomic_flag_, cond_val_, new_val_) { (void)__sync_val_compare_and_swap((atomic_flag_), (nm_atomic_flag_t)(cond_val_), (nm_atomic_flag_t)(new_val_)); }
+    #define NM_ATOMIC_FLAG_LOAD(atomic_flag_) __atomic_load_n((atomic_flag_), __ATOMIC_ACQUIRE)
+    #define NM_ATOMIC_INT_LOAD(atomic_int_) __atomic_load_n((atomic_int_), __ATOMIC_SEQ_CST)
+    #define NM_ATOMIC_INT_LOAD_RELAXED(atomic_int_) __atomic_load_n((atomic_int_), __ATOMIC_RELAXED)
+    #define NM_ATOMIC_INT_STORE(atomic_int_, new_val_) __atomic_store_n((atomic_int_), (new_val_), __ATOMIC_RELEASE)
+    #define NM_ATOMIC_INT_FETCH_ADD(atomic_int_, val_to_add_) __atomic_fetch_add((atomic_int_), (val_to_add_), __ATOMIC_SEQ_CST)
+    #define NM_ATOMIC_INT_EXCHANGE(atomic_int_, new_val_) __atomic_exchange_n((atomic_int_), (new_val_), __ATOMIC_SEQ_CST)
+    /* Returns the previous value - the exchange took place if it equals to expected_val_ */
+    #define NM_ATOMIC_INT_CAS(atomic_int_, expected_val_, new_val_) __sync_val_compare_and_swap((atomic_int_), (expected_val_), (new_val_))
+    #define NM_ATOMIC_PTR_LOAD(atomic_ptr_) __atomic_load_n((atomic_ptr_), __ATOMIC_ACQUIRE)
+    #define NM_ATOMIC_PTR_STORE(atomic_ptr_, new_val_) __atomic_store_n((atomic_ptr_), (new_val_), __ATOMIC_RELEASE)
+    #define NM_ATOMIC_PTR_EXCHANGE(atomic_ptr_, new_val_) __atomic_exchange_n((atomic_ptr_), (new_val_), __ATOMIC_SEQ_CST)
+    /* Returns the previous value - the exchange took place if it equals to expected_val_ */
+    #define NM_ATOMIC_PTR_CAS(atomic_ptr_, expected_val_, new_val_) __sync_val_compare_and_swap((atomic_ptr_), (expected_val_), (new_val_))
+    #define NM_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_MSC_VER)
+    #include <intrin.h>
+    #if defined(_WIN64)
+        #define NM_INTERLOCKED_VALUE_(name_) name_##64
+        typedef __int64 nm_interlocked_value_t;
+    #else
+        #define NM_INTERLOCKED_VALUE_(name_) name_
+        typedef long nm_interlocked_value_t;
+    #endif
+    /* MSVC volatile accesses have acquire/release semantics (/volatile:ms, the default on x86 and x64) */
+    #define NM_ATOMIC_VALUE_LOAD(atomic_val_) (*(volatile nm_atomic_value_t*)(atomic_val_))
+    #define NM_ATOMIC_VALUE_SET(atomic_val_, new_val_) (void)NM_INTERLOCKED_VALUE_(_InterlockedExchange)((volatile nm_interlocked_value_t*)(atomic_val_), (nm_interlocked_value_t)(new_val_))
+    #define NM_ATOMIC_VALUE_SET_IF(atomic_val_, cond_val_, new_val_) { (void)NM_INTERLOCKED_VALUE_(_InterlockedCompareExchange)((volatile nm_interlocked_value_t*)(atomic_val_), (nm_interlocked_value_t)(new_val_), (nm_interlocked_value_t)(cond_val_)); }
+    #define NM_ATOMIC_VALUE_ADD(atomic_val_, val_to_add_) ((nm_atomic_value_t)NM_INTERLOCKED_VALUE_(_InterlockedExchangeAdd)((volatile nm_interlocked_value_t*)(atomic_val_), (nm_interlocked_value_t)(val_to_add_)) + (val_to_add_))
+    #define NM_ATOMIC_VALUE_SUB(atomic_val_, val_to_sub_) ((nm_atomic_value_t)NM_INTERLOCKED_VALUE_(_InterlockedExchangeAdd)((volatile nm_interlocked_value_t*)(atomic_val_), -(nm_interlocked_value_t)(val_to_sub_)) - (val_to_sub_))
+    #define NM_ATOMIC_VALUE_CAS(atomic_val_, expected_val_, new_val_) ((nm_atomic_value_t)NM_INTERLOCKED_VALUE_(_InterlockedCompareExchange)((volatile nm_interlocked_value_t*)(atomic_val_), (nm_interlocked_value_t)(new_val_), (nm_interlocked_value_t)(expected_val_)))
+    #define NM_ATOMIC_FLAG_SET(atomic_flag_, new_val_) (void)_InterlockedExchange8((volatile char*)(atomic_flag_), (char)(new_val_))
+    #define NM_ATOMIC_FLAG_SET_IF(atomic_flag_, cond_val_, new_val_) { (void)_InterlockedCompareExchange8((volatile char*)(atomic_flag_), (char)(new_val_), (char)(cond_val_)); }
+    #define NM_ATOMIC_FLAG_LOAD(atomic_flag_) (*(volatile nm_atomic_flag_t*)(atomic_flag_))
+    #define NM_ATOMIC_INT_LOAD(atomic_int_) (*(volatile nm_atomic_int_t*)(atomic_int_))
+    #define NM_ATOMIC_INT_LOAD_RELAXED(atomic_int_) (*(volatile nm_atomic_int_t*)(atomic_int_))
+    #define NM_ATOMIC_INT_STORE(atomic_int_, new_val_) (void)(*(volatile nm_atomic_int_t*)(atomic_int_) = (new_val_))
+    #define NM_ATOMIC_INT_FETCH_ADD(atomic_int_, val_to_add_) ((nm_atomic_int_t)_InterlockedExchangeAdd((volatile long*)(atomic_int_), (long)(val_to_add_)))
+    #define NM_ATOMIC_INT_EXCHANGE(atomic_int_, new_val_) ((nm_atomic_int_t)_InterlockedExchange((volatile long*)(atomic_int_), (long)(new_val_)))
+    #define NM_ATOMIC_INT_CAS(atomic_int_, expected_val_, new_val_) ((nm_atomic_int_t)_InterlockedCompareExchange((volatile long*)(atomic_int_), (long)(new_val_), (long)(expected_val_)))
+    #define NM_ATOMIC_PTR_LOAD(atomic_ptr_) (*(void* volatile*)(atomic_ptr_))
+    #define NM_ATOMIC_PTR_STORE(atomic_ptr_, new_val_) (void)_InterlockedExchangePointer((void* volatile*)(atomic_ptr_), (void*)(new_val_))
+    #define NM_ATOMIC_PTR_EXCHANGE(atomic_ptr_, new_val_) _InterlockedExchangePointer((void* volatile*)(atomic_ptr_), (void*)(new_val_))
+    #define NM_ATOMIC_PTR_CAS(atomic_ptr_, expected_val_, new_val_) _InterlockedCompareExchangePointer((void* volatile*)(atomic_ptr_), (void*)(new_val_), (void*)(expected_val_))
+    #define NM_ATOMIC_FENCE() MemoryBarrier()
+#else
+    #error Compiler not supported
+#endif
 
 #if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
 	/* Implementation of POSIX sem_t wrapper for Windows OS Semaphore (required functionallity only) */
@@ -181,22 +367,187 @@ typedef unsigned char nm_atomic_flag_t;
     int sem_destroy(sem_t* sem_);
 #elif defined(__linux__)
 	#include <semaphore.h>
+	#include <pthread.h>
 #else
     #error Environment not supported
 #endif
 
+/* Time: */
+#if defined(_MSC_VER)
+typedef unsigned __int64 nm_uint64_t;
+#else
+typedef unsigned long long nm_uint64_t;
+#endif
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds (suitable only for measuring intervals)
+ * @return nm_uint64_t - the current monotonic time in nanoseconds
+ */
+nm_uint64_t nm_time_now_ns(void);
+
+/* Threads: */
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+typedef HANDLE nm_thread_t;
+#else
+typedef pthread_t nm_thread_t;
+#endif
+
+/**
+ * @brief A thread routine to run in a newly created thread
+ * @param[in] arg_: The argument that was given to nm_thread_create
+ * @return None
+ */
+typedef void (*nm_thread_routine)(void* arg_);
+
+/**
+ * @brief Creates a new thread that runs the given routine with the given argument
+ * @param[out] thread_: A pointer to a thread handle to initialize
+ * @param[in] routine_: The routine to run in the new thread
+ * @param[in] arg_: The argument to pass to the routine
+ * @return int - 0, on success / -1, on failure
+ */
+int nm_thread_create(nm_thread_t* thread_, nm_thread_routine routine_, void* arg_);
+
+/**
+ * @brief Waits for a thread (that was created by nm_thread_create) to finish, and releases its resources
+ * @param[in] thread_: A pointer to the thread handle to join
+ * @return int - 0, on success / -1, on failure
+ */
+int nm_thread_join(nm_thread_t* thread_);
+
 typedef struct nm_mutex_t nm_mutex_t;
 
 int nm_mutex_init(nm_mutex_t* mtx_);
+/* Initializes a priority-inheritance mutex (Linux FUTEX_LOCK_PI), returns -1 where it is not supported */
+int nm_mutex_init_pi(nm_mutex_t* mtx_);
 int nm_mutex_destroy(nm_mutex_t* mtx_);
 void nm_mutex_lock(nm_mutex_t* mtx_);
 void nm_mutex_unlock(nm_mutex_t* mtx_);
+/* Returns 1 if the mutex was locked, 0 if it is held by another thread (never blocks) */
+int nm_mutex_trylock(nm_mutex_t* mtx_);
+
+/*
+ * A condition variable for nm_mutex_t. A broadcast wakes a single waiter and requeues all the others
+ * directly onto the mutex (FUTEX_CMP_REQUEUE), so they are woken one by one as the mutex is released
+ * instead of all of them stampeding the mutex at once (Windows falls back to waking all of them).
+ * All the waits on a condition variable must use the same mutex.
+ * With a priority-inheritance mutex a broadcast wakes all the waiters too.
+ */
+typedef struct nm_cond_t nm_cond_t;
+
+int nm_cond_init(nm_cond_t* cond_);
+int nm_cond_destroy(nm_cond_t* cond_);
+/* May wake up spuriously - always wait in a loop that re-checks the condition */
+void nm_cond_wait(nm_cond_t* cond_, nm_mutex_t* mtx_);
+/* Returns 0 if woken up, -1 if the deadline (a nm_time_now_ns timestamp) has passed - the mutex is re-locked either way */
+int nm_cond_wait_until(nm_cond_t* cond_, nm_mutex_t* mtx_, nm_uint64_t deadline_ns_);
+void nm_cond_signal(nm_cond_t* cond_);
+void nm_cond_broadcast(nm_cond_t* cond_);
 
+/*
+ * A reusable barrier, with split-phase operations (like std::barrier): a thread can announce its arrival,
+ * do independent work, and only then wait for the phase to complete.
+ * A thread must not arrive twice in the same phase.
+ */
 typedef struct nm_barrier_t nm_barrier_t;
+typedef unsigned int nm_barrier_token;
 
 int nm_barrier_init(nm_barrier_t* barrier_, unsigned int threads_count_);
 int nm_barrier_destroy(nm_barrier_t* barrier_);
+/* Arrives and waits for the phase to complete */
 void nm_barrier_wait(nm_barrier_t* barrier_);
+/* Arrives without waiting, returns the token of the phase it arrived at */
+nm_barrier_token nm_barrier_arrive(nm_barrier_t* barrier_);
+/* Arrives without waiting, and leaves the barrier - the next phases expect one thread less */
+nm_barrier_token nm_barrier_arrive_and_drop(nm_barrier_t* barrier_);
+/* Waits for the phase of the given token to complete */
+void nm_barrier_wait_phase(nm_barrier_t* barrier_, nm_barrier_token token_);
+/* Returns 0 if the phase completed, -1 if the deadline (a nm_time_now_ns timestamp) has passed first -
+   the arrival stays counted, so the thread may wait again with the same token, or leave with nm_barrier_arrive_and_drop
+   once the phase completes */
+int nm_barrier_wait_until(nm_barrier_t* barrier_, nm_barrier_token token_, nm_uint64_t deadline_ns_);
+
+/*
+ * A counting semaphore on a single futex word, that acquires and releases any number of units in a single call
+ * (nm_semaphore_release_n wakes at most min(n, waiters) threads with a single syscall).
+ * While the waiters ask for different unit counts, every release wakes all of them instead (a single wakeup
+ * could go to a waiter that needs more units than were released, while a smaller waiter keeps sleeping),
+ * so mixing big and small acquisitions on the same semaphore costs a thundering herd on each release - until
+ * all the waiters have left.
+ * At most INT_MAX units - the *_n functions reject a larger n_.
+ */
+typedef struct nm_semaphore_t nm_semaphore_t;
+
+int nm_semaphore_init(nm_semaphore_t* sem_, unsigned int initial_value_);
+int nm_semaphore_destroy(nm_semaphore_t* sem_);
+/* Returns 0 if the n_ units were acquired, -1 if n_ is larger than INT_MAX */
+int nm_semaphore_acquire_n(nm_semaphore_t* sem_, unsigned int n_);
+/* Returns 1 if the n_ units were acquired, 0 otherwise (never blocks) */
+int nm_semaphore_try_acquire_n(nm_semaphore_t* sem_, unsigned int n_);
+/* Returns 0 if the n_ units were acquired, -1 if the deadline (a nm_time_now_ns timestamp) has passed, or n_ is larger than INT_MAX */
+int nm_semaphore_acquire_n_until(nm_semaphore_t* sem_, unsigned int n_, nm_uint64_t deadline_ns_);
+/* Returns 0 on success, -1 if n_ is larger than INT_MAX, or the value would pass INT_MAX (nothing is released) */
+int nm_semaphore_release_n(nm_semaphore_t* sem_, unsigned int n_);
+
+/*
+ * An eventcount - lets a lock-free data structure block its consumers on a condition without taking a lock:
+ *     key = nm_eventcount_prepare_wait(ec);
+ *     if(condition is met) { nm_eventcount_cancel_wait(ec); } else { nm_eventcount_commit_wait(ec, key); }
+ * and the producers call nm_eventcount_notify_one/all after making the condition true.
+ * A notify costs a fence and a single relaxed load while nobody waits.
+ * The waiters count and the notification epoch share a single futex word (16 bits each),
+ * so up to 65535 threads can wait at once, and a waiter that misses 65536 notifications
+ * between prepare and commit may sleep until the next one.
+ */
+typedef struct nm_eventcount_t
+{
+	nm_atomic_int_t state_; /* Private - the futex word: [epoch (16 bits) | waiters count (16 bits)] */
+} nm_eventcount_t; /* Complete, so it can be embedded in the typed queues (NM_BBQ_DEFINE) */
+typedef unsigned int nm_eventcount_key;
+
+int nm_eventcount_init(nm_eventcount_t* ec_);
+int nm_eventcount_destroy(nm_eventcount_t* ec_);
+nm_eventcount_key nm_eventcount_prepare_wait(nm_eventcount_t* ec_);
+void nm_eventcount_cancel_wait(nm_eventcount_t* ec_);
+void nm_eventcount_commit_wait(nm_eventcount_t* ec_, nm_eventcount_key key_);
+/* Returns 0 if notified, -1 if the deadline (a nm_time_now_ns timestamp) has passed (the wait is cancelled either way) */
+int nm_eventcount_commit_wait_until(nm_eventcount_t* ec_, nm_eventcount_key key_, nm_uint64_t deadline_ns_);
+void nm_eventcount_notify_one(nm_eventcount_t* ec_);
+void nm_eventcount_notify_all(nm_eventcount_t* ec_);
+
+/*
+ * Epoch based memory reclamation (a single process-wide domain), for lock-free structures and buffers that are
+ * replaced while other threads may still read them. A reader accesses the structure between nm_epoch_enter and
+ * nm_epoch_exit, and a writer that unlinked a node hands it to nm_epoch_retire - the node is freed once the global
+ * epoch has advanced twice, i.e. once every thread that could still see it has left its critical region.
+ * Entering costs a store and a fence. Critical regions nest, and must never block (they stall all the freeing).
+ * The retired object embeds a nm_epoch_node (like an intrusive list node), so retiring never allocates.
+ * Each thread frees its own retired nodes in batches, the nodes of an exiting thread are handed over to the others.
+ */
+typedef struct nm_epoch_node nm_epoch_node;
+typedef void (*nm_epoch_free_callback)(nm_epoch_node* node_);
+
+struct nm_epoch_node
+{
+    nm_epoch_node* next_;
+    nm_epoch_free_callback free_;
+    unsigned int epoch_;
+};
+
+/* Registers the calling thread (the first nm_epoch_enter does it implicitly), returns 0 on success, -1 on failure */
+int nm_epoch_register(void);
+/* Unregisters the calling thread (done automatically when a registered thread exits), must be outside a critical region */
+void nm_epoch_unregister(void);
+/* Returns 0 on success, -1 if the calling thread could not be registered (then it must not call nm_epoch_exit) */
+int nm_epoch_enter(void);
+void nm_epoch_exit(void);
+/* Calls free_(node_) once no thread can see it - the object must be already unreachable for new readers */
+void nm_epoch_retire(nm_epoch_node* node_, nm_epoch_free_callback free_);
+/* Frees the calling thread's retired nodes (and the ones left by exited threads) that are safe to free */
+void nm_epoch_reclaim(void);
+/* Waits until no thread can see any object that was unlinked before the call, then reclaims -
+   must be outside a critical region */
+void nm_epoch_synchronize(void);
 
 /* --------------------------------------------- End of Sync utils ----------------------------------------------- */
 
@@ -209,24 +560,1030 @@ void nm_barrier_wait(nm_barrier_t* barrier_);
 
 typedef struct nm_blocking_bounded_queue nm_blocking_bounded_queue;
 
+#define NM_BBQ_WAIT_FOREVER ((unsigned long)-1)
+
 typedef enum nm_bbq_status
 {
     NM_BBQ_SUCCESS,
     NM_BBQ_UNINITIALIZED_ERROR,
-    NM_BBQ_IS_CLOSED
+    NM_BBQ_IS_CLOSED,
+    NM_BBQ_TIMEOUT,
+    NM_BBQ_ALLOCATION_ERROR,
+    NM_BBQ_UNSUPPORTED_ERROR,
+    NM_BBQ_NOT_FOUND,
+    NM_BBQ_IO_ERROR
 } nm_bbq_status;
 
+/**
+ * @brief The destruction policy of the queue - a callback function that will be called on each element
+ *        that is left in the queue when the queue is destroyed
+ * @param[in] element_: A pointer to an element to destroy
+ * @param[in] callback_context_: The context that was given to nm_blocking_bounded_queue_destroy
+ * @return None
+ */
 typedef void (*bbq_destruction_policy_callback)(void* element_, void* callback_context_);
 
+/**
+ * @brief A predicate callback function that selects the items of a conditional take or removal
+ * @param[in] element_: A pointer to an element of the queue
+ * @param[in] context_: The context that was given to the conditional take or removal
+ * @return int - 1 if the element is selected, 0 otherwise
+ *
+ * @warning Called with the queue locked - it must not call any function of the queue
+ */
+typedef int (*bbq_predicate_callback)(const void* element_, void* context_);
+
+/**
+ * @brief The order in which blocked takers are woken up when items arrive
+ * @details NM_BBQ_WAKE_DEFAULT - the semaphore's own order (effectively FIFO, the cheapest)
+ *          NM_BBQ_WAKE_LIFO - the most recently parked taker first: a small set of cache-warm threads
+ *                             handles light load while the rest stay parked
+ *          NM_BBQ_WAKE_FIFO - the longest parked taker first: work is spread fairly over all the takers
+ */
+typedef enum nm_bbq_wake_policy
+{
+    NM_BBQ_WAKE_DEFAULT,
+    NM_BBQ_WAKE_LIFO,
+    NM_BBQ_WAKE_FIFO
+} nm_bbq_wake_policy;
+
+/**
+ * @brief The lock that protects the queue's ring
+ * @details NM_BBQ_LOCK_MUTEX - the default futex mutex
+ *          NM_BBQ_LOCK_PRIORITY_INHERIT - a priority-inheritance mutex: a lower priority thread that holds the lock
+ *                                         is boosted to the priority of the highest priority thread that waits for it,
+ *                                         which bounds the lock wait of real-time threads (Linux only)
+ *          NM_BBQ_LOCK_TICKET - a FIFO spin lock: waiters are served in arrival order (no starvation)
+ *          NM_BBQ_LOCK_MCS - a FIFO queue spin lock: each waiter spins on its own cache line,
+ *                            so a handoff touches only the next waiter's line
+ *          NM_BBQ_LOCK_COHORT - a NUMA-aware lock: a lock holder hands the lock to waiters of its own NUMA node
+ *                               first (up to a bound), so the ring's cache lines stay on one socket longer
+ *          The spin locks yield the CPU after a short spin, but they fit best when threads <= cores
+ */
+typedef enum nm_bbq_lock_kind
+{
+    NM_BBQ_LOCK_MUTEX,
+    NM_BBQ_LOCK_PRIORITY_INHERIT,
+    NM_BBQ_LOCK_TICKET,
+    NM_BBQ_LOCK_MCS,
+    NM_BBQ_LOCK_COHORT
+} nm_bbq_lock_kind;
+
+/**
+ * @brief How the threads operate on the queue's ring
+ * @details NM_BBQ_MODE_LOCKED - every put/take locks the ring for its own operation
+ *          NM_BBQ_MODE_COMBINING - flat combining: a put/take that does not need to block publishes its operation
+ *                                  in a publication record, and a single thread (the combiner) locks the ring
+ *                                  and executes all the published operations in one pass, while the ring is cache-hot.
+ *                                  Pays off when many threads hammer the queue, costs a little latency when it is
+ *                                  lightly used. Operations that must block take the locked path in both modes
+ *          NM_BBQ_MODE_UNBOUNDED - a lock-free unbounded queue of linked ring segments (capacity_ items each),
+ *                                  whose puts never block. Takers block only while it is empty. Segments are
+ *                                  allocated on demand and reclaimed by epochs once all the takers have left them.
+ *                                  Requires NM_BBQ_WAKE_DEFAULT (lock_kind_ is ignored), and does not support
+ *                                  consumer groups. The size of the queue is approximate while it is in use
+ */
+typedef enum nm_bbq_mode
+{
+    NM_BBQ_MODE_LOCKED,
+    NM_BBQ_MODE_COMBINING,
+    NM_BBQ_MODE_UNBOUNDED
+} nm_bbq_mode;
+
+/**
+ * @brief What the slots of the queue's ring hold
+ * @details NM_BBQ_SLOTS_POINTER - the items themselves (a void* per slot)
+ *          NM_BBQ_SLOTS_COMPACT - 32-bit offsets of the items from a registered base (compact_base_),
+ *                                 in units of 2^compact_shift_ bytes: the ring takes half of the memory, and a cache line
+ *                                 holds twice the slots. With a NULL base, the items are 32-bit handles (cast to void*).
+ *                                 The items are encoded by the puts and decoded by the takes - an item that cannot be
+ *                                 encoded is rejected. Not supported in NM_BBQ_MODE_UNBOUNDED, and the operations that
+ *                                 work on the ring's buffer (resize, drain_all, transfer, take_if, remove_if) return
+ *                                 NM_BBQ_UNSUPPORTED_ERROR
+ */
+typedef enum nm_bbq_slots
+{
+    NM_BBQ_SLOTS_POINTER,
+    NM_BBQ_SLOTS_COMPACT
+} nm_bbq_slots;
+
+/**
+ * @brief A callback that is called when the segments of an unbounded queue exceed its memory budget
+ * @details Called once per crossing, by the put that allocated the exceeding segment (the put still succeeds).
+ *          It is called again only after the queue's memory drops back within the budget
+ * @param[in] bbq_: The queue that exceeded its memory budget
+ * @param[in] used_bytes_: The memory that the queue's segments use
+ * @param[in] callback_context_: The memory_budget_context_ of the queue's configuration
+ * @return None
+ */
+typedef void (*bbq_memory_budget_callback)(nm_blocking_bounded_queue* bbq_, size_t used_bytes_, void* callback_context_);
 
-/* TODO: Add documentation for each API function and about the destruction_policy */
+/**
+ * @brief A callback that serializes an item into a spill record (see spill_path_ of nm_bbq_config)
+ * @details Like snprintf: if the record does not fit in buffer_size_ bytes, it returns the size the record needs
+ *          (the buffer's content is then ignored), and it is called again with a larger buffer
+ * @param[in] item_: The item to serialize
+ * @param[out] buffer_: A buffer to write the record to
+ * @param[in] buffer_size_: The size of the buffer
+ * @param[in] callback_context_: The spill_context_ of the queue's configuration
+ * @return size_t - the size of the record (> 0), on success / 0, on failure (the item is not put)
+ *
+ * @warning Called with the queue locked - it must not call any function of the queue
+ */
+typedef size_t (*bbq_spill_encode_callback)(const void* item_, void* buffer_, size_t buffer_size_, void* callback_context_);
+
+/**
+ * @brief A callback that rebuilds an item from a spill record, when the record is moved back to the queue's ring
+ * @param[in] record_: The record, as the encode callback wrote it (valid only during the call)
+ * @param[in] record_size_: The size of the record
+ * @param[in] callback_context_: The spill_context_ of the queue's configuration
+ * @return void* - the rebuilt item, on success / NULL, on failure (the record is dropped)
+ *
+ * @warning Called with the queue locked - it must not call any function of the queue
+ */
+typedef void* (*bbq_spill_decode_callback)(const void* record_, size_t record_size_, void* callback_context_);
+
+/**
+ * @brief The creation configuration of a nm_blocking_bounded_queue
+ * @details The spill tier (spill_path_): puts that find the ring full never block - the items are serialized
+ *          (spill_encode_) into large buffered appends of a sequential spill file, and the takes move them back to
+ *          the slots they free (spill_decode_), in bulk reads of the file. Once an item is spilled, the following puts
+ *          are spilled after it until the file is drained, so the queue stays FIFO across both tiers.
+ *          The file is written and read with the queue unlocked, and is truncated whenever it is drained.
+ *          A failed write or read keeps its records - the next puts and takes retry it, and return NM_BBQ_IO_ERROR
+ *          while it keeps failing. Requires NM_BBQ_MODE_LOCKED and NM_BBQ_SLOTS_POINTER.
+ *          The operations that work on the ring's buffer (resize, drain_all, transfer, take_if, remove_if)
+ *          return NM_BBQ_UNSUPPORTED_ERROR, and snapshot and contains see only the items in the ring
+ * @warning Always initialize it with nm_bbq_config_init before setting its fields
+ */
+typedef struct nm_bbq_config
+{
+    size_t capacity_;
+    nm_bbq_wake_policy wake_policy_;
+    nm_bbq_lock_kind lock_kind_;
+    nm_bbq_mode mode_;
+    size_t memory_budget_bytes_; /* NM_BBQ_MODE_UNBOUNDED only, 0 for no budget */
+    bbq_memory_budget_callback memory_budget_callback_;
+    void* memory_budget_context_;
+    size_t prefetch_distance_; /* The payloads that nm_blocking_bounded_queue_take_n prefetches, 0 to disable (default) */
+    size_t prefetch_bytes_; /* The bytes prefetched from the beginning of each payload (rounded up to cache lines), 0 for one line */
+    nm_bbq_slots slots_;
+    const void* compact_base_; /* NM_BBQ_SLOTS_COMPACT only: the items are at compact_base_ + (offset << compact_shift_) */
+    unsigned int compact_shift_; /* NM_BBQ_SLOTS_COMPACT only: the items' alignment is (at least) 2^compact_shift_ bytes */
+    const char* spill_path_; /* The spill file of the overflow tier (created, and deleted by destroy), NULL to disable (default) */
+    size_t spill_buffer_bytes_; /* The spill buffers (3: writing, written and reading, each), and the maximum record size, 0 for 1 MB */
+    bbq_spill_encode_callback spill_encode_;
+    bbq_spill_decode_callback spill_decode_;
+    bbq_destruction_policy_callback spill_release_; /* Called on each item once it is spilled, or NULL */
+    void* spill_context_; /* Sent to the spill callbacks */
+} nm_bbq_config;
+
+/**
+ * @brief The items that nm_blocking_bounded_queue_drain_all removed from a queue, in their queue order
+ */
+typedef struct nm_bbq_span
+{
+    void** first_;
+    size_t first_count_;
+    void** second_; /* The part that wrapped around the ring, NULL if second_count_ is 0 */
+    size_t second_count_;
+    void* buffer_; /* Internal - the drained ring buffer, recycled by nm_blocking_bounded_queue_drain_release */
+    size_t buffer_capacity_;
+} nm_bbq_span;
+
+
+/**
+ * @brief Initializes a queue creation configuration with the default values
+ * @param[out] config_: A configuration to initialize
+ * @param[in] capacity_: The maximum number of items the queue can hold (the segment size in NM_BBQ_MODE_UNBOUNDED)
+ * @return None
+ */
+void nm_bbq_config_init(nm_bbq_config* config_, size_t capacity_);
+
+
+/**
+ * @brief Dynamically creates a new nm_blocking_bounded_queue object of a given capacity
+ * @param[in] init_capacity_: The maximum number of items the queue can hold
+ * @return nm_blocking_bounded_queue* - on success / NULL - on failure
+ *
+ * @warning If init_capacity_ is 0: function will fail and return NULL
+ */
 nm_blocking_bounded_queue* nm_blocking_bounded_queue_create(size_t init_capacity_);
+
+
+/**
+ * @brief Dynamically creates a new nm_blocking_bounded_queue object with a given configuration
+ * @param[in] config_: The configuration of the queue to create (initialized by nm_bbq_config_init)
+ * @return nm_blocking_bounded_queue* - on success / NULL - on failure
+ *
+ * @warning If config_->capacity_ is 0: function will fail and return NULL
+ * @warning If config_->lock_kind_ is not supported on the current OS: function will fail and return NULL
+ * @warning If config_->mode_ is NM_BBQ_MODE_UNBOUNDED with a wake policy other than NM_BBQ_WAKE_DEFAULT:
+ *          function will fail and return NULL
+ * @warning If config_->slots_ is NM_BBQ_SLOTS_COMPACT with NM_BBQ_MODE_UNBOUNDED, or with a compact_shift_ that is not
+ *          less than the bits of a pointer: function will fail and return NULL
+ * @warning If config_->spill_path_ is set with a mode other than NM_BBQ_MODE_LOCKED, with NM_BBQ_SLOTS_COMPACT,
+ *          without the encode and decode callbacks, or if the spill file cannot be created: function will fail and return NULL
+ */
+nm_blocking_bounded_queue* nm_blocking_bounded_queue_create_ex(const nm_bbq_config* config_);
+
+
+/**
+ * @brief Closes the queue, and dynamically deallocates it, NULLs the nm_blocking_bounded_queue's pointer
+ * @details Threads that are blocked on the queue are woken up (returning NM_BBQ_IS_CLOSED),
+ *          and the function waits for all of them to leave the queue before deallocating it.
+ *          The spilled items are decoded for the destruction policy (and are discarded without one, or if they
+ *          cannot be read from the spill file)
+ * @param[in] bbq_: A nm_blocking_bounded_queue to deallocate
+ * @param[in] callback_: The destruction policy - a function pointer to be used to destroy each element that is left
+ *                       in the queue, or a NULL if no such destroy is required
+ * @param[in] callback_context_: User provided context, that will be sent to the destruction policy callback
+ * @return None
+ *
+ * @warning No new calls on the queue are allowed once this function was called
+ */
 void nm_blocking_bounded_queue_destroy(nm_blocking_bounded_queue** bbq_, bbq_destruction_policy_callback callback_, void* callback_context_);
+
+
+/**
+ * @brief Closes the queue: all the blocked threads are woken up, and all the next operations on the queue will fail
+ * @details The items that are staged in the queue's producer handles are flushed first (as many as the queue has room for)
+ * @param[in] bbq_: A nm_blocking_bounded_queue to close
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is already closed
+ */
+nm_bbq_status nm_blocking_bounded_queue_close(nm_blocking_bounded_queue* bbq_);
+
+
+/**
+ * @brief Inserts an item to the end of the queue, blocks while the queue is full
+ * @details With a spill tier it never blocks: an item that finds the ring full is spilled
+ * @param[in] bbq_: A nm_blocking_bounded_queue to insert an item to
+ * @param[in] item_: The item to insert to the end of the queue, cannot be NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or the item cannot be encoded in a compact slot
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - a new segment, or the calling thread's epoch record, could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only), or the item could not be spilled (encoded)
+ * @retval NM_BBQ_IO_ERROR on error - the spill file could not be written or read (retried by each put and take)
+ */
 nm_bbq_status nm_blocking_bounded_queue_put(nm_blocking_bounded_queue* bbq_, void* item_);
+
+
+/**
+ * @brief Inserts items to the end of the queue (in their order), blocks while the queue is full
+ * @details The items are put in batches of the free slots that are available, each batch in a single lock hold
+ *          and with a single wakeup step for the takers. With a spill tier it never blocks (see nm_blocking_bounded_queue_put)
+ * @param[in] bbq_: A nm_blocking_bounded_queue to insert the items to
+ * @param[in] items_: The items to insert, none of them can be NULL
+ * @param[in] count_: The number of items to insert
+ * @param[out] put_count_ptr_: A pointer to a variable that used to return the number of inserted items, or NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success (all the items were inserted)
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or one of the items is NULL or cannot be encoded
+ *                                       in a compact slot (none is inserted)
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting), the rest of the items were not inserted
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - a new segment, or the calling thread's epoch record, could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only), or an item could not be spilled - the rest of the items
+ *                                   were not inserted
+ * @retval NM_BBQ_IO_ERROR on error - the spill file could not be written or read, the rest of the items were not inserted
+ */
+nm_bbq_status nm_blocking_bounded_queue_put_n(nm_blocking_bounded_queue* bbq_, void** items_, size_t count_, size_t* put_count_ptr_);
+
+
+/**
+ * @brief Removes an item from the beginning of the queue, blocks while the queue is empty
+ * @param[in] bbq_: A nm_blocking_bounded_queue to remove an item from
+ * @param[out] item_ptr_: A pointer to a variable that used to return the wanted item value by reference
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - the calling thread's epoch record could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only)
+ * @retval NM_BBQ_IO_ERROR on error - the spill file could not be written or read (retried by each put and take)
+ */
 nm_bbq_status nm_blocking_bounded_queue_take(nm_blocking_bounded_queue* bbq_, void** item_ptr_);
+
+
+/**
+ * @brief Removes an item from the beginning of the queue, blocks up to timeout_ms_ milliseconds while the queue is empty
+ * @param[in] bbq_: A nm_blocking_bounded_queue to remove an item from
+ * @param[out] item_ptr_: A pointer to a variable that used to return the wanted item value by reference
+ * @param[in] timeout_ms_: The maximum time to wait for an item, in milliseconds
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ * @retval NM_BBQ_TIMEOUT on error - no item became available in time
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - the calling thread's epoch record could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only)
+ * @retval NM_BBQ_IO_ERROR on error - the spill file could not be written or read (retried by each put and take)
+ */
+nm_bbq_status nm_blocking_bounded_queue_take_timed(nm_blocking_bounded_queue* bbq_, void** item_ptr_, unsigned long timeout_ms_);
+
+
+/**
+ * @brief Removes up to max_items_ items from the beginning of the queue, blocks while the queue is empty
+ * @details Blocks for the first item only, and takes the items that are already in the queue with it (in a single lock hold).
+ *          If the queue's prefetch_distance_ is not 0, the first cache lines (prefetch_bytes_) of the payloads of the first
+ *          prefetch_distance_ taken items are prefetched before the function returns - see nm_blocking_bounded_queue_prefetch
+ *          for the rest of the batch
+ * @param[in] bbq_: A nm_blocking_bounded_queue to remove the items from
+ * @param[out] items_: An array of at least max_items_ elements, to return the removed items in (in their queue order)
+ * @param[in] max_items_: The maximum number of items to remove
+ * @param[out] taken_count_ptr_: A pointer to a variable that used to return the number of removed items, or NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success (at least one item was removed)
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or max_items_ is 0
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - the calling thread's epoch record could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only)
+ * @retval NM_BBQ_IO_ERROR on error - the spill file could not be written or read (retried by each put and take)
+ */
+nm_bbq_status nm_blocking_bounded_queue_take_n(nm_blocking_bounded_queue* bbq_, void** items_, size_t max_items_, size_t* taken_count_ptr_);
+
+
+/**
+ * @brief Prefetches the first cache lines (the queue's prefetch_bytes_) of the payloads that the items point to
+ * @details Lets a consumer keep the prefetches of a taken batch ahead of its processing - e.g. when it starts processing
+ *          items_[i], it prefetches items_[i + prefetch_distance_]
+ * @param[in] bbq_: The nm_blocking_bounded_queue the items were taken from
+ * @param[in] items_: The items whose payloads to prefetch
+ * @param[in] count_: The number of items
+ * @return None
+ *
+ * @warning Prefetching never faults, but the items should still point to their payloads
+ */
+void nm_blocking_bounded_queue_prefetch(nm_blocking_bounded_queue* bbq_, void* const* items_, size_t count_);
+
+
+/**
+ * @brief Changes the capacity of a live queue
+ * @details Growing moves the items to a larger ring and wakes the producers that are blocked on the full queue.
+ *          Shrinking takes effect lazily: free slots are withdrawn right away, and the slots that are still occupied
+ *          are withdrawn as the takers free them - the ring itself is reallocated once the items fit in it
+ * @param[in] bbq_: A nm_blocking_bounded_queue to resize
+ * @param[in] new_capacity_: The new capacity of the queue (1 - INT_MAX)
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or new_capacity_ is out of range
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is closed
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - the larger ring could not be allocated (the capacity is left unchanged)
+ * @retval NM_BBQ_UNSUPPORTED_ERROR on error - the queue is in NM_BBQ_MODE_UNBOUNDED (it has no capacity),
+ *                                   or has NM_BBQ_SLOTS_COMPACT or a spill tier
+ *
+ * @warning Until a shrink completes, the queue may hold more items than its new capacity
+ */
+nm_bbq_status nm_blocking_bounded_queue_resize(nm_blocking_bounded_queue* bbq_, size_t new_capacity_);
+
+
+/**
+ * @brief Removes all the items of the queue at once, by swapping its ring buffer for an empty standby buffer
+ * @details The drained items are returned in span_, in their queue order: first_ (first_count_ items), and then
+ *          second_ (second_count_ items, the part that wrapped around the ring). They can be processed without any lock,
+ *          and the span must then be given back with nm_blocking_bounded_queue_drain_release, to recycle the buffer.
+ *          The producers see only a brief swap, and are woken for the freed slots.
+ *          Items that blocked takers already reserved are left in the queue for them
+ * @param[in] bbq_: A nm_blocking_bounded_queue to drain
+ * @param[out] span_: A span to return the drained items in (empty if there were no items)
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success (even if no items were drained)
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is closed
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - no standby buffer was available, and a new one could not be allocated
+ * @retval NM_BBQ_UNSUPPORTED_ERROR on error - the queue is in NM_BBQ_MODE_UNBOUNDED, or has NM_BBQ_SLOTS_COMPACT
+ *                                   or a spill tier
+ *
+ * @warning Every drained span must be released before the queue is destroyed
+ */
+nm_bbq_status nm_blocking_bounded_queue_drain_all(nm_blocking_bounded_queue* bbq_, nm_bbq_span* span_);
+
+
+/**
+ * @brief Gives a drained span's buffer back to the queue (as its next standby buffer), and empties the span
+ * @param[in] bbq_: The nm_blocking_bounded_queue that the span was drained from
+ * @param[in] span_: A span that was returned by nm_blocking_bounded_queue_drain_all
+ * @return None
+ *
+ * @warning The span's items must not be accessed after this call
+ */
+void nm_blocking_bounded_queue_drain_release(nm_blocking_bounded_queue* bbq_, nm_bbq_span* span_);
+
+
+/**
+ * @brief Moves up to max_items_ items from the beginning of src_ to the end of dst_, without blocking
+ * @details Both queues are locked (in a fixed global order) and the items are moved in up to 4 copies. The takers of dst_
+ *          and the producers of src_ are woken for the moved items. Fewer items are moved if dst_ has no room for them,
+ *          and items that blocked takers of src_ already reserved are left for them
+ * @param[in] dst_: A nm_blocking_bounded_queue to move the items to
+ * @param[in] src_: A nm_blocking_bounded_queue to move the items from
+ * @param[in] max_items_: The maximum number of items to move
+ * @param[out] transferred_ptr_: A pointer to a variable that used to return the number of moved items, or NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success (even if no items were moved)
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or dst_ and src_ are the same queue
+ * @retval NM_BBQ_IS_CLOSED on error - one of the queues is closed
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - a new segment, or the calling thread's epoch record, could not be allocated
+ *                                   (NM_BBQ_MODE_UNBOUNDED only - the items that were moved until then stay moved)
+ * @retval NM_BBQ_UNSUPPORTED_ERROR on error - both queues are in NM_BBQ_MODE_UNBOUNDED, or one of them has
+ *                                   NM_BBQ_SLOTS_COMPACT or a spill tier
+ *
+ * @warning With a NM_BBQ_MODE_UNBOUNDED queue on one side, the items are moved one by one
+ */
+nm_bbq_status nm_blocking_bounded_queue_transfer(nm_blocking_bounded_queue* dst_, nm_blocking_bounded_queue* src_, size_t max_items_,
+                                                size_t* transferred_ptr_);
+
+
+/**
+ * @brief Removes the first item (the closest to the beginning of the queue) that matches a predicate, without blocking
+ * @details The items before it are shifted by one slot, so the cost is in the position of the match
+ * @param[in] bbq_: A nm_blocking_bounded_queue to remove an item from
+ * @param[in] predicate_: A predicate callback that selects the item to remove
+ * @param[in] context_: User provided context, that will be sent to the predicate callback
+ * @param[out] item_ptr_: A pointer to a variable that used to return the removed item value by reference
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is closed
+ * @retval NM_BBQ_UNSUPPORTED_ERROR on error - the queue is in NM_BBQ_MODE_UNBOUNDED, or has NM_BBQ_SLOTS_COMPACT
+ *                                   or a spill tier
+ * @retval NM_BBQ_NOT_FOUND on error - no item matches, or all the items are already reserved by blocked takers
+ */
+nm_bbq_status nm_blocking_bounded_queue_take_if(nm_blocking_bounded_queue* bbq_, bbq_predicate_callback predicate_, void* context_,
+                                               void** item_ptr_);
+
+
+/**
+ * @brief Removes all the items that match a predicate, compacting the queue in place in a single pass
+ * @details The remaining items keep their order. The removed items are released after the queue is unlocked,
+ *          and the blocked producers are woken for the freed slots
+ * @param[in] bbq_: A nm_blocking_bounded_queue to remove the items from
+ * @param[in] predicate_: A predicate callback that selects the items to remove
+ * @param[in] context_: User provided context, that will be sent to the predicate and release callbacks
+ * @param[in] release_: A callback to be called on each removed item, or NULL if no release is required
+ * @param[out] removed_ptr_: A pointer to a variable that used to return the number of removed items, or NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success (even if no items matched)
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is closed
+ * @retval NM_BBQ_UNSUPPORTED_ERROR on error - the queue is in NM_BBQ_MODE_UNBOUNDED, or has NM_BBQ_SLOTS_COMPACT
+ *                                   or a spill tier
+ *
+ * @warning Items that blocked takers already reserved are left for them, even if they match
+ * @warning If the removed items cannot be collected (no memory), they are released with the queue locked
+ */
+nm_bbq_status nm_blocking_bounded_queue_remove_if(nm_blocking_bounded_queue* bbq_, bbq_predicate_callback predicate_, void* context_,
+                                                 bbq_destruction_policy_callback release_, size_t* removed_ptr_);
+
+
+/**
+ * @brief Copies the items of the queue (up to max_items_ of them, from its beginning) without removing them
+ * @details The queue is locked only for the copy of its items (up to 2 memcpys) - no user code runs while it is locked,
+ *          so the copied items can be walked afterwards without stalling the producers and the consumers.
+ *          In NM_BBQ_MODE_UNBOUNDED the segments are walked without any lock, so the copy is not an atomic snapshot.
+ *          With NM_BBQ_SLOTS_COMPACT the items are decoded one by one
+ * @param[in] bbq_: A nm_blocking_bounded_queue to copy the items of
+ * @param[out] items_: An array of at least max_items_ elements, to copy the items to (in their queue order)
+ * @param[in] max_items_: The maximum number of items to copy
+ * @return size_t - the number of copied items, on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ *
+ * @warning The copied items may be taken (and released by their takers) right after the copy
+ */
+size_t nm_blocking_bounded_queue_snapshot(nm_blocking_bounded_queue* bbq_, void** items_, size_t max_items_);
+
+
+/**
+ * @brief Checks if an item (by its pointer value) is in the queue, with a vectorized scan (see nm_queue_find)
+ * @details With NM_BBQ_SLOTS_COMPACT the item is encoded, and the slots are compared one by one
+ * @param[in] bbq_: A nm_blocking_bounded_queue to search in
+ * @param[in] item_: The item to find
+ * @return int - 1 if the item is in the queue or 0 if it is not, on success / -1, on failure (or in NM_BBQ_MODE_UNBOUNDED)
+ */
+int nm_blocking_bounded_queue_contains(nm_blocking_bounded_queue* bbq_, const void* item_);
+
+
+/**
+ * @brief Returns the number of items in the queue (including the spilled items)
+ * @param[in] bbq_: A nm_blocking_bounded_queue to check its size
+ * @return size_t - number of items in the queue, on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ */
 size_t nm_blocking_bounded_queue_size(nm_blocking_bounded_queue* bbq_);
+
+
+/**
+ * @brief Checks if a given nm_blocking_bounded_queue is empty or not
+ * @param[in] bbq_: A nm_blocking_bounded_queue to check if is empty
+ * @return int - 0 if queue is not empty or 1 if queue is empty, on success / -1, on failure
+ */
 int nm_blocking_bounded_queue_is_empty(nm_blocking_bounded_queue* bbq_);
 
+/* ------------------------------------------ End of Blocking Bounded Queue -------------------------------------- */
+
+
+/* --------------------------------------------------------------------------------------------------------------- */
+/* -------------------------------------------- BBQ Consumer Group: ---------------------------------------------- */
+/* --------------------------------------------------------------------------------------------------------------- */
+
+/* Defines: */
+
+typedef struct nm_bbq_consumer_group nm_bbq_consumer_group;
+
+/**
+ * @brief A consumer callback function that will be called (by one of the group's consumer threads) on each taken element
+ * @param[in] element_: The element that was taken from the queue
+ * @param[in] callback_context_: The context that was given to nm_bbq_consumer_group_create
+ * @return None
+ */
+typedef void (*bbq_consumer_callback)(void* element_, void* callback_context_);
+
+/**
+ * @brief The scaling configuration of a managed consumer group
+ * @details Every sample_interval_ms_ the group samples the queue latency (the max of the average sojourn time
+ *          and the age of the oldest queued item).
+ *          A consumer is spawned after scale_up_samples_ consecutive samples above target_sojourn_us_,
+ *          and an idle consumer is retired after idle_retire_ms_ of consecutive samples below
+ *          scale_down_percent_ % of target_sojourn_us_ (the gap between both thresholds is the hysteresis band)
+ */
+typedef struct nm_bbq_consumer_group_config
+{
+    unsigned int min_consumers_;
+    unsigned int max_consumers_;
+    unsigned long target_sojourn_us_;
+    unsigned long sample_interval_ms_;
+    unsigned int scale_up_samples_;
+    unsigned long idle_retire_ms_;
+    unsigned int scale_down_percent_;
+} nm_bbq_consumer_group_config;
+
+
+/**
+ * @brief Initializes a consumer group configuration with the default values
+ * @param[out] config_: A configuration to initialize
+ * @return None
+ */
+void nm_bbq_consumer_group_config_init(nm_bbq_consumer_group_config* config_);
+
+
+/**
+ * @brief Dynamically creates a managed consumer group on a given queue, and starts its min_consumers_ consumer threads
+ * @details The consumers stop once the queue is closed. A failed take (NM_BBQ_IO_ERROR of a spill tier) is retried
+ *          after a sample interval
+ * @param[in] bbq_: The nm_blocking_bounded_queue to consume from
+ * @param[in] callback_: The consumer callback function to call on each taken element
+ * @param[in] callback_context_: User provided context, that will be sent to the consumer callback
+ * @param[in] config_: The scaling configuration, or a NULL to use the default configuration
+ * @return nm_bbq_consumer_group* - on success / NULL - on failure
+ *
+ * @warning If max_consumers_ is 0 or is less than min_consumers_: function will fail and return NULL
+ * @warning If bbq_ is an NM_BBQ_MODE_UNBOUNDED queue: function will fail and return NULL
+ * @warning The group must be destroyed before the queue is destroyed
+ */
+nm_bbq_consumer_group* nm_bbq_consumer_group_create(nm_blocking_bounded_queue* bbq_, bbq_consumer_callback callback_, void* callback_context_, const nm_bbq_consumer_group_config* config_);
+
+
+/**
+ * @brief Stops all the consumer threads of the group (after they finish their current element),
+ *        and dynamically deallocates the group, NULLs the nm_bbq_consumer_group's pointer
+ * @param[in] group_: A nm_bbq_consumer_group to deallocate
+ * @return None
+ *
+ * @warning The queue is not closed, elements that are left in it stay in it
+ */
+void nm_bbq_consumer_group_destroy(nm_bbq_consumer_group** group_);
+
+
+/**
+ * @brief Returns the current number of consumer threads in the group
+ * @param[in] group_: A nm_bbq_consumer_group to check its size
+ * @return unsigned int - the number of running consumer threads, on success / 0, on failure
+ */
+unsigned int nm_bbq_consumer_group_size(nm_bbq_consumer_group* group_);
+
+/* ------------------------------------------ End of BBQ Consumer Group ------------------------------------------ */
+
+
+/* --------------------------------------------------------------------------------------------------------------- */
+/* ------------------------------------------------ BBQ Producer: ------------------------------------------------ */
+/* --------------------------------------------------------------------------------------------------------------- */
+
+/* Defines: */
+
+typedef struct nm_bbq_producer nm_bbq_producer;
+
+
+/**
+ * @brief Dynamically creates a producer handle, that stages the items of a producer thread and puts them in batches
+ * @details A staged batch is flushed to the queue (with nm_blocking_bounded_queue_put_n) when batch_size_ items are staged,
+ *          when its oldest item was staged max_delay_ms_ ago (by a flusher thread of the queue, within about
+ *          1.5 * max_delay_ms_), when nm_bbq_producer_flush is called, and when the queue is closed
+ * @param[in] bbq_: The nm_blocking_bounded_queue to put the items to
+ * @param[in] batch_size_: The maximum number of staged items
+ * @param[in] max_delay_ms_: The maximum time an item stays staged, or NM_BBQ_WAIT_FOREVER for no time bound
+ * @return nm_bbq_producer* - on success / NULL - on failure
+ *
+ * @warning A handle is meant to be used by a single thread (other threads only flush it)
+ * @warning All the handles of a queue must be destroyed before the queue is destroyed
+ */
+nm_bbq_producer* nm_bbq_producer_create(nm_blocking_bounded_queue* bbq_, size_t batch_size_, unsigned long max_delay_ms_);
+
+
+/**
+ * @brief Flushes the staged items of the handle (blocks while the queue is full), and dynamically deallocates it,
+ *        NULLs the nm_bbq_producer's pointer
+ * @param[in] producer_: A nm_bbq_producer to deallocate
+ * @param[in] callback_: A function pointer to be called on each staged item that a closed queue did not accept,
+ *                       or a NULL if no such destroy is required
+ * @param[in] callback_context_: User provided context, that will be sent to the callback
+ * @return None
+ */
+void nm_bbq_producer_destroy(nm_bbq_producer** producer_, bbq_destruction_policy_callback callback_, void* callback_context_);
+
+
+/**
+ * @brief Stages an item, and flushes the staged batch if it is full (blocks while the queue is full)
+ * @param[in] producer_: A nm_bbq_producer to stage the item in
+ * @param[in] item_: The item to stage, cannot be NULL
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or the item cannot be encoded in a compact slot
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (the item may be left staged, see nm_bbq_producer_destroy)
+ * @retval NM_BBQ_ALLOCATION_ERROR on error - the flush could not allocate a new segment (NM_BBQ_MODE_UNBOUNDED only)
+ */
+nm_bbq_status nm_bbq_producer_put(nm_bbq_producer* producer_, void* item_);
+
+
+/**
+ * @brief Flushes the staged items of the handle to the queue, blocks while the queue is full
+ * @param[in] producer_: A nm_bbq_producer to flush
+ * @return nm_bbq_status - success or error status code (see nm_blocking_bounded_queue_put_n)
+ */
+nm_bbq_status nm_bbq_producer_flush(nm_bbq_producer* producer_);
+
+
+/**
+ * @brief Returns the number of items that are staged in the handle
+ * @param[in] producer_: A nm_bbq_producer to check
+ * @return size_t - number of staged items, on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ */
+size_t nm_bbq_producer_staged_count(nm_bbq_producer* producer_);
+
+/* ------------------------------------------------ End of BBQ Producer ------------------------------------------ */
+
+
+/* --------------------------------------------------------------------------------------------------------------- */
+/* ------------------------------------------ BBQ Typed (macro template): ---------------------------------------- */
+/* --------------------------------------------------------------------------------------------------------------- */
+
+/* Defines: */
+
+/* The concurrency mode of a typed queue - the single-side bits let that side claim its slots without a CAS */
+#define NM_BBQ_TYPED_SINGLE_PRODUCER 1
+#define NM_BBQ_TYPED_SINGLE_CONSUMER 2
+#define NM_BBQ_TYPED_MPMC 0
+#define NM_BBQ_TYPED_SPMC NM_BBQ_TYPED_SINGLE_PRODUCER
+#define NM_BBQ_TYPED_MPSC NM_BBQ_TYPED_SINGLE_CONSUMER
+#define NM_BBQ_TYPED_SPSC (NM_BBQ_TYPED_SINGLE_PRODUCER | NM_BBQ_TYPED_SINGLE_CONSUMER)
+
+#define NM_BBQ_TYPED_PAD_SIZE 64 /* Keeps the producers' and the consumers' positions on separate cache lines */
+
+
+/**
+ * @brief Defines a blocking bounded queue that is specialized for the element type T
+ * @details Generates the struct "name" and static inline functions, that store the items by value in an inline array
+ *          of CAPACITY cells (a power of two, checked at compile time), so the hot path has no allocation, no cast
+ *          and no indirect call, and can be inlined into the caller. The ring is a sequence-stamped array
+ *          (every cell holds its turn number), so a put and a take touch one cell and one position each, and a
+ *          single producer (or consumer) mode replaces the position CAS with a plain store.
+ *          The blocking functions spin on the try functions and sleep on an nm_eventcount_t, the fast path only
+ *          checks a waiters counter, so the library is called only when a thread actually waits.
+ *          The generated functions (all of them get a name* as the first parameter):
+ *              int name##_init(name*) / name##_destroy(name*) - 0 on success, -1 on failure
+ *              nm_bbq_status name##_try_put(name*, T) / name##_try_take(name*, T*) - NM_BBQ_TIMEOUT when full / empty
+ *              nm_bbq_status name##_put(name*, T) / name##_take(name*, T*) - block while full / empty
+ *              nm_bbq_status name##_close(name*) - wakes up all the blocked threads, NM_BBQ_IS_CLOSED if already closed
+ *              size_t name##_size(name*) - approximate while there are concurrent puts and takes
+ *          Example:
+ *              NM_BBQ_DEFINE(point_queue, struct point, 1024, NM_BBQ_TYPED_SPSC)
+ *              point_queue q; point_queue_init(&q); point_queue_put(&q, p); point_queue_take(&q, &p);
+ * @param[in] name: The name of the generated struct, and the prefix of the generated functions
+ * @param[in] T: The element type, copied by value (with assignment)
+ * @param[in] CAPACITY: The number of cells, a power of two
+ * @param[in] MODE: One of NM_BBQ_TYPED_MPMC / SPMC / MPSC / SPSC - the single sides must be used by one thread at a time
+ * @note The struct is large (CAPACITY cells), allocate it statically or dynamically rather than on a small stack
+ * @note The library's API (destruction policies, resizing, timeouts etc.) is not available for typed queues
+ */
+#define NM_BBQ_DEFINE(name, T, CAPACITY, MODE) \
+    typedef char name##_capacity_must_be_a_power_of_two[(CAPACITY) > 0 && ((CAPACITY) & ((CAPACITY) - 1)) == 0 ? 1 : -1]; \
+    \
+    typedef struct name##_cell \
+    { \
+        nm_atomic_value_t seq_; /* The position this cell waits for: pos for a put, pos + 1 for a take */ \
+        T item_; \
+    } name##_cell; \
+    \
+    typedef struct name \
+    { \
+        nm_atomic_value_t enqueue_pos_; \
+        char enqueue_pad_[NM_BBQ_TYPED_PAD_SIZE - sizeof(nm_atomic_value_t)]; \
+        nm_atomic_value_t dequeue_pos_; \
+        char dequeue_pad_[NM_BBQ_TYPED_PAD_SIZE - sizeof(nm_atomic_value_t)]; \
+        nm_atomic_flag_t is_closed_; \
+        nm_atomic_int_t takers_waiting_; \
+        nm_atomic_int_t putters_waiting_; \
+        nm_eventcount_t not_empty_; \
+        nm_eventcount_t not_full_; \
+        name##_cell cells_[CAPACITY]; \
+    } name; \
+    \
+    NM_INLINE int name##_init(name* q_) \
+    { \
+        size_t i; \
+        if(q_ == NULL) return -1; \
+        for(i = 0; i < (size_t)(CAPACITY); ++i) q_->cells_[i].seq_ = i; \
+        q_->enqueue_pos_ = 0; \
+        q_->dequeue_pos_ = 0; \
+        q_->is_closed_ = 0; \
+        q_->takers_waiting_ = 0; \
+        q_->putters_waiting_ = 0; \
+        if(nm_eventcount_init(&q_->not_empty_) != 0) return -1; \
+        if(nm_eventcount_init(&q_->not_full_) != 0) \
+        { \
+            nm_eventcount_destroy(&q_->not_empty_); \
+            return -1; \
+        } \
+        return 0; \
+    } \
+    \
+    NM_INLINE int name##_destroy(name* q_) \
+    { \
+        if(q_ == NULL) return -1; \
+        nm_eventcount_destroy(&q_->not_empty_); \
+        nm_eventcount_destroy(&q_->not_full_); \
+        return 0; \
+    } \
+    \
+    NM_INLINE nm_bbq_status name##_try_put(name* q_, T item_) \
+    { \
+        name##_cell* cell; \
+        nm_atomic_value_t pos, seq, prev; \
+        if(NM_ATOMIC_FLAG_LOAD(&q_->is_closed_)) return NM_BBQ_IS_CLOSED; \
+        pos = NM_ATOMIC_VALUE_LOAD(&q_->enqueue_pos_); \
+        for(;;) \
+        { \
+            cell = &q_->cells_[pos & ((CAPACITY) - 1)]; \
+            seq = NM_ATOMIC_VALUE_LOAD(&cell->seq_); \
+            if(seq == pos) \
+            { \
+                if((MODE) & NM_BBQ_TYPED_SINGLE_PRODUCER) \
+                { \
+                    NM_ATOMIC_VALUE_SET(&q_->enqueue_pos_, pos + 1); \
+                    break; \
+                } \
+                prev = NM_ATOMIC_VALUE_CAS(&q_->enqueue_pos_, pos, pos + 1); \
+                if(prev == pos) break; \
+                pos = prev; \
+            } \
+            else if((ptrdiff_t)(seq - pos) < 0) return NM_BBQ_TIMEOUT; /* The cell was not taken yet - full */ \
+            else pos = NM_ATOMIC_VALUE_LOAD(&q_->enqueue_pos_); \
+        } \
+        cell->item_ = item_; \
+        NM_ATOMIC_VALUE_SET(&cell->seq_, pos + 1); \
+        NM_ATOMIC_FENCE(); /* Orders the publication before the waiters check (pairs with the waiter's increment) */ \
+        if(NM_ATOMIC_INT_LOAD_RELAXED(&q_->takers_waiting_) != 0) nm_eventcount_notify_one(&q_->not_empty_); \
+        return NM_BBQ_SUCCESS; \
+    } \
+    \
+    NM_INLINE nm_bbq_status name##_try_take(name* q_, T* item_ptr_) \
+    { \
+        name##_cell* cell; \
+        nm_atomic_value_t pos, seq, prev; \
+        if(NM_ATOMIC_FLAG_LOAD(&q_->is_closed_)) return NM_BBQ_IS_CLOSED; \
+        pos = NM_ATOMIC_VALUE_LOAD(&q_->dequeue_pos_); \
+        for(;;) \
+        { \
+            cell = &q_->cells_[pos & ((CAPACITY) - 1)]; \
+            seq = NM_ATOMIC_VALUE_LOAD(&cell->seq_); \
+            if(seq == pos + 1) \
+            { \
+                if((MODE) & NM_BBQ_TYPED_SINGLE_CONSUMER) \
+                { \
+                    NM_ATOMIC_VALUE_SET(&q_->dequeue_pos_, pos + 1); \
+                    break; \
+                } \
+                prev = NM_ATOMIC_VALUE_CAS(&q_->dequeue_pos_, pos, pos + 1); \
+                if(prev == pos) break; \
+                pos = prev; \
+            } \
+            else if((ptrdiff_t)(seq - (pos + 1)) < 0) return NM_BBQ_TIMEOUT; /* The cell was not put yet - empty */ \
+            else pos = NM_ATOMIC_VALUE_LOAD(&q_->dequeue_pos_); \
+        } \
+        *item_ptr_ = cell->item_; \
+        NM_ATOMIC_VALUE_SET(&cell->seq_, pos + (CAPACITY)); \
+        NM_ATOMIC_FENCE(); \
+        if(NM_ATOMIC_INT_LOAD_RELAXED(&q_->putters_waiting_) != 0) nm_eventcount_notify_one(&q_->not_full_); \
+        return NM_BBQ_SUCCESS; \
+    } \
+    \
+    NM_INLINE nm_bbq_status name##_put(name* q_, T item_) \
+    { \
+        nm_bbq_status status; \
+        nm_eventcount_key key; \
+        for(;;) \
+        { \
+            status = name##_try_put(q_, item_); \
+            if(status != NM_BBQ_TIMEOUT) return status; \
+            (void)NM_ATOMIC_INT_FETCH_ADD(&q_->putters_waiting_, 1); \
+            key = nm_eventcount_prepare_wait(&q_->not_full_); \
+            status = name##_try_put(q_, item_); \
+            if(status != NM_BBQ_TIMEOUT) nm_eventcount_cancel_wait(&q_->not_full_); \
+            else nm_eventcount_commit_wait(&q_->not_full_, key); \
+            (void)NM_ATOMIC_INT_FETCH_ADD(&q_->putters_waiting_, -1); \
+            if(status != NM_BBQ_TIMEOUT) return status; \
+        } \
+    } \
+    \
+    NM_INLINE nm_bbq_status name##_take(name* q_, T* item_ptr_) \
+    { \
+        nm_bbq_status status; \
+        nm_eventcount_key key; \
+        for(;;) \
+        { \
+            status = name##_try_take(q_, item_ptr_); \
+            if(status != NM_BBQ_TIMEOUT) return status; \
+            (void)NM_ATOMIC_INT_FETCH_ADD(&q_->takers_waiting_, 1); \
+            key = nm_eventcount_prepare_wait(&q_->not_empty_); \
+            status = name##_try_take(q_, item_ptr_); \
+            if(status != NM_BBQ_TIMEOUT) nm_eventcount_cancel_wait(&q_->not_empty_); \
+            else nm_eventcount_commit_wait(&q_->not_empty_, key); \
+            (void)NM_ATOMIC_INT_FETCH_ADD(&q_->takers_waiting_, -1); \
+            if(status != NM_BBQ_TIMEOUT) return status; \
+        } \
+    } \
+    \
+    NM_INLINE nm_bbq_status name##_close(name* q_) \
+    { \
+        if(NM_ATOMIC_FLAG_LOAD(&q_->is_closed_)) return NM_BBQ_IS_CLOSED; \
+        NM_ATOMIC_FLAG_SET(&q_->is_closed_, 1); \
+        nm_eventcount_notify_all(&q_->not_empty_); \
+        nm_eventcount_notify_all(&q_->not_full_); \
+        return NM_BBQ_SUCCESS; \
+    } \
+    \
+    NM_INLINE size_t name##_size(name* q_) \
+    { \
+        nm_atomic_value_t dequeue_pos = NM_ATOMIC_VALUE_LOAD(&q_->dequeue_pos_); \
+        nm_atomic_value_t enqueue_pos = NM_ATOMIC_VALUE_LOAD(&q_->enqueue_pos_); \
+        if((ptrdiff_t)(enqueue_pos - dequeue_pos) <= 0) return 0; \
+        if(enqueue_pos - dequeue_pos > (size_t)(CAPACITY)) return (size_t)(CAPACITY); \
+        return (size_t)(enqueue_pos - dequeue_pos); \
+    }
+
+/* ---------------------------------------- End of BBQ Typed (macro template) ------------------------------------ */
+
+
+/* --------------------------------------------------------------------------------------------------------------- */
+/* ----------------------------------------------- Persistent Queue: --------------------------------------------- */
+/* --------------------------------------------------------------------------------------------------------------- */
+
+/* Defines: */
+
+typedef struct nm_persistent_queue nm_persistent_queue;
+
+/**
+ * @brief The configuration of a persistent queue
+ * @details The records are stored by value in a ring of capacity_ fixed size slots, in a memory mapped file.
+ *          Every record has a commit marker (its sequence number, written after its data) and a checksum,
+ *          and the head and the tail are committed (the records with msync / FlushViewOfFile, then the file header)
+ *          in groups: after commit_items_ puts and takes, and at most commit_interval_ms_ after the first
+ *          uncommitted one (by a committer thread of the queue). 0 disables a bound - with both bounds disabled
+ *          the queue is committed only by nm_persistent_queue_commit and nm_persistent_queue_destroy.
+ */
+typedef struct nm_persistent_queue_config
+{
+    const char* path_; /* The file of the queue - created if it does not exist */
+    size_t capacity_; /* The number of records */
+    size_t record_size_; /* The maximum size of a record, in bytes */
+    size_t commit_items_;
+    unsigned long commit_interval_ms_;
+} nm_persistent_queue_config;
+
+
+/**
+ * @brief Initializes a persistent queue configuration with the default values (a 10 ms group commit interval)
+ * @param[out] config_: A configuration to initialize
+ * @param[in] path_: The file of the queue
+ * @param[in] capacity_: The number of records
+ * @param[in] record_size_: The maximum size of a record, in bytes
+ * @return None
+ */
+void nm_persistent_queue_config_init(nm_persistent_queue_config* config_, const char* path_, size_t capacity_, size_t record_size_);
+
+
+/**
+ * @brief Opens a persistent queue: creates its file, or recovers the queue from an existing file
+ * @details The recovery starts from the last committed head, and takes every record after it that is complete
+ *          (its commit marker and checksum are valid), in order, up to the first one that is not - so the queue
+ *          holds at least all the records of its last commit. The records that were taken after the last commit
+ *          are recovered too (an at-least-once delivery). A file of the right size that was never given a header
+ *          (its creation was interrupted) is initialized as a new file.
+ * @param[in] config_: The configuration of the queue - capacity_ and record_size_ must match an existing file
+ * @return nm_persistent_queue* - on success / NULL - on failure
+ *
+ * @warning If the existing file is not a persistent queue file, or has another capacity or record size: function will fail
+ *          and return NULL (the file is left untouched)
+ * @warning The file is in the byte order and the layout of the platform that created it
+ * @warning A file must be opened by a single nm_persistent_queue at a time
+ */
+nm_persistent_queue* nm_persistent_queue_open(const nm_persistent_queue_config* config_);
+
+
+/**
+ * @brief Commits the queue, closes its file and dynamically deallocates it, NULLs the nm_persistent_queue's pointer
+ * @param[in] pq_: A nm_persistent_queue to deallocate
+ * @return None
+ *
+ * @warning No thread may use the queue while it is destroyed (close it and join the threads first)
+ */
+void nm_persistent_queue_destroy(nm_persistent_queue** pq_);
+
+
+/**
+ * @brief Closes the queue - all the blocked threads are woken up and the next operations fail, the records stay in the file
+ * @param[in] pq_: A nm_persistent_queue to close
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IS_CLOSED on error - the queue is already closed
+ */
+nm_bbq_status nm_persistent_queue_close(nm_persistent_queue* pq_);
+
+
+/**
+ * @brief Copies a record to the end of the queue, blocks while the queue is full
+ * @details The record is durable after the next commit. A full queue whose records were taken since the last commit
+ *          is committed by the put itself (the slots of the taken records are reused only after their take is durable)
+ * @param[in] pq_: A nm_persistent_queue to put the record to
+ * @param[in] record_: The data of the record
+ * @param[in] size_: The size of the record, in bytes (up to the record size of the queue)
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or size_ is more than the record size of the queue
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ * @retval NM_BBQ_IO_ERROR on error - the queue is full, and the commit that frees the slots of the taken records failed
+ */
+nm_bbq_status nm_persistent_queue_put(nm_persistent_queue* pq_, const void* record_, size_t size_);
+
+
+/**
+ * @brief Copies the first record of the queue to a buffer and removes it from the queue, blocks while the queue is empty
+ * @param[in] pq_: A nm_persistent_queue to take the record from
+ * @param[out] buffer_: A buffer to copy the record to
+ * @param[in] buffer_size_: The size of the buffer, at least the record size of the queue
+ * @param[out] size_ptr_: A pointer to a variable that used to return the size of the record by reference
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL, or buffer_size_ is less than the record size of the queue
+ * @retval NM_BBQ_IS_CLOSED on error - the queue was closed (before or while waiting)
+ */
+nm_bbq_status nm_persistent_queue_take(nm_persistent_queue* pq_, void* buffer_, size_t buffer_size_, size_t* size_ptr_);
+
+
+/**
+ * @brief Like nm_persistent_queue_take, but waits at most timeout_ms_ milliseconds for a record
+ * @return nm_bbq_status - success or error status code (see nm_persistent_queue_take)
+ * @retval NM_BBQ_TIMEOUT on error - no record was put before the timeout expired
+ */
+nm_bbq_status nm_persistent_queue_take_timed(nm_persistent_queue* pq_, void* buffer_, size_t buffer_size_, size_t* size_ptr_, unsigned long timeout_ms_);
+
+
+/**
+ * @brief Commits the queue now: the records that were put and taken so far are durable when the function returns
+ * @param[in] pq_: A nm_persistent_queue to commit
+ * @return nm_bbq_status - success or error status code
+ * @retval NM_BBQ_SUCCESS on success
+ * @retval NM_BBQ_UNINITIALIZED_ERROR on error - a given pointer is NULL
+ * @retval NM_BBQ_IO_ERROR on error - the file could not be synchronized (the commit may be retried)
+ */
+nm_bbq_status nm_persistent_queue_commit(nm_persistent_queue* pq_);
+
+
+/**
+ * @brief Returns the number of records in the queue
+ * @param[in] pq_: A nm_persistent_queue to check
+ * @return size_t - number of records, on success
+            / MAX_SIZE_T (-1 as size_t - is the maximum size_t value), on failure
+ */
+size_t nm_persistent_queue_size(nm_persistent_queue* pq_);
+
+/* ----------------------------------------------- End of Persistent Queue --------------------------------------- */
+
 
 #ifdef __cplusplus
 }
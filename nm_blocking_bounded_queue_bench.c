@@ -0,0 +1,1090 @@
+/**
+ * @file nm_blocking_bounded_queue_bench.c
+ * @author Natan Meirov (NatanMeirov@gmail.com)
+ * @brief Benchmark suite of the Blocking Bounded Queue
+ * @version 1.0
+ * @date 2021-12-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Build: together with nm_blocking_bounded_queue.c and nm_blocking_bounded_queue_bench_inline.c
+ * Usage: nm_bbq_bench [benchmark_name [benchmark args...]]
+ *        Runs all the benchmarks (with their default args) if no benchmark name is given
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* nanosleep, getrusage */
+#endif
+
+#include <stdio.h> /* printf, fprintf */
+#include <stdlib.h> /* malloc, calloc, free, qsort, strtoul */
+#include <string.h> /* strcmp */
+#include <limits.h> /* INT_MAX */
+
+#include "nm_blocking_bounded_queue.h"
+
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+	static void bench_sleep_us(unsigned long us_)
+	{
+		Sleep((DWORD)((us_ + 999) / 1000));
+	}
+
+	static nm_uint64_t bench_cpu_time_ns(void)
+	{
+		FILETIME creation, exit, kernel, user;
+		ULARGE_INTEGER kernel_time, user_time;
+
+		GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+		kernel_time.LowPart = kernel.dwLowDateTime;
+		kernel_time.HighPart = kernel.dwHighDateTime;
+		user_time.LowPart = user.dwLowDateTime;
+		user_time.HighPart = user.dwHighDateTime;
+		return (kernel_time.QuadPart + user_time.QuadPart) * 100; /* FILETIME ticks are 100ns */
+	}
+#else
+	#include <time.h> /* nanosleep */
+	#include <sys/resource.h> /* getrusage */
+
+	static void bench_sleep_us(unsigned long us_)
+	{
+		struct timespec duration;
+
+		duration.tv_sec = (time_t)(us_ / 1000000);
+		duration.tv_nsec = (long)(us_ % 1000000) * 1000L;
+		nanosleep(&duration, NULL);
+	}
+
+	static nm_uint64_t bench_cpu_time_ns(void)
+	{
+		struct rusage usage;
+
+		getrusage(RUSAGE_SELF, &usage);
+		return ((nm_uint64_t)usage.ru_utime.tv_sec + (nm_uint64_t)usage.ru_stime.tv_sec) * 1000000000ULL
+			+ ((nm_uint64_t)usage.ru_utime.tv_usec + (nm_uint64_t)usage.ru_stime.tv_usec) * 1000ULL;
+	}
+#endif
+
+
+/* ---------------------------------------------- Bench utils: ------------------------------------------------- */
+
+typedef struct bench_item
+{
+    nm_uint64_t put_ns_;
+    nm_uint64_t latency_ns_;
+    unsigned int consumer_id_;
+} bench_item;
+
+static int compare_uint64(const void* a_, const void* b_)
+{
+    nm_uint64_t a = *(const nm_uint64_t*)a_;
+    nm_uint64_t b = *(const nm_uint64_t*)b_;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/* Sorts the given samples, and returns the requested percentile (0..100) */
+static nm_uint64_t percentile(nm_uint64_t* samples_, size_t count_, unsigned int percent_)
+{
+    size_t idx;
+
+    if(count_ == 0)
+    {
+        return 0;
+    }
+
+    qsort(samples_, count_, sizeof(nm_uint64_t), compare_uint64);
+    idx = (count_ * percent_) / 100;
+    return samples_[idx < count_ ? idx : count_ - 1];
+}
+
+static unsigned long arg_or_default(int argc_, char** argv_, int idx_, unsigned long default_value_)
+{
+    return argc_ > idx_ ? strtoul(argv_[idx_], NULL, 10) : default_value_;
+}
+
+/* --------------------------------------------- End of Bench utils --------------------------------------------- */
+
+
+/* ------------------------------------------- Wake policy benchmark: ------------------------------------------- */
+
+typedef struct wake_consumer_args
+{
+    nm_blocking_bounded_queue* bbq_;
+    unsigned int id_;
+} wake_consumer_args;
+
+static void wake_consumer(void* args_)
+{
+    wake_consumer_args* args = (wake_consumer_args*)args_;
+    bench_item* item;
+
+    while(nm_blocking_bounded_queue_take(args->bbq_, (void**)&item) == NM_BBQ_SUCCESS)
+    {
+        item->latency_ns_ = nm_time_now_ns() - item->put_ns_;
+        item->consumer_id_ = args->id_;
+    }
+}
+
+/* Light load: a single producer trickles items to many blocked consumers, measures the wakeup latency and the CPU cost */
+static int bench_wake(int argc_, char** argv_)
+{
+    static const nm_bbq_wake_policy policies[] = {NM_BBQ_WAKE_DEFAULT, NM_BBQ_WAKE_FIFO, NM_BBQ_WAKE_LIFO};
+    static const char* policy_names[] = {"default", "fifo", "lifo"};
+    unsigned int consumers = (unsigned int)arg_or_default(argc_, argv_, 2, 8);
+    size_t items_count = (size_t)arg_or_default(argc_, argv_, 3, 2000);
+    unsigned long gap_us = arg_or_default(argc_, argv_, 4, 200);
+    nm_thread_t* threads;
+    wake_consumer_args* args;
+    bench_item* items;
+    nm_uint64_t* latencies;
+    unsigned int* served;
+    nm_uint64_t cpu_start, cpu_ns;
+    nm_blocking_bounded_queue* bbq;
+    nm_bbq_config config;
+    unsigned int p, i, active_consumers;
+    size_t j;
+
+    threads = (nm_thread_t*)calloc(consumers, sizeof(nm_thread_t));
+    args = (wake_consumer_args*)calloc(consumers, sizeof(wake_consumer_args));
+    served = (unsigned int*)calloc(consumers, sizeof(unsigned int));
+    items = (bench_item*)calloc(items_count, sizeof(bench_item));
+    latencies = (nm_uint64_t*)calloc(items_count, sizeof(nm_uint64_t));
+    if(!threads || !args || !served || !items || !latencies)
+    {
+        return -1;
+    }
+
+    printf("wake: %u consumers, %lu items, one item every %lu us\n", consumers, (unsigned long)items_count, gap_us);
+    printf("%-8s %12s %12s %12s %14s %10s\n", "policy", "p50 (us)", "p99 (us)", "max (us)", "cpu/item (us)", "threads");
+
+    for(p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p)
+    {
+        nm_bbq_config_init(&config, 1024);
+        config.wake_policy_ = policies[p];
+        bbq = nm_blocking_bounded_queue_create_ex(&config);
+        if(!bbq)
+        {
+            return -1;
+        }
+
+        for(i = 0; i < consumers; ++i)
+        {
+            args[i].bbq_ = bbq;
+            args[i].id_ = i;
+            served[i] = 0;
+            nm_thread_create(&threads[i], wake_consumer, &args[i]);
+        }
+        bench_sleep_us(100000); /* Lets all the consumers park */
+
+        cpu_start = bench_cpu_time_ns();
+        for(j = 0; j < items_count; ++j)
+        {
+            items[j].put_ns_ = nm_time_now_ns();
+            nm_blocking_bounded_queue_put(bbq, &items[j]);
+            bench_sleep_us(gap_us);
+        }
+
+        while(nm_blocking_bounded_queue_is_empty(bbq) != 1)
+        {
+            bench_sleep_us(1000);
+        }
+        cpu_ns = bench_cpu_time_ns() - cpu_start;
+
+        nm_blocking_bounded_queue_close(bbq);
+        for(i = 0; i < consumers; ++i)
+        {
+            nm_thread_join(&threads[i]);
+        }
+        nm_blocking_bounded_queue_destroy(&bbq, NULL, NULL);
+
+        for(j = 0; j < items_count; ++j)
+        {
+            latencies[j] = items[j].latency_ns_;
+            ++served[items[j].consumer_id_];
+        }
+
+        for(i = 0, active_consumers = 0; i < consumers; ++i)
+        {
+            active_consumers += served[i] * 100 >= items_count; /* Served at least 1% of the items */
+        }
+
+        printf("%-8s %12.1f %12.1f %12.1f %14.2f %7u/%u\n", policy_names[p],
+               percentile(latencies, items_count, 50) / 1000.0, percentile(latencies, items_count, 99) / 1000.0,
+               percentile(latencies, items_count, 100) / 1000.0, (double)cpu_ns / (double)items_count / 1000.0,
+               active_consumers, consumers);
+    }
+
+    free(latencies);
+    free(items);
+    free(served);
+    free(args);
+    free(threads);
+    return 0;
+}
+
+/* ----------------------------------------- End of Wake policy benchmark ---------------------------------------- */
+
+
+/* --------------------------------------- Priority inversion benchmark: ---------------------------------------- */
+
+#if defined(__linux__)
+#include <sched.h> /* sched_setaffinity, SCHED_FIFO */
+#include <pthread.h> /* pthread_setschedparam */
+
+#define PI_LOW_PRIORITY 10
+#define PI_MEDIUM_PRIORITY 50
+#define PI_HIGH_PRIORITY 80
+
+typedef struct pi_bench_context
+{
+    nm_blocking_bounded_queue* bbq_;
+    volatile int stop_;
+    volatile int priority_failed_;
+} pi_bench_context;
+
+/* Pins the calling thread to CPU 0 (so the priorities decide who runs), and makes it a SCHED_FIFO thread */
+static int pi_set_realtime(pi_bench_context* context_, int priority_)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    param.sched_priority = priority_;
+    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+    {
+        context_->priority_failed_ = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Low priority: a monitoring thread that polls the queue (holding its lock often) and consumes its items.
+   It polls in bursts of 1 ms with 1 ms sleeps: the realtime threads must leave the CPU idle for a while, or the kernel's
+   realtime throttling (sched_rt_runtime_us, 950 ms of every second by default) stalls all of them for 50 ms each second */
+static void pi_low_routine(void* context_)
+{
+    pi_bench_context* context = (pi_bench_context*)context_;
+    nm_uint64_t poll_until;
+    void* item;
+
+    if(pi_set_realtime(context, PI_LOW_PRIORITY) != 0)
+    {
+        return;
+    }
+
+    while(!context->stop_)
+    {
+        poll_until = nm_time_now_ns() + 1000000;
+        while(nm_time_now_ns() < poll_until && !context->stop_)
+        {
+            if(nm_blocking_bounded_queue_size(context->bbq_) > 0)
+            {
+                nm_blocking_bounded_queue_take(context->bbq_, &item);
+            }
+        }
+        bench_sleep_us(1000);
+    }
+}
+
+/* Medium priority: unrelated CPU bound work, that preempts the low priority thread whenever it runs */
+static void pi_medium_routine(void* context_)
+{
+    pi_bench_context* context = (pi_bench_context*)context_;
+    nm_uint64_t busy_until;
+
+    if(pi_set_realtime(context, PI_MEDIUM_PRIORITY) != 0)
+    {
+        return;
+    }
+
+    while(!context->stop_)
+    {
+        busy_until = nm_time_now_ns() + 2000000;
+        while(nm_time_now_ns() < busy_until && !context->stop_);
+        bench_sleep_us(3000);
+    }
+}
+
+/* Under SCHED_FIFO on a single CPU: measures the worst-case put latency of a high priority producer,
+   that shares the queue lock with a low priority thread, while a medium priority thread hogs the CPU (for 2 ms at a time).
+   Fails if the worst case with the priority-inheritance lock exceeds max_us: with inheritance, the producer waits only
+   for the low priority thread's critical section, never for the medium priority hog */
+static int bench_pi(int argc_, char** argv_)
+{
+    static const nm_bbq_lock_kind lock_kinds[] = {NM_BBQ_LOCK_MUTEX, NM_BBQ_LOCK_PRIORITY_INHERIT};
+    static const char* lock_names[] = {"mutex", "pi"};
+    size_t puts_count = (size_t)arg_or_default(argc_, argv_, 2, 5000);
+    unsigned long max_us = arg_or_default(argc_, argv_, 3, 1000);
+    pi_bench_context context;
+    nm_thread_t low, medium;
+    nm_bbq_config config;
+    nm_uint64_t* latencies;
+    nm_uint64_t start;
+    struct sched_param param;
+    unsigned int k;
+    size_t i;
+    int result = 0;
+
+    latencies = (nm_uint64_t*)calloc(puts_count > 0 ? puts_count : 1, sizeof(nm_uint64_t));
+    if(!latencies || puts_count == 0)
+    {
+        free(latencies);
+        return -1;
+    }
+
+    printf("pi: %lu puts of a SCHED_FIFO producer, against a low priority lock holder and a medium priority CPU hog"
+           " (pi bound: %lu us)\n", (unsigned long)puts_count, max_us);
+    printf("%-8s %12s %12s %12s\n", "lock", "p50 (us)", "p99.9 (us)", "max (us)");
+
+    for(k = 0; k < sizeof(lock_kinds) / sizeof(lock_kinds[0]); ++k)
+    {
+        nm_bbq_config_init(&config, puts_count);
+        config.lock_kind_ = lock_kinds[k];
+        context.bbq_ = nm_blocking_bounded_queue_create_ex(&config);
+        context.stop_ = 0;
+        context.priority_failed_ = 0;
+        if(!context.bbq_)
+        {
+            printf("%-8s %12s\n", lock_names[k], "unsupported");
+            continue;
+        }
+
+        nm_thread_create(&low, pi_low_routine, &context);
+        nm_thread_create(&medium, pi_medium_routine, &context);
+
+        if(pi_set_realtime(&context, PI_HIGH_PRIORITY) == 0)
+        {
+            bench_sleep_us(10000);
+            for(i = 0; i < puts_count && !context.priority_failed_; ++i)
+            {
+                start = nm_time_now_ns();
+                nm_blocking_bounded_queue_put(context.bbq_, &context);
+                latencies[i] = nm_time_now_ns() - start;
+                bench_sleep_us(500);
+            }
+        }
+
+        context.stop_ = 1;
+        nm_thread_join(&low);
+        nm_thread_join(&medium);
+        nm_blocking_bounded_queue_destroy(&context.bbq_, NULL, NULL);
+
+        if(context.priority_failed_)
+        {
+            printf("skipped: setting SCHED_FIFO priorities requires CAP_SYS_NICE (or root)\n");
+            break;
+        }
+
+        printf("%-8s %12.1f", lock_names[k], percentile(latencies, puts_count, 50) / 1000.0); /* Sorts the latencies */
+        printf(" %12.1f %12.1f", latencies[puts_count * 999 / 1000] / 1000.0, latencies[puts_count - 1] / 1000.0);
+        if(lock_kinds[k] == NM_BBQ_LOCK_PRIORITY_INHERIT && latencies[puts_count - 1] > (nm_uint64_t)max_us * 1000)
+        {
+            printf("  FAILED: the worst case exceeds %lu us", max_us);
+            result = -1;
+        }
+        printf("\n");
+    }
+
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    free(latencies);
+    return result;
+}
+#endif /* __linux__ */
+
+/* ------------------------------------- End of Priority inversion benchmark ------------------------------------- */
+
+
+/* ------------------------------------------ Lock and mode benchmark: ------------------------------------------ */
+
+typedef struct locks_worker_args
+{
+    nm_blocking_bounded_queue* bbq_;
+    nm_uint64_t* latencies_; /* 2 samples per round: the put, and the take */
+    size_t rounds_;
+} locks_worker_args;
+
+static void locks_worker(void* args_)
+{
+    locks_worker_args* args = (locks_worker_args*)args_;
+    void* item;
+    nm_uint64_t start, end;
+    size_t r;
+
+    for(r = 0; r < args->rounds_; ++r)
+    {
+        start = nm_time_now_ns();
+        nm_blocking_bounded_queue_put(args->bbq_, args_);
+        end = nm_time_now_ns();
+        nm_blocking_bounded_queue_take(args->bbq_, &item);
+        args->latencies_[2 * r] = end - start;
+        args->latencies_[2 * r + 1] = nm_time_now_ns() - end;
+    }
+}
+
+/* Heavy contention: every thread puts and takes in a loop on a shared queue, so the queue lock is the bottleneck.
+   Compares the lock kinds, the flat combining mode (on the default mutex), and the lock-free unbounded mode */
+static int bench_locks(int argc_, char** argv_)
+{
+    static const nm_bbq_lock_kind lock_kinds[] = {NM_BBQ_LOCK_MUTEX, NM_BBQ_LOCK_PRIORITY_INHERIT, NM_BBQ_LOCK_TICKET,
+                                                  NM_BBQ_LOCK_MCS, NM_BBQ_LOCK_COHORT, NM_BBQ_LOCK_MUTEX, NM_BBQ_LOCK_MUTEX};
+    static const nm_bbq_mode modes[] = {NM_BBQ_MODE_LOCKED, NM_BBQ_MODE_LOCKED, NM_BBQ_MODE_LOCKED, NM_BBQ_MODE_LOCKED,
+                                        NM_BBQ_MODE_LOCKED, NM_BBQ_MODE_COMBINING, NM_BBQ_MODE_UNBOUNDED};
+    static const char* names[] = {"mutex", "pi", "ticket", "mcs", "cohort", "combining", "unbounded"};
+    unsigned int threads_count = (unsigned int)arg_or_default(argc_, argv_, 2, 8);
+    size_t rounds = (size_t)arg_or_default(argc_, argv_, 3, 20000);
+    size_t samples_count = 2 * rounds * threads_count;
+    nm_thread_t* threads;
+    locks_worker_args* args;
+    nm_uint64_t* latencies;
+    nm_uint64_t start_ns, elapsed_ns;
+    nm_blocking_bounded_queue* bbq;
+    nm_bbq_config config;
+    unsigned int k, i;
+
+    threads = (nm_thread_t*)calloc(threads_count, sizeof(nm_thread_t));
+    args = (locks_worker_args*)calloc(threads_count, sizeof(locks_worker_args));
+    latencies = (nm_uint64_t*)calloc(samples_count, sizeof(nm_uint64_t));
+    if(!threads || !args || !latencies)
+    {
+        return -1;
+    }
+
+    printf("locks: %u threads, %lu put+take rounds per thread\n", threads_count, (unsigned long)rounds);
+    printf("%-10s %12s %12s %12s %14s\n", "queue", "p50 (us)", "p99 (us)", "p99.9 (us)", "ops/s");
+
+    for(k = 0; k < sizeof(lock_kinds) / sizeof(lock_kinds[0]); ++k)
+    {
+        /* Never full, and a taker always finds its own item at least (the unbounded queue gets a typical segment size) */
+        nm_bbq_config_init(&config, modes[k] == NM_BBQ_MODE_UNBOUNDED ? 1024 : threads_count);
+        config.lock_kind_ = lock_kinds[k];
+        config.mode_ = modes[k];
+        bbq = nm_blocking_bounded_queue_create_ex(&config);
+        if(!bbq)
+        {
+            return -1;
+        }
+
+        start_ns = nm_time_now_ns(); /* Thread startup is negligible next to the rounds */
+        for(i = 0; i < threads_count; ++i)
+        {
+            args[i].bbq_ = bbq;
+            args[i].latencies_ = latencies + 2 * rounds * i;
+            args[i].rounds_ = rounds;
+            nm_thread_create(&threads[i], locks_worker, &args[i]);
+        }
+
+        for(i = 0; i < threads_count; ++i)
+        {
+            nm_thread_join(&threads[i]);
+        }
+        elapsed_ns = nm_time_now_ns() - start_ns;
+
+        nm_blocking_bounded_queue_destroy(&bbq, NULL, NULL);
+
+        printf("%-10s %12.2f", names[k], percentile(latencies, samples_count, 50) / 1000.0); /* Sorts the latencies */
+        printf(" %12.2f %12.2f %14.0f\n", latencies[samples_count * 99 / 100] / 1000.0,
+               latencies[samples_count * 999 / 1000] / 1000.0, (double)samples_count * 1e9 / (double)elapsed_ns);
+    }
+
+    free(latencies);
+    free(args);
+    free(threads);
+    return 0;
+}
+
+/* --------------------------------------- End of Lock and mode benchmark ---------------------------------------- */
+
+
+/* --------------------------------------------- Ring scan benchmark: ------------------------------------------- */
+
+static int scan_is_item(const void* element_, void* context_)
+{
+    return element_ != context_; /* Continues until the item is found */
+}
+
+/* A cancellation check on a big queue: searches for an item that is not queued (a full scan of the ring, split in 2 spans),
+   with the per element callback of nm_queue_for_each and with the vectorized nm_queue_find / nm_queue_count_eq */
+static int bench_scan(int argc_, char** argv_)
+{
+    static const char* names[] = {"for_each", "find", "count_eq"};
+    size_t items_count = (size_t)arg_or_default(argc_, argv_, 2, 1000000);
+    size_t rounds = (size_t)arg_or_default(argc_, argv_, 3, 50);
+    char* items;
+    nm_queue* queue;
+    nm_uint64_t start_ns, elapsed_ns;
+    size_t found = 0;
+    size_t r, i;
+    unsigned int k;
+    void* item;
+
+    items = (char*)malloc(items_count + 1);
+    queue = nm_queue_create(items_count);
+    if(!items || !queue || items_count < 2)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < items_count / 2; ++i) /* Moves the head to the middle, so the items wrap around */
+    {
+        nm_queue_enqueue(queue, items);
+        nm_queue_dequeue(queue, &item);
+    }
+
+    for(i = 0; i < items_count; ++i)
+    {
+        nm_queue_enqueue(queue, items + i);
+    }
+
+    printf("scan: %lu items (wrapped), %lu rounds, searching for a missing item\n", (unsigned long)items_count, (unsigned long)rounds);
+    printf("%-10s %12s %12s\n", "scan", "ms/scan", "GB/s");
+
+    for(k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        start_ns = nm_time_now_ns();
+        for(r = 0; r < rounds; ++r)
+        {
+            switch(k)
+            {
+            case 0:
+                found += nm_queue_for_each(queue, scan_is_item, items + items_count) != items_count; /* Stops early on a match */
+                break;
+
+            case 1:
+                found += nm_queue_find(queue, items + items_count) != (size_t)-1;
+                break;
+
+            default:
+                found += nm_queue_count_eq(queue, items + items_count);
+                break;
+            }
+        }
+        elapsed_ns = nm_time_now_ns() - start_ns;
+
+        printf("%-10s %12.3f %12.2f\n", names[k], elapsed_ns / 1e6 / (double)rounds,
+               (double)(items_count * sizeof(void*)) * (double)rounds / (double)elapsed_ns);
+    }
+
+    nm_queue_destroy(&queue, NULL);
+    free(items);
+    return found == 0 ? 0 : -1; /* The item is never queued */
+}
+
+/* ------------------------------------------ End of Ring scan benchmark ------------------------------------------ */
+
+
+/* ------------------------------------------ Payload prefetch benchmark: ------------------------------------------ */
+
+#define PREFETCH_PAYLOAD_WORDS 32 /* A 256 bytes payload - 4 cache lines */
+
+typedef struct prefetch_payload
+{
+    nm_uint64_t words_[PREFETCH_PAYLOAD_WORDS];
+} prefetch_payload;
+
+/* Hashes the payload into the running hash - a dependency chain, like real processing, that keeps the CPU from running
+   ahead to the loads of the next payloads by itself */
+static nm_uint64_t prefetch_consume(nm_uint64_t hash_, const prefetch_payload* payload_)
+{
+    size_t i;
+
+    for(i = 0; i < PREFETCH_PAYLOAD_WORDS; ++i)
+    {
+        hash_ = (hash_ ^ payload_->words_[i]) * 1099511628211ULL; /* FNV-1a step */
+    }
+    return hash_;
+}
+
+/* A consumer that reads every payload it takes: the payloads are spread over a pool larger than the caches,
+   and queued in a random order, so every payload is a cache miss that the hardware prefetchers cannot predict.
+   Compares a take per item, take_n without prefetching, and take_n with the payload prefetching
+   (the consumer keeps the prefetches distance items ahead of its processing) */
+static int bench_prefetch(int argc_, char** argv_)
+{
+    static const char* names[] = {"take", "take_n", "take_n+pf"};
+    size_t items_count = (size_t)arg_or_default(argc_, argv_, 2, 1048576);
+    size_t batch_size = (size_t)arg_or_default(argc_, argv_, 3, 32);
+    size_t distance = (size_t)arg_or_default(argc_, argv_, 4, 8);
+    prefetch_payload* pool;
+    void** order;
+    void** batch;
+    nm_blocking_bounded_queue* bbq;
+    nm_bbq_config config;
+    nm_uint64_t start_ns, elapsed_ns;
+    nm_uint64_t hash, expected_hash = 0;
+    nm_uint64_t seed = 88172645463325252ULL;
+    size_t taken_count, left, i, j;
+    unsigned int k;
+    void* item;
+    int result = 0;
+
+    pool = (prefetch_payload*)malloc(items_count * sizeof(prefetch_payload));
+    order = (void**)malloc(items_count * sizeof(void*));
+    batch = (void**)malloc((batch_size > 0 ? batch_size : 1) * sizeof(void*));
+    if(!pool || !order || !batch || items_count == 0 || items_count > (size_t)INT_MAX || batch_size == 0)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < items_count; ++i)
+    {
+        for(j = 0; j < PREFETCH_PAYLOAD_WORDS; ++j)
+        {
+            pool[i].words_[j] = i + j;
+        }
+        order[i] = &pool[i];
+    }
+
+    for(i = items_count - 1; i > 0; --i) /* Fisher-Yates with a xorshift generator */
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        j = (size_t)(seed % (i + 1));
+        item = order[i];
+        order[i] = order[j];
+        order[j] = item;
+    }
+
+    for(i = 0; i < items_count; ++i) /* The consumers must end with the same hash */
+    {
+        expected_hash = prefetch_consume(expected_hash, (const prefetch_payload*)order[i]);
+    }
+
+    printf("prefetch: %lu payloads of %lu bytes (random order), batch %lu, distance %lu\n", (unsigned long)items_count,
+           (unsigned long)sizeof(prefetch_payload), (unsigned long)batch_size, (unsigned long)distance);
+    printf("%-10s %12s %12s\n", "consumer", "ns/item", "GB/s");
+
+    for(k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        nm_bbq_config_init(&config, items_count);
+        config.prefetch_distance_ = k == 2 ? distance : 0;
+        config.prefetch_bytes_ = sizeof(prefetch_payload);
+        bbq = nm_blocking_bounded_queue_create_ex(&config);
+        if(!bbq || nm_blocking_bounded_queue_put_n(bbq, order, items_count, NULL) != NM_BBQ_SUCCESS)
+        {
+            return -1;
+        }
+
+        hash = 0;
+        start_ns = nm_time_now_ns();
+        for(left = items_count; left > 0; left -= taken_count)
+        {
+            if(k == 0)
+            {
+                nm_blocking_bounded_queue_take(bbq, &item);
+                hash = prefetch_consume(hash, (const prefetch_payload*)item);
+                taken_count = 1;
+                continue;
+            }
+
+            nm_blocking_bounded_queue_take_n(bbq, batch, batch_size < left ? batch_size : left, &taken_count);
+            for(i = 0; i < taken_count; ++i)
+            {
+                if(k == 2 && i + distance < taken_count)
+                {
+                    nm_blocking_bounded_queue_prefetch(bbq, &batch[i + distance], 1);
+                }
+                hash = prefetch_consume(hash, (const prefetch_payload*)batch[i]);
+            }
+        }
+        elapsed_ns = nm_time_now_ns() - start_ns;
+
+        nm_blocking_bounded_queue_destroy(&bbq, NULL, NULL);
+        result |= hash == expected_hash ? 0 : -1;
+
+        printf("%-10s %12.2f %12.2f\n", names[k], (double)elapsed_ns / (double)items_count,
+               (double)(items_count * sizeof(prefetch_payload)) / (double)elapsed_ns);
+    }
+
+    free(batch);
+    free(order);
+    free(pool);
+    return result;
+}
+
+/* ------------------------------------- End of Payload prefetch benchmark --------------------------------------- */
+
+
+/* ------------------------------------------ Inline build mode benchmark: ---------------------------------------- */
+
+size_t bench_inline_queue_ops(nm_queue* queue_, char* items_, size_t batch_size_, size_t rounds_); /* nm_blocking_bounded_queue_bench_inline.c */
+
+NM_BBQ_DEFINE(bench_typed_queue, char*, 1024, NM_BBQ_TYPED_SPSC)
+
+/* Must stay the same loop as bench_inline_queue_ops */
+static size_t bench_call_queue_ops(nm_queue* queue_, char* items_, size_t batch_size_, size_t rounds_)
+{
+    size_t checksum = 0;
+    size_t r, i;
+    void* item;
+
+    for(r = 0; r < rounds_; ++r)
+    {
+        for(i = 0; i < batch_size_; ++i)
+        {
+            nm_queue_enqueue(queue_, items_ + i);
+        }
+        while(nm_queue_dequeue(queue_, &item) == NM_QUEUE_SUCCESS)
+        {
+            checksum += (size_t)((char*)item - items_);
+        }
+    }
+    return checksum;
+}
+
+static size_t bench_typed_queue_ops(bench_typed_queue* queue_, char* items_, size_t batch_size_, size_t rounds_)
+{
+    size_t checksum = 0;
+    size_t r, i;
+    char* item;
+
+    for(r = 0; r < rounds_; ++r)
+    {
+        for(i = 0; i < batch_size_; ++i)
+        {
+            bench_typed_queue_try_put(queue_, items_ + i);
+        }
+        while(bench_typed_queue_try_take(queue_, &item) == NM_BBQ_SUCCESS)
+        {
+            checksum += (size_t)(item - items_);
+        }
+    }
+    return checksum;
+}
+
+/* The per operation cost of a call into the library: the same enqueue / dequeue loop on an nm_queue, with the out-of-line
+   (validating) functions and with the NM_BBQ_INLINE ones, and on an NM_BBQ_DEFINE typed queue (that is also thread safe,
+   so it pays a fence per operation, as an uncontended reference). Single threaded - only the call overhead is measured */
+static int bench_inline(int argc_, char** argv_)
+{
+    static const char* names[] = {"call", "inline", "typed"};
+    size_t batch_size = (size_t)arg_or_default(argc_, argv_, 2, 64);
+    size_t rounds = (size_t)arg_or_default(argc_, argv_, 3, 200000);
+    size_t expected_checksum = batch_size * (batch_size - 1) / 2 * rounds;
+    char* items;
+    nm_queue* queue;
+    bench_typed_queue* typed_queue;
+    nm_uint64_t start_ns, elapsed_ns;
+    nm_uint64_t call_ns = 0;
+    size_t checksum;
+    unsigned int k;
+    int result = 0;
+
+    items = (char*)malloc(batch_size > 0 ? batch_size : 1);
+    queue = nm_queue_create(batch_size);
+    typed_queue = (bench_typed_queue*)malloc(sizeof(bench_typed_queue));
+    if(!items || !queue || !typed_queue || batch_size > 1024 || bench_typed_queue_init(typed_queue) != 0)
+    {
+        return -1;
+    }
+
+    printf("inline: batches of %lu items, %lu rounds\n", (unsigned long)batch_size, (unsigned long)rounds);
+    printf("%-10s %12s %12s\n", "functions", "ns/op", "speedup");
+
+    for(k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        start_ns = nm_time_now_ns();
+        switch(k)
+        {
+        case 0:
+            checksum = bench_call_queue_ops(queue, items, batch_size, rounds);
+            break;
+
+        case 1:
+            checksum = bench_inline_queue_ops(queue, items, batch_size, rounds);
+            break;
+
+        default:
+            checksum = bench_typed_queue_ops(typed_queue, items, batch_size, rounds);
+            break;
+        }
+        elapsed_ns = nm_time_now_ns() - start_ns;
+        call_ns = k == 0 ? elapsed_ns : call_ns;
+        result |= checksum == expected_checksum ? 0 : -1;
+
+        printf("%-10s %12.2f %11.2fx\n", names[k], (double)elapsed_ns / (double)(2 * batch_size * rounds),
+               (double)call_ns / (double)(elapsed_ns > 0 ? elapsed_ns : 1));
+    }
+
+    bench_typed_queue_destroy(typed_queue);
+    free(typed_queue);
+    nm_queue_destroy(&queue, NULL);
+    free(items);
+    return result;
+}
+
+/* --------------------------------------- End of Inline build mode benchmark ------------------------------------- */
+
+
+/* ---------------------------------------- Persistent queue benchmark: ------------------------------------------ */
+
+#define PERSIST_BENCH_PATH "nm_bbq_bench.pq" /* In the working directory - on the disk to measure */
+
+/* A producer that persists records: with group commits (every interval_ms), and with a commit after every put
+   (on a hundredth of the records), that is what a journal write per item costs. A consumer keeps the queue from filling up */
+static int bench_persist(int argc_, char** argv_)
+{
+    static const char* names[] = {"group", "per_put"};
+    size_t items_count = (size_t)arg_or_default(argc_, argv_, 2, 200000);
+    size_t record_size = (size_t)arg_or_default(argc_, argv_, 3, 128);
+    unsigned long interval_ms = arg_or_default(argc_, argv_, 4, 10);
+    nm_persistent_queue_config config;
+    nm_persistent_queue* pq;
+    nm_uint64_t start_ns, elapsed_ns;
+    char* record;
+    size_t count, record_length, i;
+    unsigned int k;
+    int result = 0;
+
+    record = (char*)calloc(record_size > 0 ? record_size : 1, 1);
+    if(!record || record_size == 0)
+    {
+        return -1;
+    }
+
+    printf("persist: %lu records of %lu bytes, group commit every %lu ms (%s)\n", (unsigned long)items_count,
+           (unsigned long)record_size, interval_ms, PERSIST_BENCH_PATH);
+    printf("%-10s %12s %12s\n", "commit", "records", "records/s");
+
+    for(k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        (void)remove(PERSIST_BENCH_PATH);
+        nm_persistent_queue_config_init(&config, PERSIST_BENCH_PATH, 4096, record_size);
+        config.commit_interval_ms_ = k == 0 ? interval_ms : 0;
+        pq = nm_persistent_queue_open(&config);
+        if(!pq)
+        {
+            result = -1;
+            break;
+        }
+
+        count = k == 0 ? items_count : items_count / 100 + 1;
+        start_ns = nm_time_now_ns();
+        for(i = 0; i < count; ++i)
+        {
+            result |= nm_persistent_queue_put(pq, record, record_size) == NM_BBQ_SUCCESS ? 0 : -1;
+            if(k == 1)
+            {
+                result |= nm_persistent_queue_commit(pq) == NM_BBQ_SUCCESS ? 0 : -1;
+            }
+            if(i >= 1024) /* Keeps a backlog of 1024 records */
+            {
+                result |= nm_persistent_queue_take(pq, record, record_size, &record_length) == NM_BBQ_SUCCESS ? 0 : -1;
+            }
+        }
+        result |= nm_persistent_queue_commit(pq) == NM_BBQ_SUCCESS ? 0 : -1; /* The last group is durable too */
+        elapsed_ns = nm_time_now_ns() - start_ns;
+
+        nm_persistent_queue_destroy(&pq);
+        printf("%-10s %12lu %12.0f\n", names[k], (unsigned long)count, (double)count * 1e9 / (double)(elapsed_ns > 0 ? elapsed_ns : 1));
+    }
+
+    (void)remove(PERSIST_BENCH_PATH);
+    free(record);
+    return result;
+}
+
+/* -------------------------------------- End of Persistent queue benchmark -------------------------------------- */
+
+
+/* ------------------------------------------- Spill tier benchmark: -------------------------------------------- */
+
+#define SPILL_BENCH_PATH "nm_bbq_bench.spill" /* In the working directory - on the disk to measure */
+
+typedef struct spill_bench_context
+{
+    nm_blocking_bounded_queue* bbq_;
+    size_t* items_; /* items_[i] == i, the queue carries pointers to them */
+    size_t items_count_;
+    size_t record_size_;
+    unsigned long work_ns_;
+    nm_uint64_t drained_ns_;
+    int is_ordered_;
+} spill_bench_context;
+
+/* The record is the item's index, padded to record_size_ bytes */
+static size_t spill_bench_encode(const void* item_, void* buffer_, size_t buffer_size_, void* callback_context_)
+{
+    spill_bench_context* context = (spill_bench_context*)callback_context_;
+
+    if(buffer_size_ >= context->record_size_)
+    {
+        memcpy(buffer_, item_, sizeof(size_t));
+    }
+    return context->record_size_;
+}
+
+static void* spill_bench_decode(const void* record_, size_t record_size_, void* callback_context_)
+{
+    spill_bench_context* context = (spill_bench_context*)callback_context_;
+    size_t index;
+
+    (void)record_size_;
+    memcpy(&index, record_, sizeof(size_t));
+    return index < context->items_count_ ? &context->items_[index] : NULL;
+}
+
+static void spill_bench_consumer(void* context_)
+{
+    spill_bench_context* context = (spill_bench_context*)context_;
+    size_t* item;
+    size_t expected;
+    nm_uint64_t busy_until;
+
+    for(expected = 0; expected < context->items_count_; ++expected)
+    {
+        if(nm_blocking_bounded_queue_take(context->bbq_, (void**)&item) != NM_BBQ_SUCCESS)
+        {
+            break;
+        }
+
+        context->is_ordered_ &= *item == expected;
+        busy_until = nm_time_now_ns() + context->work_ns_; /* Processes the item */
+        while(nm_time_now_ns() < busy_until);
+    }
+    context->drained_ns_ = nm_time_now_ns();
+}
+
+/* A burst of items_count puts to a queue of capacity items, that a consumer drains at work_ns per item: the producer
+   blocks for the consumer without a spill tier, and hands the overflow to the spill file and moves on with one */
+static int bench_spill(int argc_, char** argv_)
+{
+    static const char* names[] = {"blocking", "spill"};
+    size_t items_count = (size_t)arg_or_default(argc_, argv_, 2, 200000);
+    size_t capacity = (size_t)arg_or_default(argc_, argv_, 3, 1024);
+    size_t record_size = (size_t)arg_or_default(argc_, argv_, 4, 64);
+    unsigned long work_ns = arg_or_default(argc_, argv_, 5, 1000);
+    spill_bench_context context;
+    nm_bbq_config config;
+    nm_thread_t consumer;
+    nm_uint64_t start_ns, put_ns, max_put_ns, producer_ns;
+    size_t i;
+    unsigned int k;
+    int result = 0;
+
+    if(capacity == 0 || record_size < sizeof(size_t))
+    {
+        return -1;
+    }
+
+    context.items_ = (size_t*)malloc((items_count > 0 ? items_count : 1) * sizeof(size_t));
+    if(!context.items_)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < items_count; ++i)
+    {
+        context.items_[i] = i;
+    }
+
+    printf("spill: a burst of %lu items, capacity %lu, records of %lu bytes, %lu ns of work per item (%s)\n",
+           (unsigned long)items_count, (unsigned long)capacity, (unsigned long)record_size, work_ns, SPILL_BENCH_PATH);
+    printf("%-10s %12s %12s %12s\n", "tier", "producer_ms", "drained_ms", "max_put_us");
+
+    for(k = 0; k < sizeof(names) / sizeof(names[0]); ++k)
+    {
+        context.items_count_ = items_count;
+        context.record_size_ = record_size;
+        context.work_ns_ = work_ns;
+        context.is_ordered_ = 1;
+
+        nm_bbq_config_init(&config, capacity);
+        if(k == 1)
+        {
+            config.spill_path_ = SPILL_BENCH_PATH;
+            config.spill_encode_ = spill_bench_encode;
+            config.spill_decode_ = spill_bench_decode;
+            config.spill_context_ = &context;
+        }
+
+        context.bbq_ = nm_blocking_bounded_queue_create_ex(&config);
+        if(!context.bbq_)
+        {
+            result = -1;
+            break;
+        }
+
+        nm_thread_create(&consumer, spill_bench_consumer, &context);
+
+        max_put_ns = 0;
+        start_ns = nm_time_now_ns();
+        for(i = 0; i < items_count; ++i)
+        {
+            put_ns = nm_time_now_ns();
+            result |= nm_blocking_bounded_queue_put(context.bbq_, &context.items_[i]) == NM_BBQ_SUCCESS ? 0 : -1;
+            put_ns = nm_time_now_ns() - put_ns;
+            max_put_ns = put_ns > max_put_ns ? put_ns : max_put_ns;
+        }
+        producer_ns = nm_time_now_ns() - start_ns;
+
+        nm_thread_join(&consumer);
+        result |= context.is_ordered_ ? 0 : -1;
+        nm_blocking_bounded_queue_destroy(&context.bbq_, NULL, NULL);
+
+        printf("%-10s %12.2f %12.2f %12.2f\n", names[k], (double)producer_ns / 1e6, (double)(context.drained_ns_ - start_ns) / 1e6,
+               (double)max_put_ns / 1e3);
+    }
+
+    free(context.items_);
+    return result;
+}
+
+/* ------------------------------------------ End of Spill tier benchmark ---------------------------------------- */
+
+
+typedef struct bench_entry
+{
+    const char* name_;
+    int (*run_)(int argc_, char** argv_);
+    const char* usage_;
+} bench_entry;
+
+static const bench_entry benchmarks[] =
+{
+    {"wake", bench_wake, "wake [consumers=8] [items=2000] [gap_us=200]"}
+#if defined(__linux__)
+    ,{"pi", bench_pi, "pi [puts=5000] [max_us=1000] (SCHED_FIFO, requires CAP_SYS_NICE)"}
+#endif
+    ,{"locks", bench_locks, "locks [threads=8] [rounds=20000]"}
+    ,{"scan", bench_scan, "scan [items=1000000] [rounds=50]"}
+    ,{"prefetch", bench_prefetch, "prefetch [items=1048576] [batch=32] [distance=8]"}
+    ,{"inline", bench_inline, "inline [batch=64] [rounds=200000]"}
+    ,{"persist", bench_persist, "persist [items=200000] [record=128] [interval_ms=10]"}
+    ,{"spill", bench_spill, "spill [items=200000] [capacity=1024] [record=64] [work_ns=1000]"}
+};
+
+int main(int argc, char** argv)
+{
+    size_t i;
+    int result = 0;
+
+    for(i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+    {
+        if(argc < 2 || strcmp(argv[1], benchmarks[i].name_) == 0)
+        {
+            result |= benchmarks[i].run_(argc, argv);
+            if(argc >= 2)
+            {
+                return result;
+            }
+        }
+    }
+
+    if(argc >= 2)
+    {
+        fprintf(stderr, "Unknown benchmark: %s\nAvailable benchmarks:\n", argv[1]);
+        for(i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+        {
+            fprintf(stderr, "    %s\n", benchmarks[i].usage_);
+        }
+        return 1;
+    }
+
+    return result;
+}
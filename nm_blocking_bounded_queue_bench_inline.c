@@ -0,0 +1,38 @@
+/**
+ * @file nm_blocking_bounded_queue_bench_inline.c
+ * @author Natan Meirov (NatanMeirov@gmail.com)
+ * @brief The NM_BBQ_INLINE half of the inline benchmark (see bench_inline in nm_blocking_bounded_queue_bench.c)
+ * @version 1.0
+ * @date 2021-12-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * A separate translation unit, because a translation unit sees either the out-of-line or the inline nm_queue functions
+ */
+
+#define NM_BBQ_INLINE
+#include "nm_blocking_bounded_queue.h"
+
+
+size_t bench_inline_queue_ops(nm_queue* queue_, char* items_, size_t batch_size_, size_t rounds_);
+
+/* Must stay the same loop as bench_call_queue_ops */
+size_t bench_inline_queue_ops(nm_queue* queue_, char* items_, size_t batch_size_, size_t rounds_)
+{
+    size_t checksum = 0;
+    size_t r, i;
+    void* item;
+
+    for(r = 0; r < rounds_; ++r)
+    {
+        for(i = 0; i < batch_size_; ++i)
+        {
+            nm_queue_enqueue(queue_, items_ + i);
+        }
+        while(nm_queue_dequeue(queue_, &item) == NM_QUEUE_SUCCESS)
+        {
+            checksum += (size_t)((char*)item - items_);
+        }
+    }
+    return checksum;
+}
@@ -0,0 +1,825 @@
+/**
+ * @file nm_blocking_bounded_queue_stress.c
+ * @author Natan Meirov (NatanMeirov@gmail.com)
+ * @brief Stress tests of the Blocking Bounded Queue
+ * @version 1.0
+ * @date 2021-12-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Build: together with nm_blocking_bounded_queue.c
+ * Usage: nm_bbq_stress [test_name [test args...]]
+ *        Runs all the tests (with their default args) if no test name is given, returns 0 only if all of them passed.
+ *        Every configuration of the queue (mode, lock kind, wake policy, slots and spill tier) that the current OS
+ *        supports is tested - the unsupported ones are skipped
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* nanosleep */
+#endif
+
+#include <stdio.h> /* printf, fprintf */
+#include <stdlib.h> /* malloc, free, strtoul */
+#include <string.h> /* strcmp, memcpy, memset */
+
+#include "nm_blocking_bounded_queue.h"
+
+#if defined(_WIN32) || defined(_WIN64) || (defined(__CYGWIN__) && !defined(_WIN32))
+	static void stress_sleep_us(unsigned long us_)
+	{
+		Sleep((DWORD)((us_ + 999) / 1000));
+	}
+#else
+	#include <time.h> /* nanosleep */
+
+	static void stress_sleep_us(unsigned long us_)
+	{
+		struct timespec duration;
+
+		duration.tv_sec = (time_t)(us_ / 1000000);
+		duration.tv_nsec = (long)(us_ % 1000000) * 1000L;
+		nanosleep(&duration, NULL);
+	}
+#endif
+
+
+/* ---------------------------------------------- Stress utils: ------------------------------------------------ */
+
+#define STRESS_MAX_THREADS 16
+#define STRESS_BATCH 5
+#define STRESS_SEQ_BITS 24 /* An item is (producer id + 1) << STRESS_SEQ_BITS | sequence number - never NULL, and fits a compact handle */
+#define STRESS_SEQ_MASK ((1UL << STRESS_SEQ_BITS) - 1)
+#define STRESS_SPILL_PATH "nm_bbq_stress.spill"
+#define STRESS_SPILL_BUFFER_BYTES 256 /* Small spill buffers, so the spill tier goes through its file */
+
+static const char* const stress_mode_names[] = {"locked", "combining", "unbounded"};
+static const char* const stress_lock_names[] = {"mutex", "priority_inherit", "ticket", "mcs", "cohort"};
+static const char* const stress_wake_names[] = {"default", "lifo", "fifo"};
+static const char* const stress_slots_names[] = {"pointer", "compact"};
+
+typedef struct stress_config
+{
+    nm_bbq_mode mode_;
+    nm_bbq_lock_kind lock_kind_;
+    nm_bbq_wake_policy wake_policy_;
+    nm_bbq_slots slots_;
+    int has_spill_;
+} stress_config;
+
+typedef int (*stress_config_run)(const stress_config* config_, size_t items_, unsigned int threads_);
+
+static unsigned long arg_or_default(int argc_, char** argv_, int index_, unsigned long default_)
+{
+    return argc_ > index_ ? strtoul(argv_[index_], NULL, 10) : default_;
+}
+
+static void* stress_item(unsigned int producer_, size_t seq_)
+{
+    return (void*)(size_t)(((size_t)(producer_ + 1) << STRESS_SEQ_BITS) | seq_);
+}
+
+static size_t stress_spill_encode(const void* item_, void* buffer_, size_t buffer_size_, void* callback_context_)
+{
+    unsigned int value = (unsigned int)(size_t)item_;
+
+    (void)callback_context_;
+    if(buffer_size_ >= sizeof(value))
+    {
+        memcpy(buffer_, &value, sizeof(value));
+    }
+    return sizeof(value);
+}
+
+static void* stress_spill_decode(const void* record_, size_t record_size_, void* callback_context_)
+{
+    unsigned int value;
+
+    (void)callback_context_;
+    if(record_size_ != sizeof(value))
+    {
+        return NULL;
+    }
+    memcpy(&value, record_, sizeof(value));
+    return (void*)(size_t)value;
+}
+
+static void stress_print_config(const char* test_, const stress_config* config_, const char* failure_)
+{
+    fprintf(stderr, "%s: FAILED mode=%s lock=%s wake=%s slots=%s spill=%s: %s\n", test_, stress_mode_names[config_->mode_],
+            stress_lock_names[config_->lock_kind_], stress_wake_names[config_->wake_policy_], stress_slots_names[config_->slots_],
+            config_->has_spill_ ? "yes" : "no", failure_);
+}
+
+static nm_blocking_bounded_queue* stress_create(const stress_config* config_, size_t capacity_)
+{
+    nm_bbq_config config;
+
+    nm_bbq_config_init(&config, capacity_);
+    config.mode_ = config_->mode_;
+    config.lock_kind_ = config_->lock_kind_;
+    config.wake_policy_ = config_->wake_policy_;
+    config.slots_ = config_->slots_; /* Compact slots with a NULL base - the items are 32-bit handles */
+    if(config_->has_spill_)
+    {
+        config.spill_path_ = STRESS_SPILL_PATH;
+        config.spill_buffer_bytes_ = STRESS_SPILL_BUFFER_BYTES;
+        config.spill_encode_ = stress_spill_encode;
+        config.spill_decode_ = stress_spill_decode;
+    }
+    return nm_blocking_bounded_queue_create_ex(&config);
+}
+
+/* Runs run_ on every supported configuration, returns 0 if all of them passed */
+static int stress_for_each_config(const char* test_, stress_config_run run_, size_t items_, unsigned int threads_)
+{
+    stress_config config;
+    nm_blocking_bounded_queue* bbq = NULL;
+    unsigned int passed = 0, failed = 0, skipped = 0;
+    int mode, lock_kind, wake_policy, slots, has_spill;
+
+    for(has_spill = 0; has_spill <= 1; ++has_spill)
+    {
+        for(mode = NM_BBQ_MODE_LOCKED; mode <= NM_BBQ_MODE_UNBOUNDED; ++mode)
+        {
+            for(slots = NM_BBQ_SLOTS_POINTER; slots <= NM_BBQ_SLOTS_COMPACT; ++slots)
+            {
+                for(lock_kind = NM_BBQ_LOCK_MUTEX; lock_kind <= NM_BBQ_LOCK_COHORT; ++lock_kind)
+                {
+                    for(wake_policy = NM_BBQ_WAKE_DEFAULT; wake_policy <= NM_BBQ_WAKE_FIFO; ++wake_policy)
+                    {
+                        config.mode_ = (nm_bbq_mode)mode;
+                        config.lock_kind_ = (nm_bbq_lock_kind)lock_kind;
+                        config.wake_policy_ = (nm_bbq_wake_policy)wake_policy;
+                        config.slots_ = (nm_bbq_slots)slots;
+                        config.has_spill_ = has_spill;
+
+                        /* Skips the configurations that create_ex rejects (see its warnings) */
+                        bbq = stress_create(&config, 1);
+                        if(!bbq)
+                        {
+                            ++skipped;
+                            continue;
+                        }
+                        nm_blocking_bounded_queue_destroy(&bbq, NULL, NULL);
+
+                        if(run_(&config, items_, threads_) == 0)
+                        {
+                            ++passed;
+                        }
+                        else
+                        {
+                            ++failed;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%s: %u configurations passed, %u failed, %u unsupported (skipped)\n", test_, passed, failed, skipped);
+    return failed == 0 && passed > 0 ? 0 : -1;
+}
+
+static void stress_count_left(void* element_, void* callback_context_)
+{
+    (void)element_;
+    ++*(size_t*)callback_context_;
+}
+
+/* --------------------------------------------- End of Stress utils ------------------------------------------- */
+
+
+/* ------------------------------------------- MPMC checksum stress: ------------------------------------------- */
+
+/* Producers put their items with put and put_n, consumers take them with take and take_n - every item must be taken
+   exactly once (count and checksum), in the order of its producer. The consumer that takes the last item closes the
+   queue, which must wake all the other consumers with NM_BBQ_IS_CLOSED - a lost wakeup hangs the test (ctest's timeout) */
+
+typedef struct mpmc_producer
+{
+    nm_blocking_bounded_queue* bbq_;
+    unsigned int id_;
+    size_t items_;
+    size_t put_count_;
+    nm_uint64_t checksum_;
+    nm_bbq_status status_;
+} mpmc_producer;
+
+typedef struct mpmc_consumer
+{
+    nm_blocking_bounded_queue* bbq_;
+    nm_atomic_int_t* taken_total_;
+    size_t items_total_;
+    unsigned int producers_;
+    size_t taken_count_;
+    nm_uint64_t checksum_;
+    size_t next_seq_[STRESS_MAX_THREADS]; /* Of each producer - the items of a producer are taken in its order */
+    int is_corrupted_;
+    nm_bbq_status status_;
+} mpmc_consumer;
+
+static void mpmc_producer_routine(void* args_)
+{
+    mpmc_producer* producer = (mpmc_producer*)args_;
+    void* batch[STRESS_BATCH];
+    size_t seq = 0, count, i;
+    nm_bbq_status status = NM_BBQ_SUCCESS;
+
+    while(seq < producer->items_ && status == NM_BBQ_SUCCESS)
+    {
+        count = (seq % 3 == 0 && producer->items_ - seq >= STRESS_BATCH) ? STRESS_BATCH : 1;
+        for(i = 0; i < count; ++i)
+        {
+            batch[i] = stress_item(producer->id_, seq + i);
+        }
+
+        if(count == 1)
+        {
+            status = nm_blocking_bounded_queue_put(producer->bbq_, batch[0]);
+            count = status == NM_BBQ_SUCCESS ? 1 : 0;
+        }
+        else
+        {
+            status = nm_blocking_bounded_queue_put_n(producer->bbq_, batch, count, &count);
+        }
+
+        for(i = 0; i < count; ++i)
+        {
+            producer->checksum_ += (size_t)batch[i];
+        }
+        seq += count;
+        producer->put_count_ += count;
+    }
+
+    producer->status_ = status;
+}
+
+static void mpmc_consumer_routine(void* args_)
+{
+    mpmc_consumer* consumer = (mpmc_consumer*)args_;
+    void* batch[STRESS_BATCH];
+    size_t count, i, round, value, producer, seq;
+    nm_bbq_status status;
+
+    for(round = 0; ; ++round)
+    {
+        if(round % 2 == 0)
+        {
+            status = nm_blocking_bounded_queue_take(consumer->bbq_, &batch[0]);
+            count = 1;
+        }
+        else
+        {
+            status = nm_blocking_bounded_queue_take_n(consumer->bbq_, batch, STRESS_BATCH, &count);
+        }
+        if(status != NM_BBQ_SUCCESS)
+        {
+            consumer->status_ = status;
+            return;
+        }
+
+        for(i = 0; i < count; ++i)
+        {
+            value = (size_t)batch[i];
+            producer = (value >> STRESS_SEQ_BITS) - 1;
+            seq = value & STRESS_SEQ_MASK;
+            if(producer >= consumer->producers_ || seq < consumer->next_seq_[producer])
+            {
+                consumer->is_corrupted_ = 1;
+            }
+            else
+            {
+                consumer->next_seq_[producer] = seq + 1;
+            }
+            consumer->checksum_ += value;
+        }
+        consumer->taken_count_ += count;
+
+        if((size_t)NM_ATOMIC_INT_FETCH_ADD(consumer->taken_total_, (nm_atomic_int_t)count) + count == consumer->items_total_)
+        {
+            nm_blocking_bounded_queue_close(consumer->bbq_);
+        }
+    }
+}
+
+static int mpmc_run(const stress_config* config_, size_t items_, unsigned int threads_)
+{
+    mpmc_producer producers[STRESS_MAX_THREADS];
+    mpmc_consumer consumers[STRESS_MAX_THREADS];
+    nm_thread_t producer_threads[STRESS_MAX_THREADS], consumer_threads[STRESS_MAX_THREADS];
+    nm_blocking_bounded_queue* bbq = NULL;
+    nm_atomic_int_t taken_total = 0;
+    nm_uint64_t put_checksum = 0, taken_checksum = 0;
+    size_t put_count = 0, taken_count = 0, left = 0;
+    const char* failure = NULL;
+    unsigned int i;
+
+    bbq = stress_create(config_, 64);
+    if(!bbq)
+    {
+        stress_print_config("mpmc", config_, "create_ex failed");
+        return -1;
+    }
+
+    memset(producers, 0, sizeof(producers));
+    memset(consumers, 0, sizeof(consumers));
+    for(i = 0; i < threads_; ++i)
+    {
+        consumers[i].bbq_ = bbq;
+        consumers[i].taken_total_ = &taken_total;
+        consumers[i].items_total_ = items_ * threads_;
+        consumers[i].producers_ = threads_;
+        nm_thread_create(&consumer_threads[i], mpmc_consumer_routine, &consumers[i]);
+    }
+    for(i = 0; i < threads_; ++i)
+    {
+        producers[i].bbq_ = bbq;
+        producers[i].id_ = i;
+        producers[i].items_ = items_;
+        nm_thread_create(&producer_threads[i], mpmc_producer_routine, &producers[i]);
+    }
+
+    for(i = 0; i < threads_; ++i)
+    {
+        nm_thread_join(&producer_threads[i]);
+        put_checksum += producers[i].checksum_;
+        put_count += producers[i].put_count_;
+        if(producers[i].status_ != NM_BBQ_SUCCESS)
+        {
+            failure = "a put failed";
+        }
+    }
+    for(i = 0; i < threads_; ++i)
+    {
+        nm_thread_join(&consumer_threads[i]);
+        taken_checksum += consumers[i].checksum_;
+        taken_count += consumers[i].taken_count_;
+        if(consumers[i].is_corrupted_)
+        {
+            failure = "an item was taken out of its producer's order, or corrupted";
+        }
+        if(consumers[i].status_ != NM_BBQ_IS_CLOSED)
+        {
+            failure = "a consumer stopped with a status other than NM_BBQ_IS_CLOSED";
+        }
+    }
+
+    nm_blocking_bounded_queue_destroy(&bbq, stress_count_left, &left);
+
+    if(!failure && put_count != items_ * threads_)
+    {
+        failure = "not all the items were put";
+    }
+    if(!failure && (taken_count != put_count || left != 0))
+    {
+        failure = "the taken items do not add up to the put items";
+    }
+    if(!failure && taken_checksum != put_checksum)
+    {
+        failure = "checksum mismatch";
+    }
+
+    if(failure)
+    {
+        stress_print_config("mpmc", config_, failure);
+        return -1;
+    }
+    return 0;
+}
+
+static int stress_mpmc(int argc_, char** argv_)
+{
+    size_t items = arg_or_default(argc_, argv_, 2, 20000);
+    unsigned int threads = (unsigned int)arg_or_default(argc_, argv_, 3, 4);
+
+    if(threads == 0 || threads > STRESS_MAX_THREADS || items == 0 || items > STRESS_SEQ_MASK
+       || items * threads > (size_t)0x7FFFFFFF)
+    {
+        fprintf(stderr, "mpmc: threads must be 1-%d, and items 1-%lu\n", STRESS_MAX_THREADS, (unsigned long)STRESS_SEQ_MASK);
+        return -1;
+    }
+
+    return stress_for_each_config("mpmc", mpmc_run, items, threads);
+}
+
+/* ------------------------------------------ End of MPMC checksum stress -------------------------------------- */
+
+
+/* -------------------------------------------- Close stress: -------------------------------------------------- */
+
+/* Takers blocked on an empty queue, and putters blocked on a full one (bounded and without a spill tier), must all
+   return NM_BBQ_IS_CLOSED when the queue is closed - and the items that were put must all reach the destruction policy */
+
+typedef struct close_taker
+{
+    nm_blocking_bounded_queue* bbq_;
+    unsigned int kind_; /* 0 - take, 1 - take_n, 2 - take_timed */
+    nm_bbq_status status_;
+} close_taker;
+
+static void close_taker_routine(void* args_)
+{
+    close_taker* taker = (close_taker*)args_;
+    void* items[STRESS_BATCH];
+    size_t count = 0;
+
+    switch(taker->kind_)
+    {
+    case 0:
+        taker->status_ = nm_blocking_bounded_queue_take(taker->bbq_, &items[0]);
+        break;
+    case 1:
+        taker->status_ = nm_blocking_bounded_queue_take_n(taker->bbq_, items, STRESS_BATCH, &count);
+        break;
+    default:
+        taker->status_ = nm_blocking_bounded_queue_take_timed(taker->bbq_, &items[0], 60000);
+        break;
+    }
+}
+
+static void close_sum_left(void* element_, void* callback_context_)
+{
+    *(nm_uint64_t*)callback_context_ += (size_t)element_;
+}
+
+static int close_run(const stress_config* config_, size_t items_, unsigned int threads_)
+{
+    close_taker takers[STRESS_MAX_THREADS];
+    mpmc_producer producers[STRESS_MAX_THREADS];
+    nm_thread_t threads[STRESS_MAX_THREADS];
+    nm_blocking_bounded_queue* bbq = NULL;
+    nm_uint64_t put_checksum = 0, left_checksum = 0;
+    const char* failure = NULL;
+    unsigned int i;
+
+    /* Takers blocked on an empty queue */
+    bbq = stress_create(config_, 16);
+    if(!bbq)
+    {
+        stress_print_config("close", config_, "create_ex failed");
+        return -1;
+    }
+    for(i = 0; i < threads_; ++i)
+    {
+        takers[i].bbq_ = bbq;
+        takers[i].kind_ = i % 3;
+        takers[i].status_ = NM_BBQ_SUCCESS;
+        nm_thread_create(&threads[i], close_taker_routine, &takers[i]);
+    }
+    stress_sleep_us(10000);
+    nm_blocking_bounded_queue_close(bbq);
+    for(i = 0; i < threads_; ++i)
+    {
+        nm_thread_join(&threads[i]);
+        if(takers[i].status_ != NM_BBQ_IS_CLOSED)
+        {
+            failure = "a blocked taker did not return NM_BBQ_IS_CLOSED on close";
+        }
+    }
+    nm_blocking_bounded_queue_destroy(&bbq, NULL, NULL);
+
+    /* Putters blocked on a full queue (the unbounded queue and the spill tier never block, their puts all succeed) */
+    bbq = stress_create(config_, 16);
+    if(!bbq)
+    {
+        stress_print_config("close", config_, "create_ex failed");
+        return -1;
+    }
+    memset(producers, 0, sizeof(producers));
+    for(i = 0; i < threads_; ++i)
+    {
+        producers[i].bbq_ = bbq;
+        producers[i].id_ = i;
+        producers[i].items_ = items_;
+        nm_thread_create(&threads[i], mpmc_producer_routine, &producers[i]);
+    }
+    stress_sleep_us(10000);
+    nm_blocking_bounded_queue_close(bbq);
+    for(i = 0; i < threads_; ++i)
+    {
+        nm_thread_join(&threads[i]);
+        put_checksum += producers[i].checksum_;
+        if(producers[i].status_ != NM_BBQ_IS_CLOSED
+           && !(producers[i].status_ == NM_BBQ_SUCCESS && producers[i].put_count_ == items_))
+        {
+            failure = "a blocked putter did not return NM_BBQ_IS_CLOSED on close";
+        }
+    }
+    nm_blocking_bounded_queue_destroy(&bbq, close_sum_left, &left_checksum);
+
+    if(!failure && left_checksum != put_checksum)
+    {
+        failure = "the items left for the destruction policy do not add up to the put items";
+    }
+
+    if(failure)
+    {
+        stress_print_config("close", config_, failure);
+        return -1;
+    }
+    return 0;
+}
+
+static int stress_close(int argc_, char** argv_)
+{
+    size_t items = arg_or_default(argc_, argv_, 2, 1000);
+    unsigned int threads = (unsigned int)arg_or_default(argc_, argv_, 3, 4);
+
+    if(threads == 0 || threads > STRESS_MAX_THREADS || items == 0 || items > STRESS_SEQ_MASK)
+    {
+        fprintf(stderr, "close: threads must be 1-%d, and items 1-%lu\n", STRESS_MAX_THREADS, (unsigned long)STRESS_SEQ_MASK);
+        return -1;
+    }
+
+    return stress_for_each_config("close", close_run, items, threads);
+}
+
+/* ---------------------------------------------- End of Close stress ------------------------------------------ */
+
+
+/* -------------------------------------- Epoch reclamation stress: ------------------------------------------- */
+
+/* Writers swap a shared buffer and retire the old one while readers dereference it in their critical regions - a read of
+   a freed buffer finds it poisoned (and is reported by ASan). Every retired buffer must be freed exactly once by the
+   end: the writers exit with retired buffers that are not safe to free yet, so their thread exit hands them over
+   to the orphan list, which the other threads and nm_epoch_synchronize free */
+
+#define EPOCH_MAGIC 0x5EED1234U
+
+typedef struct epoch_buffer
+{
+    nm_epoch_node node_; /* First - the retired node is the buffer */
+    volatile unsigned int magic_;
+} epoch_buffer;
+
+typedef struct epoch_writer
+{
+    size_t retires_;
+    unsigned int kind_; /* epoch_threads: 0 - unregisters itself, 1 - exits registered, 2 - only retires (never enters) */
+} epoch_writer;
+
+static epoch_buffer* epoch_shared;
+static nm_atomic_int_t epoch_allocated;
+static nm_atomic_int_t epoch_freed;
+static nm_atomic_int_t epoch_bad_reads;
+static nm_atomic_int_t epoch_is_stopped;
+
+static void epoch_buffer_free(nm_epoch_node* node_)
+{
+    ((epoch_buffer*)node_)->magic_ = 0; /* Poisons it for a reader that is (wrongly) still there */
+    free(node_);
+    NM_ATOMIC_INT_FETCH_ADD(&epoch_freed, 1);
+}
+
+static epoch_buffer* epoch_buffer_create(void)
+{
+    epoch_buffer* buffer = (epoch_buffer*)malloc(sizeof(epoch_buffer));
+
+    if(buffer)
+    {
+        buffer->magic_ = EPOCH_MAGIC;
+        NM_ATOMIC_INT_FETCH_ADD(&epoch_allocated, 1);
+    }
+    return buffer;
+}
+
+static void epoch_read(void)
+{
+    epoch_buffer* buffer = (epoch_buffer*)NM_ATOMIC_PTR_LOAD(&epoch_shared);
+
+    if(buffer->magic_ != EPOCH_MAGIC)
+    {
+        NM_ATOMIC_INT_FETCH_ADD(&epoch_bad_reads, 1);
+    }
+}
+
+static void epoch_reader_routine(void* args_)
+{
+    (void)args_;
+    while(!NM_ATOMIC_INT_LOAD(&epoch_is_stopped))
+    {
+        if(nm_epoch_enter() != 0)
+        {
+            NM_ATOMIC_INT_FETCH_ADD(&epoch_bad_reads, 1);
+            return;
+        }
+        epoch_read();
+        nm_epoch_exit();
+    }
+}
+
+static void epoch_writer_routine(void* args_)
+{
+    epoch_writer* writer = (epoch_writer*)args_;
+    epoch_buffer* buffer;
+    size_t i;
+
+    for(i = 0; i < writer->retires_; ++i)
+    {
+        buffer = epoch_buffer_create();
+        if(!buffer)
+        {
+            NM_ATOMIC_INT_FETCH_ADD(&epoch_bad_reads, 1);
+            return;
+        }
+
+        if(writer->kind_ != 2 && nm_epoch_enter() == 0)
+        {
+            if(nm_epoch_enter() == 0) /* Nested */
+            {
+                epoch_read();
+                nm_epoch_exit();
+            }
+            nm_epoch_exit();
+        }
+
+        buffer = (epoch_buffer*)NM_ATOMIC_PTR_EXCHANGE(&epoch_shared, buffer);
+        nm_epoch_retire(&buffer->node_, epoch_buffer_free);
+    }
+
+    if(writer->kind_ == 0)
+    {
+        nm_epoch_unregister();
+    }
+}
+
+/* Runs rounds_ rounds of writers_ short-lived writers, with readers_ readers for the whole run */
+static int epoch_run(const char* test_, unsigned int rounds_, unsigned int writers_, unsigned int readers_, size_t retires_)
+{
+    epoch_writer writers[STRESS_MAX_THREADS];
+    nm_thread_t writer_threads[STRESS_MAX_THREADS], reader_threads[STRESS_MAX_THREADS];
+    unsigned int round, i;
+    int retired;
+
+    NM_ATOMIC_INT_STORE(&epoch_allocated, 0);
+    NM_ATOMIC_INT_STORE(&epoch_freed, 0);
+    NM_ATOMIC_INT_STORE(&epoch_bad_reads, 0);
+    NM_ATOMIC_INT_STORE(&epoch_is_stopped, 0);
+    epoch_shared = epoch_buffer_create();
+    if(!epoch_shared)
+    {
+        fprintf(stderr, "%s: FAILED: allocation\n", test_);
+        return -1;
+    }
+
+    for(i = 0; i < readers_; ++i)
+    {
+        nm_thread_create(&reader_threads[i], epoch_reader_routine, NULL);
+    }
+
+    for(round = 0; round < rounds_; ++round)
+    {
+        for(i = 0; i < writers_; ++i)
+        {
+            writers[i].retires_ = retires_;
+            writers[i].kind_ = rounds_ > 1 ? (round + i) % 3 : 1;
+            nm_thread_create(&writer_threads[i], epoch_writer_routine, &writers[i]);
+        }
+        for(i = 0; i < writers_; ++i)
+        {
+            nm_thread_join(&writer_threads[i]);
+        }
+    }
+
+    NM_ATOMIC_INT_STORE(&epoch_is_stopped, 1);
+    for(i = 0; i < readers_; ++i)
+    {
+        nm_thread_join(&reader_threads[i]);
+    }
+
+    nm_epoch_synchronize(); /* Frees the orphans of the exited threads */
+    retired = NM_ATOMIC_INT_LOAD(&epoch_allocated) - 1;
+    printf("%s: %d buffers retired, %d freed, %d bad reads\n", test_, retired, NM_ATOMIC_INT_LOAD(&epoch_freed),
+           NM_ATOMIC_INT_LOAD(&epoch_bad_reads));
+
+    free(epoch_shared);
+    if(NM_ATOMIC_INT_LOAD(&epoch_bad_reads) != 0 || NM_ATOMIC_INT_LOAD(&epoch_freed) != retired)
+    {
+        fprintf(stderr, "%s: FAILED: a reader saw a freed buffer, or not every retired buffer was freed exactly once\n", test_);
+        return -1;
+    }
+    return 0;
+}
+
+static int stress_epoch(int argc_, char** argv_)
+{
+    unsigned int writers = (unsigned int)arg_or_default(argc_, argv_, 2, 2);
+    unsigned int readers = (unsigned int)arg_or_default(argc_, argv_, 3, 4);
+    size_t retires = arg_or_default(argc_, argv_, 4, 200000);
+
+    if(writers == 0 || writers > STRESS_MAX_THREADS || readers > STRESS_MAX_THREADS || writers * retires > (size_t)0x7FFFFFFE)
+    {
+        fprintf(stderr, "epoch: writers must be 1-%d, and readers 0-%d\n", STRESS_MAX_THREADS, STRESS_MAX_THREADS);
+        return -1;
+    }
+
+    return epoch_run("epoch", 1, writers, readers, retires);
+}
+
+/* Thread churn: every round's writers are new threads (the records of the exited ones are reused), that unregister
+   themselves, exit registered (the thread exit hook) or only retire (registered by nm_epoch_retire) */
+static int stress_epoch_threads(int argc_, char** argv_)
+{
+    unsigned int rounds = (unsigned int)arg_or_default(argc_, argv_, 2, 50);
+    unsigned int writers = (unsigned int)arg_or_default(argc_, argv_, 3, 6);
+    size_t retires = arg_or_default(argc_, argv_, 4, 1000);
+
+    if(rounds == 0 || writers == 0 || writers > STRESS_MAX_THREADS || (size_t)rounds * writers * retires > (size_t)0x7FFFFFFE)
+    {
+        fprintf(stderr, "epoch_threads: rounds must be positive, and writers 1-%d\n", STRESS_MAX_THREADS);
+        return -1;
+    }
+
+    return epoch_run("epoch_threads", rounds, writers, 2, retires);
+}
+
+/* --------------------------------------- End of Epoch reclamation stress ------------------------------------- */
+
+
+/* --------------------------------------- Unbounded queue churn stress: --------------------------------------- */
+
+/* The MPMC checksum run on an unbounded queue of small segments, with new threads every round - the segments that the
+   takers retire are left to the epoch reclamation of threads that exit, and destroy frees the rest (a leak is reported
+   by ASan's leak checker) */
+
+static int stress_unbounded(int argc_, char** argv_)
+{
+    unsigned int rounds = (unsigned int)arg_or_default(argc_, argv_, 2, 20);
+    size_t items = arg_or_default(argc_, argv_, 3, 5000);
+    unsigned int threads = (unsigned int)arg_or_default(argc_, argv_, 4, 4);
+    stress_config config;
+    unsigned int round;
+
+    if(threads == 0 || threads > STRESS_MAX_THREADS || items == 0 || items > STRESS_SEQ_MASK
+       || items * threads > (size_t)0x7FFFFFFF)
+    {
+        fprintf(stderr, "unbounded: threads must be 1-%d, and items 1-%lu\n", STRESS_MAX_THREADS, (unsigned long)STRESS_SEQ_MASK);
+        return -1;
+    }
+
+    config.mode_ = NM_BBQ_MODE_UNBOUNDED;
+    config.lock_kind_ = NM_BBQ_LOCK_MUTEX;
+    config.wake_policy_ = NM_BBQ_WAKE_DEFAULT;
+    config.slots_ = NM_BBQ_SLOTS_POINTER;
+    config.has_spill_ = 0;
+    for(round = 0; round < rounds; ++round)
+    {
+        if(mpmc_run(&config, items, threads) != 0)
+        {
+            return -1;
+        }
+    }
+
+    nm_epoch_synchronize(); /* Frees the segments that the exited threads left */
+    printf("unbounded: %u rounds passed\n", rounds);
+    return 0;
+}
+
+/* ------------------------------------- End of Unbounded queue churn stress ----------------------------------- */
+
+
+typedef struct stress_entry
+{
+    const char* name_;
+    int (*run_)(int argc_, char** argv_);
+    const char* usage_;
+} stress_entry;
+
+static const stress_entry tests[] =
+{
+    {"mpmc", stress_mpmc, "mpmc [items_per_producer=20000] [producers_and_consumers=4]"}
+    ,{"close", stress_close, "close [items_per_producer=1000] [threads=4]"}
+    ,{"epoch", stress_epoch, "epoch [writers=2] [readers=4] [retires_per_writer=200000]"}
+    ,{"epoch_threads", stress_epoch_threads, "epoch_threads [rounds=50] [writers=6] [retires_per_writer=1000]"}
+    ,{"unbounded", stress_unbounded, "unbounded [rounds=20] [items_per_producer=5000] [producers_and_consumers=4]"}
+};
+
+int main(int argc, char** argv)
+{
+    size_t i;
+    int result = 0;
+
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+    {
+        if(argc < 2 || strcmp(argv[1], tests[i].name_) == 0)
+        {
+            result |= tests[i].run_(argc, argv);
+            if(argc >= 2)
+            {
+                return result == 0 ? 0 : 1;
+            }
+        }
+    }
+
+    if(argc >= 2)
+    {
+        fprintf(stderr, "Unknown test: %s\nAvailable tests:\n", argv[1]);
+        for(i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+        {
+            fprintf(stderr, "    %s\n", tests[i].usage_);
+        }
+        return 1;
+    }
+
+    return result == 0 ? 0 : 1;
+}